@@ -0,0 +1,322 @@
+/*
+ * Pied Piper compression library
+ *
+ * Public interface of the native engine (libpiedpiper):
+ * - One-shot compression of v5 frames, and reusable contexts for hot paths
+ * - Linked blocks with windows up to 128MB for large, repetitive inputs
+ * - Raw prefix dictionaries for small, similar messages
+ * - Streaming compression from FILE handles, with adaptive levels
+ * - Frame inspection and parallel integrity checks
+ * - Multi-file .ppa archives
+ * - In-place upgrade of legacy (v1-v4) .pp files
+ * - The web app's password envelope (AES-256-GCM), sealed and opened natively
+ * - The local compression service (serve) and its client
+ *
+ * Functions returning int give 0 on success or a negative PP_ERROR_* code.
+ * Contexts and decoders are not thread-safe; use one per thread.
+ * Dictionaries are read-only once created and may be shared.
+ */
+
+#ifndef PIEDPIPER_H
+#define PIEDPIPER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PP_VERSION_MAJOR 2
+#define PP_VERSION_MINOR 0
+#define PP_VERSION_PATCH 0
+#define PP_VERSION "2.0.0"
+
+// Exported symbols; the library is built with -fvisibility=hidden
+#if defined(__GNUC__)
+#define PP_API __attribute__((visibility("default")))
+#else
+#define PP_API
+#endif
+
+// Error codes
+#define PP_OK 0
+#define PP_ERROR_INVALID -1                 // Bad arguments, unknown format, I/O or memory
+#define PP_ERROR_BUFFER -2                  // Output too small; *output_size holds the need
+#define PP_ERROR_CHECKSUM -3
+#define PP_ERROR_CORRUPT -4
+#define PP_ERROR_DICTIONARY -5              // Frame needs a dictionary that was not given
+#define PP_ERROR_ENCRYPTED -6               // Encrypted by the web app; cannot be read as is
+
+// Level above the LZ range (1-9): context-mixing blocks for archival (--max)
+#define PP_LEVEL_MAX 10
+// Fast levels below it (--fast=N is level -N): single-probe parse that
+// skips harder as N grows, raw literals
+#define PP_LEVEL_FAST_MAX 10
+
+// Filters (PP_Options.filters, frame header byte 16)
+#define PP_FILTER_TEXT 0x01                 // Structured-text tokenizer
+
+// Per-content pipelines (PP_Options.strategy, frame header byte 17)
+#define PP_STRATEGY_AUTO 0                  // Pick from the detected file type
+#define PP_STRATEGY_GENERIC 1
+#define PP_STRATEGY_TEXT 2
+#define PP_STRATEGY_STORED 3
+#define PP_STRATEGY_COUNT 4
+
+// File types from content detection (frame header byte 6)
+#define PP_FILETYPE_BINARY 0
+#define PP_FILETYPE_PNG 1
+#define PP_FILETYPE_JPEG 2
+#define PP_FILETYPE_GIF 3
+#define PP_FILETYPE_ZIP 4
+#define PP_FILETYPE_PDF 5
+#define PP_FILETYPE_GZIP 6
+#define PP_FILETYPE_PACKED 7                // bzip2, xz, zstd, 7z
+#define PP_FILETYPE_TEXT 10
+
+// v5 frame header; the first block header follows it
+#define PP_FRAME_HEADER_SIZE 24
+
+// Frame flags (frame header byte 4, PP_FrameInfo.flags)
+#define PP_FRAME_BLOCK_CHECKSUM 0x01        // xxh32 of each block's raw bytes
+#define PP_FRAME_STORED_CHECKSUM 0x02       // u32 xxh32 of header + stored bytes after each block
+#define PP_FRAME_SEEK_INDEX 0x04            // End block carries a seek index
+#define PP_FRAME_LINKED 0x08                // LZ blocks match into earlier blocks (byte 3: window log)
+
+// Linked-block window (PP_Options.window_log)
+#define PP_WINDOW_LOG_MIN 15
+#define PP_WINDOW_LOG_MAX 27                // 128MB
+
+// Password envelope: flag byte, header and per-segment tag sizes
+#define PP_ENVELOPE_FLAG 0x02
+#define PP_ENVELOPE_HEADER_SIZE 32
+#define PP_ENVELOPE_TAG_SIZE 16
+
+// Service operations (pp_serve_call)
+#define PP_SERVE_OP_COMPRESS 1
+#define PP_SERVE_OP_DECOMPRESS 2
+
+// Compression options
+typedef struct {
+    int8_t level;             // 1-9, PP_LEVEL_MAX, or -1 to -PP_LEVEL_FAST_MAX
+    uint32_t filters;         // PP_FILTER_* bits to try on suitable blocks
+    uint8_t strategy;         // PP_STRATEGY_*; AUTO picks from the file type
+    uint8_t adaptive_min;     // Streaming: level range per block; 0 = fixed level
+    uint8_t adaptive_max;
+    uint8_t window_log;       // One-shot: link blocks over a 2^window_log window; 0 = off
+} PP_Options;
+
+// Statistics for one compressed frame
+typedef struct {
+    uint64_t input_size;
+    uint64_t output_size;
+    uint8_t file_type;
+    uint8_t strategy;
+    int8_t level;
+    uint32_t filters;
+    uint32_t blocks;
+    uint32_t matches_found;
+    uint32_t routes[3];       // Blocks stored, on the fast path, on the strong path
+    uint32_t rle_blocks;
+    uint32_t cm_blocks;
+    uint32_t filtered_blocks;
+    uint32_t levels[PP_LEVEL_MAX + 1];  // Adaptive mode: blocks per level
+} PP_Stats;
+
+// Header and layout of a .pp file (pp_frame_info)
+typedef struct {
+    uint8_t version;
+    uint8_t flags;            // PP_FRAME_* bits
+    int8_t level;
+    uint8_t file_type;
+    uint8_t strategy;
+    uint8_t filters;
+    uint8_t block_log;
+    uint8_t has_index;        // Blocks came from the seek index
+    uint32_t dict_id;         // 0 if no dictionary
+    uint32_t blocks;
+    uint64_t content_size;
+    uint64_t compressed_size;
+    uint8_t window_log;       // Linked frames: history a decoder keeps (log2), else 0
+} PP_FrameInfo;
+
+typedef struct {
+    uint32_t span;            // Block header + stored bytes + trailer
+    uint32_t raw_size;
+} PP_SeekEntry;
+
+// Outcome of pp_verify
+typedef struct {
+    uint32_t blocks;
+    uint32_t decoded;         // Blocks fully decoded (the rest: stored checksum only)
+    uint64_t content_size;
+    uint32_t bad_block;       // First failing block when the result is not 0
+    uint64_t bad_offset;      // Its header position in the frame
+} PP_VerifyResult;
+
+// Archive totals; after extraction, the files written and groups decoded
+typedef struct {
+    uint32_t files;
+    uint32_t groups;
+    uint64_t content_size;
+    uint64_t stored_size;
+} PP_ArchiveInfo;
+
+// One archived file (pp_archive_info)
+typedef struct {
+    const char *path;         // Relative, '/'-separated
+    uint64_t size;
+    uint64_t mtime;
+    uint32_t mode;
+} PP_ArchiveFile;
+
+// Outcome of pp_upgrade for one file
+typedef struct {
+    int result;               // 0 or a PP_ERROR_* code
+    uint8_t from_version;     // Format found; files already at 5 are left as they are
+    uint64_t content_size;
+    uint64_t old_size;
+    uint64_t new_size;
+} PP_UpgradeResult;
+
+typedef struct PP_Context PP_Context;
+typedef struct PP_Decoder PP_Decoder;
+typedef struct PP_Dict PP_Dict;
+
+PP_API const char* pp_version(void);
+
+/* One-shot compression */
+
+// Worst-case compressed size for an input of the given size
+PP_API uint32_t pp_compress_bound(uint32_t input_size);
+PP_API int pp_compress(const uint8_t *input, uint32_t input_size,
+                       uint8_t *output, uint32_t *output_size, int8_t level);
+PP_API int pp_compress_ex(const uint8_t *input, uint32_t input_size,
+                          uint8_t *output, uint32_t *output_size, const PP_Options *options);
+PP_API int pp_compress_dict(const uint8_t *input, uint32_t input_size,
+                            uint8_t *output, uint32_t *output_size,
+                            const PP_Options *options, const PP_Dict *dict);
+
+// Decompressed size recorded in a .pp header (0 if unknown or invalid)
+PP_API uint64_t pp_get_decompressed_size(const uint8_t *input, uint32_t input_size);
+PP_API int pp_decompress(const uint8_t *input, uint32_t input_size,
+                         uint8_t *output, uint32_t *output_size);
+// Length of the frame at the start of input, for splitting a stream of
+// concatenated frames. Returns PP_ERROR_BUFFER while input holds too little
+// of it, with *frame_size set to how much to read before calling again.
+PP_API int pp_frame_size(const uint8_t *input, uint32_t input_size, uint64_t *frame_size);
+PP_API int pp_decompress_dict(const uint8_t *input, uint32_t input_size,
+                              uint8_t *output, uint32_t *output_size, const PP_Dict *dict);
+
+/* Reusable contexts: tables are allocated once and kept warm across calls */
+
+PP_API PP_Context* pp_context_create(void);
+PP_API void pp_context_free(PP_Context *ctx);
+PP_API void pp_context_set_dict(PP_Context *ctx, const PP_Dict *dict);
+// Blocks of unlinked frames compress on up to threads threads (default 1)
+PP_API void pp_context_set_threads(PP_Context *ctx, int threads);
+// stats may be NULL
+PP_API int pp_compress_ctx(PP_Context *ctx, const uint8_t *input, uint32_t input_size,
+                           uint8_t *output, uint32_t *output_size,
+                           const PP_Options *options, PP_Stats *stats);
+
+PP_API PP_Decoder* pp_decoder_create(void);
+PP_API void pp_decoder_free(PP_Decoder *dec);
+PP_API void pp_decoder_set_dict(PP_Decoder *dec, const PP_Dict *dict);
+PP_API int pp_decompress_ctx(PP_Decoder *dec, const uint8_t *input, uint32_t input_size,
+                             uint8_t *output, uint32_t *output_size);
+
+/* Dictionaries: only the last 32KB of the content is used */
+
+PP_API PP_Dict* pp_dict_create(const uint8_t *data, uint32_t size);
+PP_API PP_Dict* pp_dict_load(const char *path);
+PP_API void pp_dict_free(PP_Dict *dict);
+// Nonzero id stored in frames written with the dictionary
+PP_API uint32_t pp_dict_id(const PP_Dict *dict);
+
+/* Streaming */
+
+// Compress size bytes from in into out as one frame, block by block. With
+// options->adaptive_max set, each block's level follows how fast out drains.
+// Blocks are not linked: options->window_log must be 0 (PP_ERROR_INVALID).
+PP_API int pp_compress_stream(FILE *in, uint64_t size, FILE *out, const PP_Options *options,
+                              const PP_Dict *dict, PP_Stats *stats);
+
+/* Inspection and integrity */
+
+// Header and seek index only; entries (optional, freed with free()) gets
+// the block layout
+PP_API int pp_frame_info(const char *path, PP_FrameInfo *info, PP_SeekEntry **entries);
+// Check a frame on up to threads threads; quick trusts stored-byte checksums
+PP_API int pp_verify(const uint8_t *input, uint64_t input_size, const PP_Dict *dict,
+                     int quick, int threads, PP_VerifyResult *res);
+// Same for a .pp or .ppa file, mapped rather than read
+PP_API int pp_verify_file(const char *path, const PP_Dict *dict, int quick, int threads,
+                          PP_VerifyResult *res);
+PP_API int pp_cpu_count(void);
+
+// Strategy name ("auto", "generic", "text", "stored") and back (-1 if unknown)
+PP_API const char* pp_strategy_name(uint8_t strategy);
+PP_API int pp_strategy_from_name(const char *name);
+
+/* Archives (.ppa) */
+
+// info (optional) receives the totals of the new archive
+PP_API int pp_archive_create(const char *archive_path, const char *source,
+                             const PP_Options *options, int threads, PP_ArchiveInfo *info);
+// Extract everything, or only the given paths (and directories)
+PP_API int pp_archive_extract(const char *archive_path, const char *dest,
+                              char **names, int name_count, int threads, PP_ArchiveInfo *info);
+PP_API int pp_archive_test(const char *archive_path, int quick, int threads,
+                           PP_VerifyResult *res);
+// Index only; files (optional) is one allocation, freed with free()
+PP_API int pp_archive_info(const char *archive_path, PP_ArchiveInfo *info,
+                           PP_ArchiveFile **files);
+
+/* Upgrade of legacy files */
+
+// Rewrite v1-v4 .pp files (including the web app's, behind its flag byte)
+// in place as v5 frames with the given options. Decoding streams through a
+// small window, so memory does not grow with file size. Files run in
+// parallel, and a file's blocks take the threads left over. results gets
+// one entry per path; returns 0 if all of them succeeded.
+PP_API int pp_upgrade(char **paths, int count, const PP_Options *options, int threads,
+                      PP_UpgradeResult *results);
+
+/* Password envelope */
+
+// Same bytes as the web app's encryptEnvelope: 256KB segments, each sealed
+// with AES-256-GCM under a PBKDF2-HMAC-SHA256 key. Segments run on up to
+// threads threads, with AES-NI and PCLMULQDQ when the CPU has them.
+PP_API uint64_t pp_envelope_bound(uint64_t input_size);
+// iterations 0 picks the default (600000)
+PP_API int pp_envelope_seal(const uint8_t *input, uint64_t input_size,
+                            uint8_t *output, uint64_t *output_size,
+                            const char *password, uint32_t iterations, int threads);
+// Plaintext size of an envelope, or a negative PP_ERROR_* code
+PP_API int64_t pp_envelope_content_size(const uint8_t *input, uint64_t input_size);
+// PP_ERROR_CHECKSUM for a wrong password or a tampered file; output is
+// then cleared
+PP_API int pp_envelope_open(const uint8_t *input, uint64_t input_size,
+                            uint8_t *output, uint64_t *output_size,
+                            const char *password, int threads);
+
+/* Compression service */
+
+// Serve requests on a Unix socket until SIGINT or SIGTERM
+PP_API int pp_serve(const char *socket_path, const PP_Options *options,
+                    PP_Dict **dicts, int dict_count, int threads);
+// Connect to a serve socket; returns the descriptor or -1
+PP_API int pp_serve_connect(const char *socket_path);
+// One round trip; *reply (freed with free()) receives the payload. Returns
+// the server's status, or PP_ERROR_INVALID if the connection failed.
+PP_API int pp_serve_call(int fd, uint8_t op, int8_t level, uint32_t dict_id,
+                         const uint8_t *data, uint32_t size,
+                         uint8_t **reply, uint32_t *reply_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PIEDPIPER_H */
@@ -0,0 +1,360 @@
+/*
+ * Pied Piper compression library - C++ interface
+ *
+ * Header-only layer over piedpiper.h (C++17; std::span under C++20):
+ * - Compressor / Decompressor own a reusable context and are move-only
+ * - Buffer calls write into caller-provided memory and return the size used
+ * - Dictionary owns a loaded prefix dictionary
+ * - CompressBuf / DecompressBuf adapt a std::streambuf for streaming
+ *
+ * Failures throw piedpiper::Error carrying the PP_ERROR_* code.
+ */
+
+#ifndef PIEDPIPER_HPP
+#define PIEDPIPER_HPP
+
+#include "piedpiper.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+namespace piedpiper {
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+template <class T>
+using span = std::span<T>;
+#else
+// Minimal stand-in for std::span before C++20
+template <class T>
+class span {
+public:
+    constexpr span() noexcept = default;
+    constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+    template <class C, class = decltype(std::declval<C&>().data())>
+    constexpr span(C &c) noexcept : data_(c.data()), size_(c.size()) {}
+
+    constexpr T* data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T* begin() const noexcept { return data_; }
+    constexpr T* end() const noexcept { return data_ + size_; }
+    constexpr T& operator[](std::size_t i) const noexcept { return data_[i]; }
+
+private:
+    T *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+#endif
+
+class Error : public std::runtime_error {
+public:
+    explicit Error(int code) : std::runtime_error(describe(code)), code_(code) {}
+    int code() const noexcept { return code_; }
+
+    static const char* describe(int code) noexcept {
+        switch (code) {
+            case PP_ERROR_BUFFER: return "piedpiper: output buffer too small";
+            case PP_ERROR_CHECKSUM: return "piedpiper: checksum mismatch";
+            case PP_ERROR_CORRUPT: return "piedpiper: corrupt data";
+            case PP_ERROR_DICTIONARY: return "piedpiper: frame needs its dictionary";
+            case PP_ERROR_ENCRYPTED: return "piedpiper: encrypted input";
+            default: return "piedpiper: invalid input or arguments";
+        }
+    }
+
+private:
+    int code_;
+};
+
+namespace detail {
+
+inline void check(int code) {
+    if (code != PP_OK) throw Error(code);
+}
+
+// The C interface takes 32-bit sizes
+inline std::uint32_t size32(std::size_t size) {
+    if (size > UINT32_MAX) throw Error(PP_ERROR_INVALID);
+    return static_cast<std::uint32_t>(size);
+}
+
+inline const std::uint8_t* bytes(const void *p) { return static_cast<const std::uint8_t*>(p); }
+inline std::uint8_t* bytes(void *p) { return static_cast<std::uint8_t*>(p); }
+
+struct ContextDelete { void operator()(PP_Context *p) const noexcept { pp_context_free(p); } };
+struct DecoderDelete { void operator()(PP_Decoder *p) const noexcept { pp_decoder_free(p); } };
+struct DictDelete { void operator()(PP_Dict *p) const noexcept { pp_dict_free(p); } };
+
+} // namespace detail
+
+struct Options : PP_Options {
+    Options(std::int8_t level = 6, std::uint8_t strategy = PP_STRATEGY_AUTO, std::uint32_t filters = 0)
+        : PP_Options{level, filters, strategy, 0, 0, 0} {}
+};
+
+// Worst-case compressed size, for sizing output buffers
+inline std::size_t compress_bound(std::size_t input_size) {
+    return pp_compress_bound(detail::size32(input_size));
+}
+
+// Original size recorded in a frame header (0 if unknown)
+inline std::uint64_t content_size(span<const std::uint8_t> frame) {
+    return pp_get_decompressed_size(frame.data(), detail::size32(frame.size()));
+}
+
+// Raw prefix dictionary; must outlive the compressors and decompressors using it
+class Dictionary {
+public:
+    Dictionary(const void *data, std::size_t size)
+        : dict_(pp_dict_create(detail::bytes(data), detail::size32(size))) {
+        if (!dict_) throw std::bad_alloc();
+    }
+    explicit Dictionary(std::string_view data) : Dictionary(data.data(), data.size()) {}
+
+    static Dictionary load(const std::string &path) {
+        PP_Dict *dict = pp_dict_load(path.c_str());
+        if (!dict) throw Error(PP_ERROR_INVALID);
+        return Dictionary(dict);
+    }
+
+    std::uint32_t id() const noexcept { return pp_dict_id(dict_.get()); }
+    const PP_Dict* get() const noexcept { return dict_.get(); }
+
+private:
+    explicit Dictionary(PP_Dict *dict) : dict_(dict) {}
+    std::unique_ptr<PP_Dict, detail::DictDelete> dict_;
+};
+
+// Reusable compression context. Each call writes one complete frame.
+class Compressor {
+public:
+    explicit Compressor(const Options &options = Options(), const Dictionary *dict = nullptr)
+        : ctx_(pp_context_create()), options_(options) {
+        if (!ctx_) throw std::bad_alloc();
+        set_dictionary(dict);
+    }
+
+    void set_options(const Options &options) noexcept { options_ = options; }
+    const Options& options() const noexcept { return options_; }
+    void set_dictionary(const Dictionary *dict) noexcept {
+        pp_context_set_dict(ctx_.get(), dict ? dict->get() : nullptr);
+    }
+    // Blocks of unlinked frames on up to threads threads (default 1)
+    void set_threads(int threads) noexcept { pp_context_set_threads(ctx_.get(), threads); }
+
+    // Compress into out and return the bytes written; out.size() of
+    // compress_bound(in.size()) always suffices
+    std::size_t compress(span<const std::uint8_t> in, span<std::uint8_t> out) {
+        return compress(in.data(), in.size(), out.data(), out.size());
+    }
+    std::size_t compress(std::string_view in, span<char> out) {
+        return compress(in.data(), in.size(), out.data(), out.size());
+    }
+    std::size_t compress(const void *in, std::size_t in_size, void *out, std::size_t out_size) {
+        std::uint32_t n = detail::size32(out_size);
+        detail::check(pp_compress_ctx(ctx_.get(), detail::bytes(in), detail::size32(in_size),
+                                      detail::bytes(out), &n, &options_, &stats_));
+        return n;
+    }
+
+    // Statistics of the last frame
+    const PP_Stats& stats() const noexcept { return stats_; }
+    PP_Context* get() const noexcept { return ctx_.get(); }
+
+private:
+    std::unique_ptr<PP_Context, detail::ContextDelete> ctx_;
+    Options options_;
+    PP_Stats stats_ = {};
+};
+
+// Reusable decoder: scratch buffers and model state persist across frames
+class Decompressor {
+public:
+    explicit Decompressor(const Dictionary *dict = nullptr) : dec_(pp_decoder_create()) {
+        if (!dec_) throw std::bad_alloc();
+        set_dictionary(dict);
+    }
+
+    void set_dictionary(const Dictionary *dict) noexcept {
+        pp_decoder_set_dict(dec_.get(), dict ? dict->get() : nullptr);
+    }
+
+    // Decompress one frame into out and return the bytes written;
+    // out.size() of content_size(in) suffices
+    std::size_t decompress(span<const std::uint8_t> in, span<std::uint8_t> out) {
+        return decompress(in.data(), in.size(), out.data(), out.size());
+    }
+    std::size_t decompress(std::string_view in, span<char> out) {
+        return decompress(in.data(), in.size(), out.data(), out.size());
+    }
+    std::size_t decompress(const void *in, std::size_t in_size, void *out, std::size_t out_size) {
+        std::uint32_t n = detail::size32(out_size);
+        detail::check(pp_decompress_ctx(dec_.get(), detail::bytes(in), detail::size32(in_size),
+                                        detail::bytes(out), &n));
+        return n;
+    }
+
+    PP_Decoder* get() const noexcept { return dec_.get(); }
+
+private:
+    std::unique_ptr<PP_Decoder, detail::DecoderDelete> dec_;
+};
+
+// Output streambuf: bytes written to it are compressed in chunks, each a
+// complete frame, and written to sink. sync() (std::flush) ends the current
+// frame early; the last frame is written by close() or the destructor.
+class CompressBuf : public std::streambuf {
+public:
+    explicit CompressBuf(std::streambuf &sink, Compressor compressor = Compressor(),
+                         std::size_t chunk_size = 1u << 20)
+        : sink_(&sink), compressor_(std::move(compressor)),
+          in_(chunk_size ? chunk_size : 1), out_(compress_bound(in_.size())) {
+        setp(in_.data(), in_.data() + in_.size());
+    }
+    CompressBuf(const CompressBuf&) = delete;
+    CompressBuf& operator=(const CompressBuf&) = delete;
+
+    ~CompressBuf() override {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+
+    // Write the pending frame; further output starts a new one
+    void close() {
+        if (sink_ && write_frame() != 0) throw Error(PP_ERROR_INVALID);
+    }
+
+    Compressor& compressor() noexcept { return compressor_; }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (write_frame() != 0) return traits_type::eof();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+        if (write_frame() != 0) return -1;
+        return sink_->pubsync();
+    }
+
+private:
+    int write_frame() {
+        std::size_t pending = static_cast<std::size_t>(pptr() - pbase());
+        if (pending == 0) return 0;
+        setp(in_.data(), in_.data() + in_.size());
+
+        std::size_t n;
+        try {
+            n = compressor_.compress(in_.data(), pending, out_.data(), out_.size());
+        } catch (const Error&) {
+            return -1;
+        }
+        std::streamsize want = static_cast<std::streamsize>(n);
+        return sink_->sputn(out_.data(), want) == want ? 0 : -1;
+    }
+
+    std::streambuf *sink_;
+    Compressor compressor_;
+    std::vector<char> in_;
+    std::vector<char> out_;
+};
+
+// Input streambuf: reads concatenated frames from source and yields the
+// decompressed bytes, holding one frame at a time.
+class DecompressBuf : public std::streambuf {
+public:
+    explicit DecompressBuf(std::streambuf &source, Decompressor decompressor = Decompressor())
+        : source_(&source), decompressor_(std::move(decompressor)) {
+        setg(nullptr, nullptr, nullptr);
+    }
+    DecompressBuf(const DecompressBuf&) = delete;
+    DecompressBuf& operator=(const DecompressBuf&) = delete;
+
+    // Error code of the frame that ended the stream early, or PP_OK
+    int error() const noexcept { return error_; }
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        if (!next_frame()) return traits_type::eof();
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    // Read exactly n more bytes of the current frame; false at end of input
+    bool fill(std::size_t n) {
+        std::size_t have = frame_.size();
+        frame_.resize(have + n);
+        std::streamsize got = source_->sgetn(reinterpret_cast<char*>(frame_.data()) + have,
+                                             static_cast<std::streamsize>(n));
+        frame_.resize(have + static_cast<std::size_t>(got > 0 ? got : 0));
+        return static_cast<std::size_t>(got) == n;
+    }
+
+    bool next_frame() {
+        if (error_ != PP_OK) return false;
+        frame_.clear();
+
+        // Read block headers until the frame length is known
+        std::uint64_t need = 0;
+        int r;
+        while ((r = pp_frame_size(frame_.data(), detail::size32(frame_.size()), &need)) == PP_ERROR_BUFFER) {
+            if (!fill(static_cast<std::size_t>(need - frame_.size()))) {
+                if (!frame_.empty()) error_ = PP_ERROR_CORRUPT;
+                return false;
+            }
+        }
+        if (r != PP_OK || need > UINT32_MAX) {
+            error_ = r != PP_OK ? r : PP_ERROR_INVALID;
+            return false;
+        }
+        if (need > frame_.size() && !fill(static_cast<std::size_t>(need - frame_.size()))) {
+            error_ = PP_ERROR_CORRUPT;
+            return false;
+        }
+
+        std::uint64_t size = content_size(frame_);
+        if (size > UINT32_MAX) {
+            error_ = PP_ERROR_INVALID;
+            return false;
+        }
+        out_.resize(size ? static_cast<std::size_t>(size) : 1);
+        try {
+            std::size_t n = decompressor_.decompress(frame_.data(), frame_.size(), out_.data(), out_.size());
+            setg(out_.data(), out_.data(), out_.data() + n);
+        } catch (const Error &e) {
+            error_ = e.code();
+            return false;
+        }
+        return egptr() > gptr() || next_frame();
+    }
+
+    std::streambuf *source_;
+    Decompressor decompressor_;
+    std::vector<std::uint8_t> frame_;
+    std::vector<char> out_;
+    int error_ = PP_OK;
+};
+
+} // namespace piedpiper
+
+#endif /* PIEDPIPER_HPP */
@@ -3,18 +3,52 @@
  * High-performance hybrid compression engine
  *
  * Features:
- * - Optimized LZ77 with extended search windows
- * - Adaptive Huffman coding
- * - Multi-pass analysis for maximum compression
- * - Type-specific optimizations
+ * - Block-based frame format (v5) with per-block checksums
+ * - Per-block compressibility estimator routing to store/fast/strong paths
+ * - Optimized LZ77 with hash chains and lazy matching
+ * - Suffix-array match finder and price-based optimal parsing (levels 8-9)
+ * - Canonical Huffman coding of literals and sequence codes
+ * - Context-mixing arithmetic coder for archival blocks (--max)
+ * - Backward-compatible decoding of v1 files and browser-made v2-v4 files
+ * - Multi-file .ppa archives compressed and extracted in parallel
+ * - The web app's AES-256-GCM password envelope (AES-NI/PCLMULQDQ when present)
+ *
+ * Public interface: piedpiper.h (libpiedpiper). The command-line tool is
+ * ppcompress.c.
  */
 
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "piedpiper.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Worker threads for archives; emscripten builds stay single-threaded
+#if !defined(__EMSCRIPTEN__) && !defined(PP_NO_THREADS)
+#include <pthread.h>
+#define PP_HAVE_THREADS 1
+#endif
 
-#define PP_VERSION "1.0.0"
 #define PP_MAGIC 0x5050  // "PP" in hex
 #define MAX_WINDOW_SIZE 32768
 #define MAX_LOOKAHEAD 258
@@ -23,7 +57,84 @@
 #define HASH_SIZE (1 << HASH_BITS)
 #define HASH_MASK (HASH_SIZE - 1)
 
-// Pied Piper file header
+// Hash chains size their head table per block, about one slot per
+// position, between these bounds and the level's limit. Dictionaries are
+// prehashed with HASH_BITS.
+#define PP_HASH_LOG_MIN 10
+#define PP_HASH_LOG_MAX 17
+
+// Row match finder: each hash row holds its 32 most recent positions (two
+// cache lines) and their 8-bit tags (half a line), searched newest first.
+// Small blocks use fewer rows.
+#define PP_ROW_LOG 10
+#define PP_ROW_COUNT (1 << PP_ROW_LOG)
+#define PP_ROW_ENTRIES 32
+
+// v5 block frame
+#define PP_FRAME_VERSION 5
+#define PP_BLOCK_HEADER_SIZE 16
+#define PP_BLOCK_LOG 18                      // 256KB blocks
+#define PP_BLOCK_SIZE (1 << PP_BLOCK_LOG)
+#define PP_MIN_MATCH 4
+
+// Seek index (end block body): per block u32 span + u32 raw size, then a
+// footer of u32 block count, u32 xxh32 of the entries and the magic, so
+// readers find it from the end of the file
+#define PP_SEEK_ENTRY_SIZE 8
+#define PP_SEEK_FOOTER_SIZE 12
+#define PP_SEEK_MAGIC 0x4B535050            // "PPSK"
+
+// Block types
+#define PP_BLOCK_RAW 0
+#define PP_BLOCK_LZ 1
+#define PP_BLOCK_RLE 2                      // One byte value repeated raw_size times
+#define PP_BLOCK_CM 3                       // Context-mixing arithmetic coded
+#define PP_BLOCK_END 0xFF
+
+// Byte runs at least this long bypass the match finder
+#define PP_RUN_MIN 16
+
+// Long-distance matcher for linked frames: anchors are the positions whose
+// gear hash of the preceding PP_LDM_SPAN bytes has its top PP_LDM_SPLIT_LOG
+// bits clear, about one every 64 bytes; matches are at least PP_LDM_MIN long
+#define PP_LDM_SPAN 64
+#define PP_LDM_SPLIT_LOG 6
+#define PP_LDM_MIN 64
+#define PP_LDM_LOG_MAX 22
+
+// Matches longer than this insert only every insert_step-th position and
+// their last PP_SPARSE_TAIL positions into the match finder
+#define PP_SPARSE_MIN 32
+#define PP_SPARSE_TAIL 8
+
+// Fast levels: misses per step increase (log2), and bytes left as literals
+// at the end of a block (the last probe reads 4 of them)
+#define PP_FAST_SKIP_LOG 6
+#define PP_FAST_TAIL 8
+
+// LZ block flags
+#define PP_BF_LIT_HUFFMAN 0x01
+#define PP_BF_SEQ_HUFFMAN 0x02
+#define PP_BF_TEXT 0x10                     // Body starts with a text token table
+
+// Text tokenizer limits
+#define PP_TEXT_MAX_TOKENS 128
+#define PP_TEXT_MIN_LEN 4
+#define PP_TEXT_MAX_LEN 32
+#define PP_TEXT_SLOTS_LOG 12
+
+// Sequence code alphabets
+#define PP_HUF_MAX_BITS 11
+#define PP_LL_CODES 40
+#define PP_ML_CODES 40
+#define PP_OF_CODES 32
+
+// Estimator routes
+#define PP_ROUTE_STORE 0
+#define PP_ROUTE_FAST 1
+#define PP_ROUTE_STRONG 2
+
+// Pied Piper file header (v1)
 typedef struct {
     uint16_t magic;           // PP magic number
     uint8_t version_major;
@@ -37,21 +148,132 @@ typedef struct {
 
 // LZ77 match structure
 typedef struct {
-    uint16_t offset;
-    uint16_t length;
+    uint32_t offset;
+    uint32_t length;
 } LZ77_Match;
 
-// Huffman node
-typedef struct HuffmanNode {
-    uint32_t freq;
-    uint8_t symbol;
-    struct HuffmanNode *left;
-    struct HuffmanNode *right;
-} HuffmanNode;
+// Match-finder parameters per compression level
+typedef struct {
+    uint16_t chain_limit;     // Maximum hash chain steps (or row candidates) per search
+    uint16_t good_length;     // Best match this long: search the remaining quarter
+    uint16_t target_length;   // Match this long is committed without lazy steps
+    uint16_t nice_length;     // Match this long ends the search (or optimal lookup)
+    uint8_t lazy;             // Positions to look ahead before committing a match
+    uint8_t insert_step;      // Hash insertion stride inside long matches
+    uint8_t hash_log;         // Largest hash table, in bits
+    uint8_t huffman;          // PP_HUF_*: what is entropy-coded when it pays
+    uint8_t row;              // Row match finder instead of hash chains
+    uint8_t optimal;          // Price-based parse over suffix-array matches: passes
+} PP_LevelParams;
+
+// Optimal parser node: how the cheapest known path reaches a position
+typedef struct {
+    uint32_t price;
+    uint32_t len;             // Match length, 0 for a literal
+    uint32_t off;
+    uint32_t litlen;          // Literals since the last match on that path
+} PP_OptNode;
+
+#define PP_HUF_NONE 0
+#define PP_HUF_SEQ 1              // Sequence codes; literals stay raw
+#define PP_HUF_ALL 2
+
+static const PP_LevelParams pp_level_table[10] = {
+    {    0,   0,   0,   0, 0, 0,  0, 0, 0, 0 },  // unused
+    {    4,  16,   0,  32, 0, 8, 15, 2, 0, 0 },  // 1: fast path
+    {    8,  16,   0,  64, 0, 4, 15, 2, 0, 0 },
+    {   16,  16,   0,  64, 0, 4, 15, 2, 1, 0 },
+    {   32,  16,  32, 128, 1, 2, 15, 2, 1, 0 },
+    {   64,  32,  64, 128, 1, 1, 16, 2, 0, 0 },
+    {  128,  32, 128, 258, 1, 1, 16, 2, 0, 0 },  // 6: default
+    {  256,  64, 258, 258, 1, 1, 17, 2, 0, 0 },
+    {  512, 128, 258, 128, 2, 1, 17, 2, 0, 1 },
+    { 1024, 258, 258, 258, 2, 1, 17, 2, 0, 2 },  // 9: strongest
+};
+
+// Fast levels (below 1) all parse with pp_lz_parse_fast; only the
+// table size and the entropy coding come from here
+static const PP_LevelParams pp_fast_params = { 0, 0, 0, 0, 0, 0, 14, PP_HUF_SEQ, 0, 0 };
+
+// Pipeline per strategy. max_level caps the requested level, and with it the
+// entropy backend: 0 stores, 1-9 run LZ + Huffman, PP_LEVEL_MAX allows CM.
+// chain_shift scales the level's search depth: text keeps finding longer
+// matches further down the chains, while binaries find theirs early and
+// gain speed from a shallower search (about 0.05% of ratio).
+typedef struct {
+    const char *name;
+    uint32_t filters;         // Filters tried on each block
+    int8_t chain_shift;       // Search depth vs the level table, as a power of two
+    uint8_t max_level;
+} PP_Strategy;
+
+static const PP_Strategy pp_strategy_table[PP_STRATEGY_COUNT] = {
+    { "auto",    0,               0, PP_LEVEL_MAX },   // Resolved per file first
+    { "generic", 0,              -1, PP_LEVEL_MAX },
+    { "text",    PP_FILTER_TEXT,  1, PP_LEVEL_MAX },
+    { "stored",  0,               0, 0 },             // Already entropy coded
+};
+
+// Strategy per detected file type. ZIP and PDF mix stored and deflated
+// parts, so they stay generic and the block estimator sorts them out.
+static const uint8_t pp_filetype_strategy[11] = {
+    PP_STRATEGY_GENERIC,      // 0: binary
+    PP_STRATEGY_STORED,       // 1: PNG
+    PP_STRATEGY_STORED,       // 2: JPEG
+    PP_STRATEGY_STORED,       // 3: GIF
+    PP_STRATEGY_GENERIC,      // 4: ZIP
+    PP_STRATEGY_GENERIC,      // 5: PDF
+    PP_STRATEGY_STORED,       // 6: gzip
+    PP_STRATEGY_STORED,       // 7: bzip2, xz, zstd, 7z
+    PP_STRATEGY_GENERIC,
+    PP_STRATEGY_GENERIC,
+    PP_STRATEGY_TEXT,         // 10: text
+};
+
+// Token table for the structured-text filter
+typedef struct {
+    uint32_t count;
+    uint8_t code[PP_TEXT_MAX_TOKENS];
+    uint8_t len[PP_TEXT_MAX_TOKENS];
+    uint8_t data[PP_TEXT_MAX_TOKENS][PP_TEXT_MAX_LEN];
+} PP_TextTokens;
+
+// Per-block estimate from the sampling estimator
+typedef struct {
+    uint32_t entropy;         // Order-0 entropy, bits per byte in 8.8 fixed point
+    uint32_t match_rate;      // Sparse hash-probe hits per 1024 probes
+} PP_BlockEstimate;
+
+// Context-mixing model state (see the --max coder below)
+typedef struct PP_CModel PP_CModel;
+
+// Long-distance matcher: last anchor per hash slot, and a match found for
+// the current block (pos relative to the match finder's input)
+typedef struct {
+    uint32_t pos;             // Frame position, UINT32_MAX if empty
+    uint32_t check;           // Low hash bits, to skip most false hits
+} PP_LdmEntry;
 
-// Compression context
 typedef struct {
-    uint8_t *input;
+    uint32_t pos;
+    uint32_t len;
+    uint32_t off;
+} PP_LdmMatch;
+
+// Raw prefix dictionary: LZ blocks may match into it as if it preceded
+// every block. The match finder state after inserting it is kept, so a
+// loaded dictionary costs one table copy per block.
+struct PP_Dict {
+    uint8_t *data;            // Last MAX_WINDOW_SIZE bytes of the source
+    uint32_t size;
+    uint32_t id;              // Nonzero; stored at frame header bytes 20-23
+    int32_t *hash_table;
+    int32_t *prev;
+};
+
+// Compression context
+struct PP_Context {
+    const uint8_t *input;
     uint32_t input_size;
     uint8_t *output;
     uint32_t output_size;
@@ -60,381 +282,6263 @@ typedef struct {
     // Hash table for LZ77
     int32_t *hash_table;
     int32_t *prev;
+    uint32_t window_mask;
+    uint32_t hash_log;        // Bits in use for the current block
+    uint32_t hash_cap;        // Bits hash_table is sized for
+    uint32_t chain_limit;
+    uint32_t good_length;
+    uint32_t nice_length;
 
-    // Huffman trees
-    HuffmanNode *literal_tree;
-    HuffmanNode *distance_tree;
+    // Row match finder, allocated on first use
+    uint32_t *row_pos;        // PP_ROW_ENTRIES positions per row
+    uint8_t *row_tag;         // Low hash byte of each entry
+    uint8_t *row_head;        // Slot of each row's newest entry
+    int rows;                 // Rows in use for the current block
+    uint32_t row_log;         // log2 of that row count
 
-    // Statistics
-    uint32_t literals[256];
-    uint32_t distances[32768];
-    uint32_t matches_found;
-} PP_Context;
+    // Suffix-array candidates and parser nodes, allocated on first use
+    int32_t *sa_buf;
+    uint32_t sa_cap;          // Positions sa_buf is sized for
+    int32_t *sa_prev, *sa_next;
+    uint32_t *sa_prev_len, *sa_next_len;
+    PP_OptNode *opt;
 
-// Initialize hash value
-static inline uint32_t hash_func(uint8_t *data) {
-    return ((data[0] << 10) ^ (data[1] << 5) ^ data[2]) & HASH_MASK;
-}
+    // Parsed block: literals and sequences
+    uint8_t *lit_buf;
+    uint32_t lit_count;
+    uint32_t *seq_ll;
+    uint32_t *seq_ml;
+    uint32_t *seq_off;
+    uint32_t seq_count;
 
-// Initialize compression context
-PP_Context* pp_init_context(uint8_t *input, uint32_t input_size) {
-    PP_Context *ctx = (PP_Context*)calloc(1, sizeof(PP_Context));
-    if (!ctx) return NULL;
+    // Filtered copy of the current block
+    uint8_t *filter_buf;
 
-    ctx->input = input;
-    ctx->input_size = input_size;
-    ctx->output_size = input_size + (input_size / 10) + 1024;
-    ctx->output = (uint8_t*)malloc(ctx->output_size);
+    // Dictionary followed by the current block, when a dictionary is set
+    const PP_Dict *dict;
+    uint8_t *window;
+    uint32_t prefix;          // History bytes before the block in input
 
-    ctx->hash_table = (int32_t*)malloc(HASH_SIZE * sizeof(int32_t));
-    ctx->prev = (int32_t*)malloc(input_size * sizeof(int32_t));
+    // Linked frames: the whole input, the block's place in it and the
+    // window; input then starts up to MAX_WINDOW_SIZE bytes before the block
+    const uint8_t *frame;
+    uint32_t frame_pos;
+    uint32_t link_window;     // 0 when blocks stand alone
+    int linked;               // Prefix is frame history, not hashed yet
 
-    memset(ctx->hash_table, -1, HASH_SIZE * sizeof(int32_t));
-    memset(ctx->prev, -1, input_size * sizeof(int32_t));
+    // Long-distance matcher, allocated on the first linked frame
+    PP_LdmEntry *ldm_table;
+    uint64_t *ldm_gear;
+    uint32_t ldm_log;
+    PP_LdmMatch *ldm_seq;
+    uint32_t ldm_count;
 
-    return ctx;
-}
+    // Context-mixing model, created on first use
+    PP_CModel *cm;
 
-// Find longest match using hash chains
-LZ77_Match pp_find_longest_match(PP_Context *ctx, uint32_t pos) {
-    LZ77_Match match = {0, 0};
+    // Unlinked frames: blocks spread over threads workers, this context
+    // and threads - 1 more created on first use
+    int threads;
+    struct PP_Context **workers;
 
-    if (pos + MIN_MATCH > ctx->input_size) {
-        return match;
-    }
+    PP_Stats stats;
+};
 
-    uint32_t hash = hash_func(&ctx->input[pos]);
-    int32_t chain_pos = ctx->hash_table[hash];
-    uint32_t best_len = 0;
-    uint32_t best_offset = 0;
-    uint32_t max_match = (ctx->input_size - pos < MAX_LOOKAHEAD) ?
-                         ctx->input_size - pos : MAX_LOOKAHEAD;
+// Decoder state, grown on demand and reused across blocks and frames
+struct PP_Decoder {
+    uint8_t *buf;             // Filtered block before the text filter is undone
+    uint32_t size;
+    PP_CModel *cm;
+    const PP_Dict *dict;      // Dictionary the frame was written with
+    uint8_t *window;          // Dictionary followed by the block being decoded
+    uint32_t window_size;
+};
 
-    int chain_limit = 128; // Maximum chain length to search
+// Bit writer (LSB-first)
+typedef struct {
+    uint8_t *out;
+    uint32_t pos;
+    uint32_t cap;
+    uint64_t buf;
+    uint32_t count;
+} PP_BitWriter;
 
-    while (chain_pos >= 0 && chain_limit-- > 0) {
-        uint32_t offset = pos - chain_pos;
+// Bit reader (LSB-first)
+typedef struct {
+    const uint8_t *in;
+    uint32_t pos;
+    uint32_t size;
+    uint64_t buf;
+    uint32_t count;
+} PP_BitReader;
 
-        if (offset > MAX_WINDOW_SIZE) break;
-        if (offset == 0) break;
+// Huffman table: code lengths, LSB-first codes and a single-level decode table
+typedef struct {
+    uint8_t lengths[256];
+    uint16_t codes[256];
+    uint16_t decode[1 << PP_HUF_MAX_BITS];   // (symbol << 4) | length
+} PP_Huffman;
 
-        // Quick check for potential match
-        if (ctx->input[chain_pos + best_len] == ctx->input[pos + best_len]) {
-            uint32_t len = 0;
-            while (len < max_match &&
-                   ctx->input[chain_pos + len] == ctx->input[pos + len]) {
-                len++;
-            }
+/* ---------- Little-endian helpers ---------- */
 
-            if (len >= MIN_MATCH && len > best_len) {
-                best_len = len;
-                best_offset = offset;
+static inline uint32_t pp_read_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-                if (len == max_match) break; // Can't do better
-            }
-        }
+static inline uint64_t pp_read_le64(const uint8_t *p) {
+    return (uint64_t)pp_read_le32(p) | ((uint64_t)pp_read_le32(p + 4) << 32);
+}
 
-        chain_pos = ctx->prev[chain_pos];
-    }
+static inline void pp_write_le32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
 
-    if (best_len >= MIN_MATCH) {
-        match.length = best_len;
-        match.offset = best_offset;
-        ctx->matches_found++;
-    }
+static inline void pp_write_le64(uint8_t *p, uint64_t v) {
+    pp_write_le32(p, (uint32_t)v);
+    pp_write_le32(p + 4, (uint32_t)(v >> 32));
+}
 
-    return match;
+static inline uint32_t pp_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
-// Update hash chains
-void pp_update_hash(PP_Context *ctx, uint32_t pos) {
-    if (pos + MIN_MATCH > ctx->input_size) return;
+static inline uint64_t pp_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-    uint32_t hash = hash_func(&ctx->input[pos]);
-    ctx->prev[pos] = ctx->hash_table[hash];
-    ctx->hash_table[hash] = pos;
+/* ---------- xxHash32 (block checksums) ---------- */
+
+#define PP_XXH_PRIME1 2654435761U
+#define PP_XXH_PRIME2 2246822519U
+#define PP_XXH_PRIME3 3266489917U
+#define PP_XXH_PRIME4 668265263U
+#define PP_XXH_PRIME5 374761393U
+
+static inline uint32_t pp_rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
 }
 
-// Detect file type for optimization
-uint8_t pp_detect_filetype(uint8_t *data, uint32_t size) {
-    if (size < 4) return 0;
+static inline uint32_t pp_xxh32_round(uint32_t acc, uint32_t input) {
+    acc += input * PP_XXH_PRIME2;
+    acc = pp_rotl32(acc, 13);
+    return acc * PP_XXH_PRIME1;
+}
 
-    // Check for common file signatures
-    if (memcmp(data, "\x89PNG", 4) == 0) return 1; // PNG
-    if (memcmp(data, "\xFF\xD8\xFF", 3) == 0) return 2; // JPEG
-    if (memcmp(data, "GIF8", 4) == 0) return 3; // GIF
-    if (memcmp(data, "\x50\x4B\x03\x04", 4) == 0) return 4; // ZIP
-    if (memcmp(data, "%PDF", 4) == 0) return 5; // PDF
+static uint32_t pp_xxh32(const uint8_t *data, size_t len, uint32_t seed) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    uint32_t h;
 
-    // Check for text-based content
-    uint32_t text_chars = 0;
-    uint32_t sample_size = (size < 1024) ? size : 1024;
-    for (uint32_t i = 0; i < sample_size; i++) {
-        if ((data[i] >= 32 && data[i] <= 126) || data[i] == '\n' ||
-            data[i] == '\r' || data[i] == '\t') {
-            text_chars++;
-        }
+    if (len >= 16) {
+        const uint8_t *limit = end - 16;
+        uint32_t v1 = seed + PP_XXH_PRIME1 + PP_XXH_PRIME2;
+        uint32_t v2 = seed + PP_XXH_PRIME2;
+        uint32_t v3 = seed;
+        uint32_t v4 = seed - PP_XXH_PRIME1;
+
+        do {
+            v1 = pp_xxh32_round(v1, pp_read_le32(p));
+            v2 = pp_xxh32_round(v2, pp_read_le32(p + 4));
+            v3 = pp_xxh32_round(v3, pp_read_le32(p + 8));
+            v4 = pp_xxh32_round(v4, pp_read_le32(p + 12));
+            p += 16;
+        } while (p <= limit);
+
+        h = pp_rotl32(v1, 1) + pp_rotl32(v2, 7) + pp_rotl32(v3, 12) + pp_rotl32(v4, 18);
+    } else {
+        h = seed + PP_XXH_PRIME5;
     }
 
-    if (text_chars > sample_size * 0.9) return 10; // Text
+    h += (uint32_t)len;
+
+    while (p + 4 <= end) {
+        h += pp_read_le32(p) * PP_XXH_PRIME3;
+        h = pp_rotl32(h, 17) * PP_XXH_PRIME4;
+        p += 4;
+    }
+    while (p < end) {
+        h += (*p++) * PP_XXH_PRIME5;
+        h = pp_rotl32(h, 11) * PP_XXH_PRIME1;
+    }
 
-    return 0; // Unknown/binary
+    h ^= h >> 15;
+    h *= PP_XXH_PRIME2;
+    h ^= h >> 13;
+    h *= PP_XXH_PRIME3;
+    h ^= h >> 16;
+    return h;
 }
 
-// Write bits to output
-void pp_write_bits(PP_Context *ctx, uint32_t bits, uint8_t num_bits) {
-    static uint32_t bit_buffer = 0;
-    static uint8_t bits_in_buffer = 0;
+/* ---------- Bit I/O ---------- */
 
-    bit_buffer |= (bits << bits_in_buffer);
-    bits_in_buffer += num_bits;
+static void pp_bw_init(PP_BitWriter *bw, uint8_t *out, uint32_t cap) {
+    bw->out = out;
+    bw->pos = 0;
+    bw->cap = cap;
+    bw->buf = 0;
+    bw->count = 0;
+}
+
+// Write up to 32 bits; output past the capacity is counted but dropped
+static inline void pp_bw_put(PP_BitWriter *bw, uint32_t bits, uint32_t num_bits) {
+    bw->buf |= (uint64_t)bits << bw->count;
+    bw->count += num_bits;
 
-    while (bits_in_buffer >= 8) {
-        if (ctx->output_pos < ctx->output_size) {
-            ctx->output[ctx->output_pos++] = bit_buffer & 0xFF;
+    if (bw->count >= 32) {
+        if (bw->pos + 4 <= bw->cap) {
+            pp_write_le32(bw->out + bw->pos, (uint32_t)bw->buf);
         }
-        bit_buffer >>= 8;
-        bits_in_buffer -= 8;
+        bw->pos += 4;
+        bw->buf >>= 32;
+        bw->count -= 32;
     }
 }
 
-// Main compression function
-int pp_compress(uint8_t *input, uint32_t input_size,
-                uint8_t *output, uint32_t *output_size,
-                uint8_t level) {
+// Flush remaining bits; returns bytes written (may exceed cap on overflow)
+static uint32_t pp_bw_finish(PP_BitWriter *bw) {
+    while (bw->count > 0) {
+        if (bw->pos < bw->cap) {
+            bw->out[bw->pos] = bw->buf & 0xFF;
+        }
+        bw->pos++;
+        bw->buf >>= 8;
+        bw->count = (bw->count > 8) ? bw->count - 8 : 0;
+    }
+    return bw->pos;
+}
 
-    if (!input || !output || !output_size || input_size == 0) {
-        return -1;
+static void pp_br_init(PP_BitReader *br, const uint8_t *in, uint32_t size) {
+    br->in = in;
+    br->pos = 0;
+    br->size = size;
+    br->buf = 0;
+    br->count = 0;
+}
+
+// Ensure at least 56 bits are buffered; reads past the end yield zeros
+static inline void pp_br_refill(PP_BitReader *br) {
+    if (br->pos + 8 <= br->size) {
+        br->buf |= pp_read_le64(br->in + br->pos) << br->count;
+        uint32_t bytes = (63 - br->count) >> 3;
+        br->pos += bytes;
+        br->count += bytes * 8;
+    } else {
+        while (br->count <= 56) {
+            uint64_t byte = (br->pos < br->size) ? br->in[br->pos] : 0;
+            br->buf |= byte << br->count;
+            br->pos++;
+            br->count += 8;
+        }
     }
+}
 
-    PP_Context *ctx = pp_init_context(input, input_size);
-    if (!ctx) return -1;
+static inline uint32_t pp_br_get(PP_BitReader *br, uint32_t num_bits) {
+    if (br->count < num_bits) pp_br_refill(br);
+    uint32_t val = (uint32_t)(br->buf & ((1ULL << num_bits) - 1));
+    br->buf >>= num_bits;
+    br->count -= num_bits;
+    return val;
+}
 
-    // Write header
-    PP_Header header;
-    header.magic = PP_MAGIC;
-    header.version_major = 1;
-    header.version_minor = 0;
-    header.uncompressed_size = input_size;
-    header.compression_level = level;
-    header.file_type = pp_detect_filetype(input, input_size);
+// True if the reader consumed more bits than the input holds
+static inline int pp_br_overrun(const PP_BitReader *br) {
+    return (uint64_t)br->pos * 8 - br->count > (uint64_t)br->size * 8;
+}
 
-    memcpy(ctx->output, &header, sizeof(PP_Header));
-    ctx->output_pos = sizeof(PP_Header);
+/* ---------- Canonical Huffman ---------- */
 
-    // LZ77 compression with lazy matching
-    uint32_t pos = 0;
-    while (pos < input_size) {
-        pp_update_hash(ctx, pos);
+// Build length-limited code lengths for up to 256 symbols
+static void pp_huf_build_lengths(const uint32_t *freq, int n, uint8_t *lengths) {
+    uint16_t syms[256];
+    uint32_t weight[512];
+    int16_t parent[512];
+    int count = 0;
 
-        LZ77_Match match = pp_find_longest_match(ctx, pos);
+    memset(lengths, 0, n);
+    for (int i = 0; i < n; i++) {
+        if (freq[i]) syms[count++] = (uint16_t)i;
+    }
+    if (count == 0) return;
+    if (count == 1) {
+        lengths[syms[0]] = 1;
+        return;
+    }
 
-        if (match.length >= MIN_MATCH) {
-            // Output match: flag bit 1 + offset + length
-            pp_write_bits(ctx, 1, 1);  // Match flag
-            pp_write_bits(ctx, match.offset, 15);
-            pp_write_bits(ctx, match.length - MIN_MATCH, 8);
+    // Sort symbols by ascending frequency (insertion sort, n <= 256)
+    for (int i = 1; i < count; i++) {
+        uint16_t s = syms[i];
+        int j = i - 1;
+        while (j >= 0 && freq[syms[j]] > freq[s]) {
+            syms[j + 1] = syms[j];
+            j--;
+        }
+        syms[j + 1] = s;
+    }
 
-            // Update hash for all positions in match
-            for (uint32_t i = 1; i < match.length && pos + i < input_size; i++) {
-                pp_update_hash(ctx, pos + i);
+    // Two-queue Huffman construction: leaves 0..count-1, internal nodes after
+    for (int i = 0; i < count; i++) {
+        weight[i] = freq[syms[i]];
+    }
+    int leaf = 0, node = count, next = count;
+    while (next < 2 * count - 1) {
+        int pick[2];
+        for (int k = 0; k < 2; k++) {
+            if (leaf < count && (node >= next || weight[leaf] <= weight[node])) {
+                pick[k] = leaf++;
+            } else {
+                pick[k] = node++;
             }
-
-            pos += match.length;
-        } else {
-            // Output literal: flag bit 0 + byte
-            pp_write_bits(ctx, 0, 1);  // Literal flag
-            pp_write_bits(ctx, input[pos], 8);
-            pos++;
         }
+        weight[next] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = (int16_t)next;
+        parent[pick[1]] = (int16_t)next;
+        next++;
+    }
+
+    // Depths from the root down
+    uint8_t depth[512];
+    depth[next - 1] = 0;
+    for (int i = next - 2; i >= 0; i--) {
+        depth[i] = depth[parent[i]] + 1;
     }
 
-    // Flush remaining bits
-    if (ctx->output_pos < ctx->output_size) {
-        pp_write_bits(ctx, 0, 7);
+    // Limit lengths, then repair the Kraft sum by lengthening the rarest codes
+    int64_t kraft = 0;
+    const int64_t one = (int64_t)1 << PP_HUF_MAX_BITS;
+    for (int i = 0; i < count; i++) {
+        uint8_t len = depth[i] > PP_HUF_MAX_BITS ? PP_HUF_MAX_BITS : depth[i];
+        lengths[syms[i]] = len;
+        kraft += one >> len;
     }
+    while (kraft > one) {
+        for (int i = 0; i < count && kraft > one; i++) {
+            uint8_t len = lengths[syms[i]];
+            if (len < PP_HUF_MAX_BITS) {
+                lengths[syms[i]] = len + 1;
+                kraft -= one >> (len + 1);
+            }
+        }
+    }
+}
 
-    // Update header with compressed size
-    ((PP_Header*)ctx->output)->compressed_size = ctx->output_pos;
+// Assign canonical codes (bit-reversed for LSB-first output) and, for
+// decoders, build the decode table. Returns 0 on success, -1 if the lengths
+// are over-subscribed.
+static int pp_huf_build_codes(PP_Huffman *huf, int n, int decode) {
+    uint32_t bl_count[PP_HUF_MAX_BITS + 1] = {0};
+    uint32_t next_code[PP_HUF_MAX_BITS + 1];
+    int64_t kraft = 0;
 
-    // Calculate checksum
-    uint16_t checksum = 0;
-    for (uint32_t i = 0; i < input_size; i++) {
-        checksum = (checksum + input[i]) & 0xFFFF;
+    for (int i = 0; i < n; i++) {
+        if (huf->lengths[i] > PP_HUF_MAX_BITS) return -1;
+        if (huf->lengths[i]) {
+            bl_count[huf->lengths[i]]++;
+            kraft += (int64_t)1 << (PP_HUF_MAX_BITS - huf->lengths[i]);
+        }
     }
-    ((PP_Header*)ctx->output)->checksum = checksum;
+    if (kraft > ((int64_t)1 << PP_HUF_MAX_BITS)) return -1;
 
-    // Copy result
-    if (ctx->output_pos <= *output_size) {
-        memcpy(output, ctx->output, ctx->output_pos);
-        *output_size = ctx->output_pos;
-    } else {
-        *output_size = ctx->output_pos;
-        free(ctx->output);
-        free(ctx->hash_table);
-        free(ctx->prev);
-        free(ctx);
-        return -2; // Output buffer too small
+    uint32_t code = 0;
+    for (int bits = 1; bits <= PP_HUF_MAX_BITS; bits++) {
+        next_code[bits] = code;
+        code = (code + bl_count[bits]) << 1;
     }
 
-    printf("Pied Piper Compression Stats:\n");
-    printf("  Input size: %u bytes\n", input_size);
-    printf("  Output size: %u bytes\n", ctx->output_pos);
-    printf("  Compression ratio: %.2f%%\n",
-           100.0 * ctx->output_pos / input_size);
-    printf("  Matches found: %u\n", ctx->matches_found);
+    if (decode) memset(huf->decode, 0, sizeof(huf->decode));
+    for (int s = 0; s < n; s++) {
+        uint32_t len = huf->lengths[s];
+        if (!len) continue;
 
-    free(ctx->output);
-    free(ctx->hash_table);
-    free(ctx->prev);
-    free(ctx);
+        uint32_t c = next_code[len]++;
+        uint32_t rev = 0;
+        for (uint32_t b = 0; b < len; b++) {
+            rev |= ((c >> b) & 1) << (len - 1 - b);
+        }
+        huf->codes[s] = (uint16_t)rev;
 
+        if (!decode) continue;
+        for (uint32_t e = rev; e < (1u << PP_HUF_MAX_BITS); e += (1u << len)) {
+            huf->decode[e] = (uint16_t)((s << 4) | len);
+        }
+    }
     return 0;
 }
 
-// Decompression function
-int pp_decompress(uint8_t *input, uint32_t input_size,
-                  uint8_t *output, uint32_t *output_size) {
+// Lengths are stored as 4-bit nibbles
+static void pp_huf_write_lengths(uint8_t *out, const uint8_t *lengths, int n) {
+    for (int i = 0; i < n; i += 2) {
+        out[i / 2] = lengths[i] | ((i + 1 < n ? lengths[i + 1] : 0) << 4);
+    }
+}
 
-    if (!input || !output || !output_size || input_size < sizeof(PP_Header)) {
-        return -1;
+static void pp_huf_read_lengths(const uint8_t *in, uint8_t *lengths, int n) {
+    for (int i = 0; i < n; i++) {
+        lengths[i] = (in[i / 2] >> ((i & 1) * 4)) & 0x0F;
     }
+}
 
-    PP_Header *header = (PP_Header*)input;
+static inline uint32_t pp_huf_decode(const PP_Huffman *huf, PP_BitReader *br) {
+    if (br->count < PP_HUF_MAX_BITS) pp_br_refill(br);
+    uint16_t e = huf->decode[br->buf & ((1u << PP_HUF_MAX_BITS) - 1)];
+    uint32_t len = e & 0x0F;
+    br->buf >>= len;
+    br->count -= len;
+    return e >> 4;
+}
 
-    // Validate header
-    if (header->magic != PP_MAGIC) {
-        return -1;
+// Encoded size in bits for a frequency table under the given lengths
+static uint64_t pp_huf_cost(const uint32_t *freq, const uint8_t *lengths, int n) {
+    uint64_t bits = 0;
+    for (int i = 0; i < n; i++) {
+        bits += (uint64_t)freq[i] * lengths[i];
     }
+    return bits;
+}
 
-    if (*output_size < header->uncompressed_size) {
-        *output_size = header->uncompressed_size;
-        return -2;
-    }
+/* ---------- Sequence codes ---------- */
+
+static inline uint32_t pp_highbit(uint32_t v) {
+    return 31 - __builtin_clz(v);
+}
+
+// Literal and match lengths: values < 16 are their own code, larger values
+// use code 12 + log2(v) followed by log2(v) extra bits
+static inline uint32_t pp_length_code(uint32_t v) {
+    return (v < 16) ? v : 12 + pp_highbit(v);
+}
+
+static inline uint32_t pp_length_extra(uint32_t code) {
+    return (code < 16) ? 0 : code - 12;
+}
 
-    uint8_t *in_ptr = input + sizeof(PP_Header);
-    uint32_t out_pos = 0;
-    uint32_t bit_buffer = 0;
-    uint8_t bits_available = 0;
+static inline uint32_t pp_length_base(uint32_t code) {
+    return (code < 16) ? code : (1u << (code - 12));
+}
 
-    // Helper to read bits
-    #define READ_BITS(n) ({ \
-        while (bits_available < (n)) { \
-            bit_buffer |= (*in_ptr++) << bits_available; \
-            bits_available += 8; \
-        } \
-        uint32_t val = bit_buffer & ((1 << (n)) - 1); \
-        bit_buffer >>= (n); \
-        bits_available -= (n); \
-        val; \
-    })
+// Offsets: code log2(offset) followed by that many extra bits
+static inline uint32_t pp_offset_code(uint32_t offset) {
+    return pp_highbit(offset);
+}
 
-    while (out_pos < header->uncompressed_size) {
-        uint8_t flag = READ_BITS(1);
+/* ---------- Context-mixing coder (--max) ---------- */
 
-        if (flag == 1) {
-            // Match
-            uint16_t offset = READ_BITS(15);
-            uint16_t length = READ_BITS(8) + MIN_MATCH;
+// Bitwise model in the lpaq style: one adaptive probability per context for
+// orders 0-4 and 6, the current word and a long-range match predictor, mixed
+// in the logistic domain and refined by an order-1 APM. Each block starts
+// from a fresh model, so blocks stay independently decodable.
 
-            uint32_t src_pos = out_pos - offset;
-            for (uint16_t i = 0; i < length; i++) {
-                output[out_pos++] = output[src_pos++];
-            }
-        } else {
-            // Literal
-            output[out_pos++] = READ_BITS(8);
-        }
+#define PP_CM_TABLE_LOG 22            // Counters per hashed context table (max)
+#define PP_CM_HASHED 5                // Orders 2, 3, 4, 6 and the current word
+#define PP_CM_INPUTS 9                // Orders 0-1, hashed contexts, match, bias
+#define PP_CM_MATCH_LOG 18
+#define PP_CM_MATCH_MIN 6             // Bytes hashed to find match candidates
+#define PP_CM_LIMIT 255               // Counter confidence limit
+#define PP_CM_MIXER_SHIFT 11          // Mixer learning rate
+
+struct PP_CModel {
+    uint32_t *table[PP_CM_HASHED];    // Nibble-slotted counters per hashed context
+    uint32_t *order1;                 // Previous byte x partial byte
+    uint32_t order0[256];
+    uint32_t *match_pos;              // Hash of the last 6 bytes -> next position
+    uint32_t match_sm[64 * 2];        // Match length bucket x expected bit
+    int32_t *weights;                 // Mixer weights, one set per partial byte
+    uint16_t *apm;                    // (partial byte, previous byte) x 33 bins
+
+    // Coding state
+    const uint8_t *hist;              // Bytes coded so far in this block
+    uint32_t pos;
+    uint32_t c0, c4, c8, word, bitpos;
+    uint32_t table_log;               // Sized from the block, so small blocks reset fast
+    uint32_t hash[PP_CM_HASHED];
+    uint32_t *slot[PP_CM_HASHED];
+    uint32_t match_ptr, match_len;
+
+    // Per-bit state shared by predict and update
+    uint32_t *cnt[PP_CM_INPUTS];
+    int32_t st[PP_CM_INPUTS];
+    uint32_t *match_cnt;
+    int32_t *w;
+    int pr_mix;
+    uint32_t apm_idx, apm_wt;
+};
+
+static int16_t pp_cm_stretch_table[4096];
+static uint16_t pp_cm_dt[PP_CM_LIMIT + 1];
+
+// Logistic function: 4096 / (1 + e^(-d/256)), d in [-2047, 2047]
+static int pp_cm_squash(int d) {
+    static const int t[33] = {
+        1, 2, 3, 6, 10, 16, 27, 45, 73, 120, 194, 310, 488, 747, 1101, 1546,
+        2047, 2549, 2994, 3348, 3607, 3785, 3901, 3975, 4024, 4050, 4068, 4079,
+        4085, 4089, 4092, 4093, 4094
+    };
+    if (d > 2047) return 4095;
+    if (d < -2047) return 1;
+    int w = d & 127;
+    d = (d >> 7) + 16;
+    return (t[d] * (128 - w) + t[d + 1] * w + 64) >> 7;
+}
+
+static void pp_cm_build_tables(void) {
+    int pi = 0;
+    for (int x = -2047; x <= 2047; x++) {
+        int v = pp_cm_squash(x);
+        for (int j = pi; j <= v; j++) pp_cm_stretch_table[j] = (int16_t)x;
+        pi = v + 1;
     }
+    for (int j = pi; j < 4096; j++) pp_cm_stretch_table[j] = 2047;
+
+    for (int i = 0; i <= PP_CM_LIMIT; i++) pp_cm_dt[i] = (uint16_t)(16384 / (i + i + 3));
+}
+
+// Shared tables are built once, even when workers create models concurrently
+static void pp_cm_init_tables(void) {
+#ifdef PP_HAVE_THREADS
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, pp_cm_build_tables);
+#else
+    if (!pp_cm_dt[0]) pp_cm_build_tables();
+#endif
+}
+
+static inline int pp_cm_stretch(int p) {
+    return pp_cm_stretch_table[p];
+}
+
+// Counter: 22-bit probability in the high bits, hit count in the low 10
+static inline void pp_cm_adapt(uint32_t *t, int bit) {
+    uint32_t n = *t & 1023, p = *t >> 10;
+    if (n < PP_CM_LIMIT) (*t)++;
+    *t += ((uint32_t)(((int32_t)(bit << 22) - (int32_t)p) >> 3) * pp_cm_dt[n]) & 0xfffffc00u;
+}
+
+static inline uint32_t pp_cm_hash(uint32_t x, uint32_t order) {
+    x = (x + order * 0x3C6EF372u) * 0x9E3779B1u;
+    return x ^ (x >> 15);
+}
 
-    #undef READ_BITS
+static void pp_cm_free(PP_CModel *cm) {
+    if (!cm) return;
+    for (int i = 0; i < PP_CM_HASHED; i++) free(cm->table[i]);
+    free(cm->order1);
+    free(cm->match_pos);
+    free(cm->weights);
+    free(cm->apm);
+    free(cm);
+}
 
-    *output_size = out_pos;
+static PP_CModel* pp_cm_create(void) {
+    PP_CModel *cm = (PP_CModel*)calloc(1, sizeof(PP_CModel));
+    if (!cm) return NULL;
 
-    // Verify checksum
-    uint16_t checksum = 0;
-    for (uint32_t i = 0; i < out_pos; i++) {
-        checksum = (checksum + output[i]) & 0xFFFF;
+    int ok = 1;
+    for (int i = 0; i < PP_CM_HASHED; i++) {
+        cm->table[i] = (uint32_t*)malloc(((size_t)1 << PP_CM_TABLE_LOG) * sizeof(uint32_t));
+        ok &= cm->table[i] != NULL;
     }
+    cm->order1 = (uint32_t*)malloc(65536 * sizeof(uint32_t));
+    cm->match_pos = (uint32_t*)malloc((1 << PP_CM_MATCH_LOG) * sizeof(uint32_t));
+    cm->weights = (int32_t*)malloc(256 * PP_CM_INPUTS * sizeof(int32_t));
+    cm->apm = (uint16_t*)malloc(65536 * 33 * sizeof(uint16_t));
 
-    if (checksum != header->checksum) {
-        return -3; // Checksum mismatch
+    if (!ok || !cm->order1 || !cm->match_pos || !cm->weights || !cm->apm) {
+        pp_cm_free(cm);
+        return NULL;
     }
 
-    return 0;
+    pp_cm_init_tables();
+    return cm;
 }
 
-// Command-line interface
-int main(int argc, char **argv) {
-    if (argc < 4) {
-        printf("Pied Piper Compression Engine v%s\n", PP_VERSION);
-        printf("Usage: %s <compress|decompress> <input> <output> [level]\n", argv[0]);
-        printf("  level: 1-9 (default: 6)\n");
-        return 1;
+static void pp_cm_set_slots(PP_CModel *cm) {
+    uint32_t k = cm->c0 * 0x2C9277B5u;
+    for (int i = 0; i < PP_CM_HASHED; i++) {
+        uint32_t h = (cm->hash[i] ^ k) * 0x9E3779B1u;
+        cm->slot[i] = cm->table[i] + ((h >> (32 - cm->table_log)) & ~15u);
     }
+}
 
-    const char *mode = argv[1];
-    const char *input_file = argv[2];
-    const char *output_file = argv[3];
-    uint8_t level = (argc > 4) ? atoi(argv[4]) : 6;
+// Start a block; hist must hold each byte before pp_cm_byte is called for it
+static void pp_cm_reset(PP_CModel *cm, const uint8_t *hist, uint32_t size) {
+    const uint32_t half = 1u << 31;
 
-    if (level < 1) level = 1;
-    if (level > 9) level = 9;
+    // About 16 counters per input byte and context
+    cm->table_log = pp_highbit(size | 1) + 5;
+    if (cm->table_log < 12) cm->table_log = 12;
+    if (cm->table_log > PP_CM_TABLE_LOG) cm->table_log = PP_CM_TABLE_LOG;
 
-    // Read input file
-    FILE *fin = fopen(input_file, "rb");
-    if (!fin) {
-        printf("Error: Cannot open input file\n");
-        return 1;
+    for (int i = 0; i < PP_CM_HASHED; i++) {
+        uint32_t *t = cm->table[i];
+        for (uint32_t j = 0; j < (1u << cm->table_log); j++) t[j] = half;
     }
+    for (uint32_t j = 0; j < 65536; j++) cm->order1[j] = half;
+    for (uint32_t j = 0; j < 256; j++) cm->order0[j] = half;
+    for (uint32_t j = 0; j < 128; j++) cm->match_sm[j] = half;
+    memset(cm->match_pos, 0, (1 << PP_CM_MATCH_LOG) * sizeof(uint32_t));
 
-    fseek(fin, 0, SEEK_END);
-    uint32_t input_size = ftell(fin);
-    fseek(fin, 0, SEEK_SET);
+    for (uint32_t j = 0; j < 256 * PP_CM_INPUTS; j++) {
+        cm->weights[j] = (j % PP_CM_INPUTS == PP_CM_INPUTS - 1) ? 0 : 1 << 14;
+    }
+    for (int k = 0; k < 33; k++) cm->apm[k] = (uint16_t)(pp_cm_squash((k - 16) * 128) * 16);
+    for (uint32_t j = 1; j < 65536; j++) memcpy(cm->apm + j * 33, cm->apm, 33 * sizeof(uint16_t));
 
-    uint8_t *input = (uint8_t*)malloc(input_size);
-    fread(input, 1, input_size, fin);
-    fclose(fin);
+    cm->hist = hist;
+    cm->pos = 0;
+    cm->c0 = 1;
+    cm->c4 = cm->c8 = cm->word = cm->bitpos = 0;
+    cm->match_ptr = cm->match_len = 0;
+    for (int i = 0; i < PP_CM_HASHED; i++) cm->hash[i] = pp_cm_hash(0, i + 2);
+    pp_cm_set_slots(cm);
+}
 
-    if (strcmp(mode, "compress") == 0) {
-        uint32_t output_size = input_size * 2;
-        uint8_t *output = (uint8_t*)malloc(output_size);
+// Probability (12-bit) that the next bit is 1
+static inline int pp_cm_predict(PP_CModel *cm) {
+    uint32_t c0 = cm->c0;
+    uint32_t nib = (cm->bitpos < 4) ? c0 : (c0 & ((1u << (cm->bitpos - 4)) - 1)) | (1u << (cm->bitpos - 4));
 
-        int result = pp_compress(input, input_size, output, &output_size, level);
+    cm->cnt[0] = &cm->order0[c0];
+    cm->cnt[1] = &cm->order1[((cm->c4 & 0xFF) << 8) | c0];
+    for (int i = 0; i < PP_CM_HASHED; i++) cm->cnt[2 + i] = &cm->slot[i][nib];
+    for (int i = 0; i < 2 + PP_CM_HASHED; i++) cm->st[i] = pp_cm_stretch(*cm->cnt[i] >> 20);
 
-        if (result == 0) {
-            FILE *fout = fopen(output_file, "wb");
-            fwrite(output, 1, output_size, fout);
-            fclose(fout);
-            printf("Compression successful!\n");
-        } else {
-            printf("Compression failed with code %d\n", result);
+    // Match model: the byte that followed the last occurrence of this context
+    cm->match_cnt = NULL;
+    cm->st[7] = 0;
+    if (cm->match_len) {
+        uint32_t expected = cm->hist[cm->match_ptr] | 0x100;
+        if ((expected >> (8 - cm->bitpos)) == c0) {
+            uint32_t bit = (expected >> (7 - cm->bitpos)) & 1;
+            uint32_t len = cm->match_len < 32 ? cm->match_len : 31 + (cm->match_len >= 64);
+            cm->match_cnt = &cm->match_sm[(len << 1) | bit];
+            cm->st[7] = pp_cm_stretch(*cm->match_cnt >> 20);
         }
+    }
+    cm->st[8] = 256;
+
+    cm->w = cm->weights + c0 * PP_CM_INPUTS;
+    int64_t dot = 0;
+    for (int i = 0; i < PP_CM_INPUTS; i++) dot += (int64_t)cm->w[i] * cm->st[i];
+    int d = (int)(dot >> 16);
+    if (d > 2047) d = 2047;
+    if (d < -2047) d = -2047;
+    cm->pr_mix = pp_cm_squash(d);
+
+    // APM on the previous byte, interpolating between two of 33 bins
+    uint32_t s = (uint32_t)(d + 2048);
+    cm->apm_idx = (c0 | ((cm->c4 & 0xFF) << 8)) * 33 + (s >> 7);
+    cm->apm_wt = s & 127;
+    const uint16_t *a = cm->apm + cm->apm_idx;
+    int pr_apm = (a[0] * (128 - cm->apm_wt) + a[1] * cm->apm_wt) >> 11;
+
+    int p = (cm->pr_mix + 3 * pr_apm) >> 2;
+    return p < 1 ? 1 : (p > 4095 ? 4095 : p);
+}
+
+static inline void pp_cm_update(PP_CModel *cm, int bit) {
+    for (int i = 0; i < 2 + PP_CM_HASHED; i++) pp_cm_adapt(cm->cnt[i], bit);
+    if (cm->match_cnt) pp_cm_adapt(cm->match_cnt, bit);
 
-        free(output);
+    int err = (bit << 12) - cm->pr_mix;
+    for (int i = 0; i < PP_CM_INPUTS; i++) {
+        cm->w[i] += (cm->st[i] * err) >> PP_CM_MIXER_SHIFT;
     }
-    else if (strcmp(mode, "decompress") == 0) {
-        uint32_t output_size = input_size * 10;
-        uint8_t *output = (uint8_t*)malloc(output_size);
 
-        int result = pp_decompress(input, input_size, output, &output_size);
+    uint16_t *a = cm->apm + cm->apm_idx;
+    int g = (bit << 16) + (bit << 7) - bit - bit;
+    a[0] += (g - a[0]) >> 7;
+    a[1] += (g - a[1]) >> 7;
 
-        if (result == 0) {
-            FILE *fout = fopen(output_file, "wb");
-            fwrite(output, 1, output_size, fout);
-            fclose(fout);
-            printf("Decompression successful!\n");
+    cm->c0 = (cm->c0 << 1) | bit;
+    cm->bitpos++;
+    if (cm->bitpos == 4) pp_cm_set_slots(cm);
+}
+
+// Advance to the next byte once hist[pos] holds the byte just coded
+static void pp_cm_byte(PP_CModel *cm) {
+    uint32_t c = cm->c0 & 0xFF;
+    const uint8_t *hist = cm->hist;
+
+    cm->c8 = (cm->c8 << 8) | (cm->c4 >> 24);
+    cm->c4 = (cm->c4 << 8) | c;
+    cm->c0 = 1;
+    cm->bitpos = 0;
+    cm->pos++;
+
+    uint32_t lower = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+    if ((lower >= 'a' && lower <= 'z') || c >= 0x80) {
+        cm->word = (cm->word + lower + 1) * 0x2F0B4C1Du;
+    } else {
+        cm->word = 0;
+    }
+
+    cm->hash[0] = pp_cm_hash(cm->c4 & 0xFFFF, 2);
+    cm->hash[1] = pp_cm_hash(cm->c4 & 0xFFFFFF, 3);
+    cm->hash[2] = pp_cm_hash(cm->c4, 4);
+    cm->hash[3] = pp_cm_hash(cm->c4 ^ pp_cm_hash(cm->c8 & 0xFFFF, 6), 6);
+    cm->hash[4] = pp_cm_hash(cm->word ? cm->word : c, 7);
+
+    // Extend the current match, or look up a new one
+    if (cm->match_len) {
+        if (hist[cm->match_ptr] == c) {
+            cm->match_ptr++;
+            if (cm->match_len < 65535) cm->match_len++;
         } else {
-            printf("Decompression failed with code %d\n", result);
+            cm->match_len = 0;
+        }
+    }
+    if (cm->pos >= PP_CM_MATCH_MIN) {
+        uint32_t h = (cm->c4 * 0x9E3779B1u + (cm->c8 & 0xFFFF) * 0x85EBCA77u) >> (32 - PP_CM_MATCH_LOG);
+        if (cm->match_len == 0) {
+            uint32_t cand = cm->match_pos[h];
+            if (cand) {
+                uint32_t len = 0;
+                while (len < 32 && len < cand && hist[cand - 1 - len] == hist[cm->pos - 1 - len]) len++;
+                if (len >= PP_CM_MATCH_MIN) {
+                    cm->match_len = len;
+                    cm->match_ptr = cand;
+                }
+            }
+        }
+        cm->match_pos[h] = cm->pos;
+    }
+
+    pp_cm_set_slots(cm);
+}
+
+// Binary arithmetic coding of a block; returns bytes written, 0 if over cap
+static uint32_t pp_cm_encode(PP_CModel *cm, const uint8_t *src, uint32_t size,
+                             uint8_t *out, uint32_t cap) {
+    uint32_t x1 = 0, x2 = 0xFFFFFFFFu, n = 0;
+
+    pp_cm_reset(cm, src, size);
+    for (uint32_t i = 0; i < size; i++) {
+        uint32_t c = src[i];
+        for (int b = 7; b >= 0; b--) {
+            int bit = (c >> b) & 1;
+            uint32_t xmid = x1 + (uint32_t)(((uint64_t)(x2 - x1) * pp_cm_predict(cm)) >> 12);
+            if (bit) x2 = xmid; else x1 = xmid + 1;
+            pp_cm_update(cm, bit);
+
+            while (((x1 ^ x2) & 0xFF000000u) == 0) {
+                if (n >= cap) return 0;
+                out[n++] = (uint8_t)(x2 >> 24);
+                x1 <<= 8;
+                x2 = (x2 << 8) | 0xFF;
+            }
         }
+        pp_cm_byte(cm);
+    }
 
-        free(output);
+    for (int k = 0; k < 4; k++) {
+        if (n >= cap) return 0;
+        out[n++] = (uint8_t)(x1 >> 24);
+        x1 <<= 8;
     }
-    else {
-        printf("Error: Invalid mode. Use 'compress' or 'decompress'\n");
-        return 1;
+    return n;
+}
+
+static int pp_cm_decode(PP_CModel *cm, const uint8_t *in, uint32_t in_size,
+                        uint8_t *dst, uint32_t raw_size) {
+    uint32_t x1 = 0, x2 = 0xFFFFFFFFu, x = 0, n = 0;
+
+    for (int k = 0; k < 4; k++) x = (x << 8) | (n < in_size ? in[n++] : 0);
+
+    pp_cm_reset(cm, dst, raw_size);
+    for (uint32_t i = 0; i < raw_size; i++) {
+        for (int b = 0; b < 8; b++) {
+            uint32_t xmid = x1 + (uint32_t)(((uint64_t)(x2 - x1) * pp_cm_predict(cm)) >> 12);
+            int bit = x <= xmid;
+            if (bit) x2 = xmid; else x1 = xmid + 1;
+            pp_cm_update(cm, bit);
+
+            while (((x1 ^ x2) & 0xFF000000u) == 0) {
+                x1 <<= 8;
+                x2 = (x2 << 8) | 0xFF;
+                x = (x << 8) | (n < in_size ? in[n++] : 0);
+            }
+        }
+        dst[i] = (uint8_t)cm->c0;
+        pp_cm_byte(cm);
     }
 
-    free(input);
     return 0;
 }
+
+/* ---------- Match finder ---------- */
+
+// Positions ahead of the parser whose head slots are prefetched; their
+// first chain candidates are prefetched half as far ahead, once the head
+// slot has had time to arrive
+#define PP_PREFETCH_DISTANCE 16
+
+#if defined(__GNUC__)
+#define PP_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PP_PREFETCH(p) ((void)(p))
+#endif
+
+// Initialize hash value
+static inline uint32_t hash_func(const uint8_t *data, uint32_t bits) {
+    return (pp_read32(data) * PP_XXH_PRIME1) >> (32 - bits);
+}
+
+// Table bits for size positions: one slot per position, within
+// [PP_HASH_LOG_MIN, limit]
+static uint32_t pp_hash_log(uint32_t size, uint32_t limit) {
+    uint32_t log = PP_HASH_LOG_MIN;
+    while (log < limit && (1u << log) < size) log++;
+    return log;
+}
+
+// Initialize compression context
+static PP_Context* pp_init_context(const uint8_t *input, uint32_t input_size) {
+    PP_Context *ctx = (PP_Context*)calloc(1, sizeof(PP_Context));
+    if (!ctx) return NULL;
+
+    uint32_t block_cap = (input_size < PP_BLOCK_SIZE) ? input_size : PP_BLOCK_SIZE;
+    uint32_t max_seq = block_cap / PP_MIN_MATCH + 1;
+
+    ctx->input = input;
+    ctx->input_size = input_size;
+    ctx->output_size = block_cap + PP_BLOCK_HEADER_SIZE + 1024;
+    ctx->output = (uint8_t*)malloc(ctx->output_size);
+
+    // Small inputs get small tables: less to allocate and clear per call
+    uint32_t window = 1u << pp_hash_log(block_cap, 15); // Up to MAX_WINDOW_SIZE
+    ctx->hash_cap = pp_hash_log(block_cap, PP_HASH_LOG_MAX);
+    ctx->hash_table = (int32_t*)malloc(((size_t)1 << ctx->hash_cap) * sizeof(int32_t));
+    ctx->prev = (int32_t*)malloc(window * sizeof(int32_t));
+    ctx->window_mask = window - 1;
+
+    ctx->lit_buf = (uint8_t*)malloc(block_cap + 1);
+    ctx->seq_ll = (uint32_t*)malloc(max_seq * sizeof(uint32_t));
+    ctx->seq_ml = (uint32_t*)malloc(max_seq * sizeof(uint32_t));
+    ctx->seq_off = (uint32_t*)malloc(max_seq * sizeof(uint32_t));
+
+    if (!ctx->output || !ctx->hash_table || !ctx->prev || !ctx->lit_buf ||
+        !ctx->seq_ll || !ctx->seq_ml || !ctx->seq_off) {
+        free(ctx->output);
+        free(ctx->hash_table);
+        free(ctx->prev);
+        free(ctx->lit_buf);
+        free(ctx->seq_ll);
+        free(ctx->seq_ml);
+        free(ctx->seq_off);
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static void pp_free_context(PP_Context *ctx) {
+    if (!ctx) return;
+    free(ctx->output);
+    free(ctx->hash_table);
+    free(ctx->prev);
+    free(ctx->lit_buf);
+    free(ctx->seq_ll);
+    free(ctx->seq_ml);
+    free(ctx->seq_off);
+    free(ctx->filter_buf);
+    free(ctx->window);
+    free(ctx->row_pos);
+    free(ctx->row_tag);
+    free(ctx->row_head);
+    free(ctx->sa_buf);
+    free(ctx->opt);
+    free(ctx->ldm_table);
+    free(ctx->ldm_gear);
+    free(ctx->ldm_seq);
+    pp_cm_free(ctx->cm);
+    if (ctx->workers) {
+        for (int i = 0; i < ctx->threads - 1; i++) pp_free_context(ctx->workers[i]);
+        free(ctx->workers);
+    }
+    free(ctx);
+}
+
+// Prepare the match finder for a new block, with at most hash_log bits
+// of hash table
+static void pp_reset_block(PP_Context *ctx, const uint8_t *block, uint32_t block_size,
+                           uint32_t hash_log) {
+    ctx->input = block;
+    ctx->input_size = block_size;
+    ctx->prefix = 0;
+    ctx->lit_count = 0;
+    ctx->seq_count = 0;
+    ctx->linked = 0;
+    ctx->ldm_count = 0;
+    ctx->hash_log = pp_hash_log(block_size, hash_log < ctx->hash_cap ? hash_log : ctx->hash_cap);
+    memset(ctx->hash_table, -1, ((size_t)1 << ctx->hash_log) * sizeof(int32_t));
+}
+
+// Same, with the dictionary placed before the block and already hashed;
+// returns -1 if the window cannot be allocated
+static int pp_reset_block_dict(PP_Context *ctx, const uint8_t *block, uint32_t block_size) {
+    const PP_Dict *dict = ctx->dict;
+    if (!ctx->window) ctx->window = (uint8_t*)malloc(MAX_WINDOW_SIZE + PP_BLOCK_SIZE);
+    if (!ctx->window) return -1;
+
+    // The prehashed tables need full-size ones; contexts made for small
+    // inputs grow on their first dictionary block
+    if (ctx->hash_cap < HASH_BITS) {
+        int32_t *table = (int32_t*)realloc(ctx->hash_table, HASH_SIZE * sizeof(int32_t));
+        if (!table) return -1;
+        ctx->hash_table = table;
+        ctx->hash_cap = HASH_BITS;
+    }
+    if (ctx->window_mask != MAX_WINDOW_SIZE - 1) {
+        int32_t *prev = (int32_t*)realloc(ctx->prev, MAX_WINDOW_SIZE * sizeof(int32_t));
+        if (!prev) return -1;
+        ctx->prev = prev;
+        ctx->window_mask = MAX_WINDOW_SIZE - 1;
+    }
+
+    memcpy(ctx->window, dict->data, dict->size);
+    memcpy(ctx->window + dict->size, block, block_size);
+    ctx->input = ctx->window;
+    ctx->input_size = dict->size + block_size;
+    ctx->prefix = dict->size;
+    ctx->lit_count = 0;
+    ctx->seq_count = 0;
+    ctx->linked = 0;
+    ctx->ldm_count = 0;
+    ctx->hash_log = HASH_BITS;
+    memcpy(ctx->hash_table, dict->hash_table, HASH_SIZE * sizeof(int32_t));
+    memcpy(ctx->prev, dict->prev, MAX_WINDOW_SIZE * sizeof(int32_t));
+    return 0;
+}
+
+// History a linked block sees through the match finders' input
+static inline uint32_t pp_link_history(const PP_Context *ctx) {
+    return ctx->frame_pos < MAX_WINDOW_SIZE ? ctx->frame_pos : MAX_WINDOW_SIZE;
+}
+
+// Same, for a block of a linked frame: input starts at the last
+// MAX_WINDOW_SIZE bytes of frame history, hashed when the block is parsed.
+// Matches further back come from the long-distance matcher.
+static void pp_reset_block_linked(PP_Context *ctx, uint32_t block_size, uint32_t hash_log) {
+    uint32_t hist = pp_link_history(ctx), far = ctx->ldm_count;
+    pp_reset_block(ctx, ctx->frame + ctx->frame_pos - hist, hist + block_size, hash_log);
+    ctx->prefix = hist;
+    ctx->linked = 1;
+    ctx->ldm_count = far;
+}
+
+// Count matching bytes between a and b, up to limit
+static inline uint32_t pp_count_match(const uint8_t *a, const uint8_t *b, uint32_t limit) {
+    uint32_t len = 0;
+    while (len + 8 <= limit) {
+        uint64_t diff = pp_read64(a + len) ^ pp_read64(b + len);
+        if (diff) return len + (__builtin_ctzll(diff) >> 3);
+        len += 8;
+    }
+    while (len < limit && a[len] == b[len]) len++;
+    return len;
+}
+
+// Length of the run of bytes equal to p[-1] starting at p, up to limit
+static inline uint32_t pp_run_length(const uint8_t *p, uint32_t limit) {
+    uint64_t pattern = p[-1] * 0x0101010101010101ULL;
+    uint32_t len = 0;
+    while (len + 8 <= limit) {
+        uint64_t diff = pp_read64(p + len) ^ pattern;
+        if (diff) return len + (__builtin_ctzll(diff) >> 3);
+        len += 8;
+    }
+    while (len < limit && p[len] == p[-1]) len++;
+    return len;
+}
+
+// Row and tag of a position: the hash's high bits pick the row, its low
+// byte is the tag
+static inline uint32_t pp_row_hash(const uint8_t *data, uint32_t row_log) {
+    return (pp_read32(data) * PP_XXH_PRIME1) >> (32 - row_log - 8);
+}
+
+// Empty every row; returns -1 if the tables cannot be allocated
+static int pp_row_reset(PP_Context *ctx) {
+    if (!ctx->row_pos) {
+        ctx->row_pos = (uint32_t*)malloc(PP_ROW_COUNT * PP_ROW_ENTRIES * sizeof(uint32_t));
+        ctx->row_tag = (uint8_t*)malloc(PP_ROW_COUNT * PP_ROW_ENTRIES);
+        ctx->row_head = (uint8_t*)malloc(PP_ROW_COUNT);
+    }
+    if (!ctx->row_pos || !ctx->row_tag || !ctx->row_head) return -1;
+
+    // About two slots per position of the block, dictionary included.
+    // Empty slots hold UINT32_MAX, which is never before the current position.
+    ctx->row_log = pp_hash_log(ctx->input_size, PP_ROW_LOG + 4) - 4;
+    uint32_t rows = 1u << ctx->row_log;
+    memset(ctx->row_pos, 0xFF, rows * PP_ROW_ENTRIES * sizeof(uint32_t));
+    memset(ctx->row_tag, 0, rows * PP_ROW_ENTRIES);
+    memset(ctx->row_head, 0, rows);
+    return 0;
+}
+
+static inline void pp_row_insert(PP_Context *ctx, uint32_t pos) {
+    uint32_t hash = pp_row_hash(ctx->input + pos, ctx->row_log);
+    uint32_t row = hash >> 8;
+    uint32_t head = (ctx->row_head[row] - 1) & (PP_ROW_ENTRIES - 1);
+    ctx->row_head[row] = (uint8_t)head;
+    ctx->row_pos[row * PP_ROW_ENTRIES + head] = pos;
+    ctx->row_tag[row * PP_ROW_ENTRIES + head] = (uint8_t)hash;
+}
+
+// Bit i set when slot i of the row carries tag
+static inline uint32_t pp_row_match_tags(const uint8_t *tags, uint8_t tag) {
+#if defined(__SSE2__)
+    __m128i t = _mm_set1_epi8((char)tag);
+    uint32_t lo = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)tags), t));
+    uint32_t hi = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(tags + 16)), t));
+    return lo | (hi << 16);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < PP_ROW_ENTRIES; i++) mask |= (uint32_t)(tags[i] == tag) << i;
+    return mask;
+#endif
+}
+
+// Longest match among the row's entries whose tag matches, newest first
+static LZ77_Match pp_find_row_match(PP_Context *ctx, uint32_t pos) {
+    LZ77_Match match = {0, 0};
+    const uint8_t *cur = ctx->input + pos;
+    uint32_t hash = pp_row_hash(cur, ctx->row_log);
+    uint32_t row = hash >> 8;
+    uint32_t head = ctx->row_head[row];
+    const uint32_t *slots = ctx->row_pos + row * PP_ROW_ENTRIES;
+
+    // Rotate so bit 0 is the newest slot
+    uint32_t mask = pp_row_match_tags(ctx->row_tag + row * PP_ROW_ENTRIES, (uint8_t)hash);
+    if (head) mask = (mask >> head) | (mask << (PP_ROW_ENTRIES - head));
+
+    uint32_t best_len = PP_MIN_MATCH - 1;
+    uint32_t best_offset = 0;
+    uint32_t max_match = (ctx->input_size - pos < MAX_LOOKAHEAD) ?
+                         ctx->input_size - pos : MAX_LOOKAHEAD;
+    uint32_t limit = ctx->chain_limit;
+    uint32_t good = ctx->good_length;
+    uint32_t nice = ctx->nice_length < max_match ? ctx->nice_length : max_match;
+
+    for (; mask && limit > 0; mask &= mask - 1, limit--) {
+        uint32_t cand_pos = slots[(head + __builtin_ctz(mask)) & (PP_ROW_ENTRIES - 1)];
+        if (cand_pos >= pos) continue;
+        uint32_t offset = pos - cand_pos;
+        if (offset > MAX_WINDOW_SIZE) break; // Older slots are further away
+
+        const uint8_t *cand = ctx->input + cand_pos;
+        if (cand[best_len] == cur[best_len] && pp_read32(cand) == pp_read32(cur)) {
+            uint32_t len = pp_count_match(cand, cur, max_match);
+            if (len > best_len) {
+                best_len = len;
+                best_offset = offset;
+                if (len >= nice) break;
+                if (len >= good) {
+                    limit = (limit >> 2) + 1; // Still decremented by the loop
+                    good = UINT32_MAX;
+                }
+            }
+        }
+    }
+
+    if (best_len >= PP_MIN_MATCH) {
+        match.length = best_len;
+        match.offset = best_offset;
+        ctx->stats.matches_found++;
+    }
+    return match;
+}
+
+// Find longest match using hash chains
+static LZ77_Match pp_find_longest_match(PP_Context *ctx, uint32_t pos) {
+    LZ77_Match match = {0, 0};
+
+    if (pos + PP_MIN_MATCH > ctx->input_size) {
+        return match;
+    }
+    if (ctx->rows) return pp_find_row_match(ctx, pos);
+
+    const uint8_t *cur = ctx->input + pos;
+    uint32_t hash = hash_func(cur, ctx->hash_log);
+    int32_t chain_pos = ctx->hash_table[hash];
+    uint32_t best_len = PP_MIN_MATCH - 1;
+    uint32_t best_offset = 0;
+    uint32_t max_match = (ctx->input_size - pos < MAX_LOOKAHEAD) ?
+                         ctx->input_size - pos : MAX_LOOKAHEAD;
+
+    uint32_t chain_limit = ctx->chain_limit;
+    uint32_t good = ctx->good_length;
+    uint32_t nice = ctx->nice_length < max_match ? ctx->nice_length : max_match;
+
+    while (chain_pos >= 0 && chain_limit-- > 0) {
+        uint32_t offset = pos - chain_pos;
+
+        if (offset > MAX_WINDOW_SIZE) break;
+        if (offset == 0) break;
+
+        // Start fetching the next candidate while this one is compared
+        int32_t next = ctx->prev[chain_pos & ctx->window_mask];
+        if (next >= 0) {
+            PP_PREFETCH(ctx->input + next);
+            PP_PREFETCH(&ctx->prev[next & ctx->window_mask]);
+        }
+
+        // Quick check for potential match
+        const uint8_t *cand = ctx->input + chain_pos;
+        if (cand[best_len] == cur[best_len] && pp_read32(cand) == pp_read32(cur)) {
+            uint32_t len = pp_count_match(cand, cur, max_match);
+
+            if (len > best_len) {
+                best_len = len;
+                best_offset = offset;
+
+                if (len >= nice) break; // Long enough, or can't do better
+
+                // A good match already: only a short tail of the chain
+                // is likely to beat it
+                if (len >= good) {
+                    chain_limit >>= 2;
+                    good = UINT32_MAX;
+                }
+            }
+        }
+
+        if (next >= chain_pos) break; // Slot reused by a newer position
+        chain_pos = next;
+    }
+
+    if (best_len >= PP_MIN_MATCH) {
+        match.length = best_len;
+        match.offset = best_offset;
+        ctx->stats.matches_found++;
+    }
+
+    return match;
+}
+
+// Update hash chains
+static void pp_update_hash(PP_Context *ctx, uint32_t pos) {
+    if (pos + PP_MIN_MATCH > ctx->input_size) return;
+    if (ctx->rows) {
+        pp_row_insert(ctx, pos);
+        return;
+    }
+
+    uint32_t hash = hash_func(&ctx->input[pos], ctx->hash_log);
+    ctx->prev[pos & ctx->window_mask] = ctx->hash_table[hash];
+    ctx->hash_table[hash] = pos;
+}
+
+// Issue the loads a search at pos will depend on before it gets there:
+// the head slot for pos + PP_PREFETCH_DISTANCE, and for the nearer
+// pos + PP_PREFETCH_DISTANCE / 2 (whose slot was requested earlier) the
+// bytes and chain link of its first candidate
+static inline void pp_prefetch_match(const PP_Context *ctx, uint32_t pos) {
+    uint32_t near = pos + PP_PREFETCH_DISTANCE / 2, far = pos + PP_PREFETCH_DISTANCE;
+    if (ctx->rows) {
+        // Tags and positions of the row; candidates are recent enough to
+        // be cached already
+        if (far + PP_MIN_MATCH <= ctx->input_size) {
+            uint32_t row = pp_row_hash(ctx->input + far, ctx->row_log) >> 8;
+            PP_PREFETCH(ctx->row_tag + row * PP_ROW_ENTRIES);
+            PP_PREFETCH(ctx->row_pos + row * PP_ROW_ENTRIES);
+            PP_PREFETCH(ctx->row_pos + row * PP_ROW_ENTRIES + 16);
+        }
+        return;
+    }
+    if (far + PP_MIN_MATCH <= ctx->input_size) {
+        PP_PREFETCH(&ctx->hash_table[hash_func(ctx->input + far, ctx->hash_log)]);
+    }
+    if (near + PP_MIN_MATCH <= ctx->input_size) {
+        int32_t head = ctx->hash_table[hash_func(ctx->input + near, ctx->hash_log)];
+        if (head >= 0) {
+            PP_PREFETCH(ctx->input + head);
+            PP_PREFETCH(&ctx->prev[head & ctx->window_mask]);
+        }
+    }
+}
+
+// Insert [from, to) into the hash chains, prefetching head slots ahead
+// (past to as well: the search resumes there)
+static void pp_update_hash_range(PP_Context *ctx, uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; i++) {
+        if (i + PP_PREFETCH_DISTANCE + PP_MIN_MATCH <= ctx->input_size) {
+            const uint8_t *ahead = ctx->input + i + PP_PREFETCH_DISTANCE;
+            if (ctx->rows) {
+                // Insertion touches the tag, the head and one position line
+                uint32_t row = pp_row_hash(ahead, ctx->row_log) >> 8;
+                PP_PREFETCH(ctx->row_tag + row * PP_ROW_ENTRIES);
+                PP_PREFETCH(&ctx->row_head[row]);
+            } else {
+                PP_PREFETCH(&ctx->hash_table[hash_func(ahead, ctx->hash_log)]);
+            }
+        }
+        pp_update_hash(ctx, i);
+    }
+}
+
+// Insert the positions a match covered, sparsely for long matches: the
+// tail stays dense since the next searches reach it first
+static void pp_update_hash_match(PP_Context *ctx, uint32_t from, uint32_t to, uint32_t step) {
+    if (step > 1 && to > from + PP_SPARSE_MIN) {
+        uint32_t tail = to - PP_SPARSE_TAIL;
+        for (; from < tail; from += step) pp_update_hash(ctx, from);
+        from = tail;
+    }
+    pp_update_hash_range(ctx, from, to);
+}
+
+/* ---------- Long-distance matcher ---------- */
+
+// Hash chains stop at MAX_WINDOW_SIZE. Linked frames find older repeats by
+// content instead: anchors fall on the same bytes wherever a region repeats,
+// so one table slot per anchor reaches back over the whole window, and each
+// hit is extended both ways into a single long match.
+
+// Size the table for a frame covering span bytes and empty it; returns -1
+// if the matcher cannot be allocated
+static int pp_ldm_reset(PP_Context *ctx, uint32_t span) {
+    uint32_t log = pp_hash_log(span >> PP_LDM_SPLIT_LOG, PP_LDM_LOG_MAX);
+
+    if (!ctx->ldm_gear) {
+        ctx->ldm_gear = (uint64_t*)malloc(256 * sizeof(uint64_t));
+        ctx->ldm_seq = (PP_LdmMatch*)malloc((PP_BLOCK_SIZE / PP_LDM_MIN + 1) * sizeof(PP_LdmMatch));
+        if (!ctx->ldm_gear || !ctx->ldm_seq) return -1;
+
+        // splitmix64: any fixed table of well-mixed words will do
+        uint64_t x = 0;
+        for (int i = 0; i < 256; i++) {
+            uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            ctx->ldm_gear[i] = z ^ (z >> 31);
+        }
+    }
+    if (!ctx->ldm_table || log > ctx->ldm_log) {
+        free(ctx->ldm_table);
+        ctx->ldm_table = (PP_LdmEntry*)malloc(sizeof(PP_LdmEntry) << log);
+        if (!ctx->ldm_table) return -1;
+    }
+    ctx->ldm_log = log;
+    memset(ctx->ldm_table, 0xFF, sizeof(PP_LdmEntry) << log);
+    return 0;
+}
+
+// Collect the long matches of the block at ctx->frame_pos into ctx->ldm_seq,
+// at positions within the input pp_reset_block_linked sets up, and insert
+// the block's anchors
+static void pp_ldm_scan(PP_Context *ctx, uint32_t size) {
+    const uint8_t *in = ctx->frame;
+    uint32_t start = ctx->frame_pos, end = start + size;
+    uint32_t base = start - pp_link_history(ctx);
+    uint32_t from = start > PP_LDM_SPAN ? start - PP_LDM_SPAN : 0;
+    uint32_t done = start;   // Covered by the last match
+    uint32_t shift = 64 - ctx->ldm_log;
+    uint64_t h = 0;
+
+    ctx->ldm_count = 0;
+    for (uint32_t p = from; p < end; p++) {
+        // The shift ages bytes out after PP_LDM_SPAN steps
+        h = (h << 1) + ctx->ldm_gear[in[p]];
+        if (p < start || p + 1 < PP_LDM_SPAN || (h >> (64 - PP_LDM_SPLIT_LOG)) != 0) continue;
+
+        uint32_t anchor = p + 1 - PP_LDM_SPAN;
+        PP_LdmEntry *e = &ctx->ldm_table[(h * 0x9E3779B97F4A7C15ull) >> shift];
+        if (anchor >= done && e->pos != UINT32_MAX && e->check == (uint32_t)h &&
+            anchor - e->pos <= ctx->link_window) {
+            uint32_t len = pp_count_match(in + e->pos, in + anchor, end - anchor);
+            if (len >= PP_LDM_MIN) {
+                uint32_t a = anchor, b = e->pos;
+                while (a > done && b > 0 && in[a - 1] == in[b - 1]) { a--; b--; }
+
+                PP_LdmMatch *m = &ctx->ldm_seq[ctx->ldm_count++];
+                m->pos = a - base;
+                m->len = len + (anchor - a);
+                m->off = anchor - e->pos;
+                done = a + m->len;
+            }
+        }
+        e->pos = anchor;
+        e->check = (uint32_t)h;
+    }
+}
+
+/* ---------- Suffix-array match finder ---------- */
+
+// Strongest levels: suffix array (SA-IS) and LCP array over the history
+// and block, reduced in one stack pass to the two nearest earlier
+// positions in suffix order (the previous and next smaller values). One of
+// them is the longest previous match; together they give the optimal
+// parser its candidates in O(n), however repetitive the input.
+
+#define PP_SA_EMPTY -1
+
+// Bucket heads (end = 0) or tails (end = 1) of each symbol
+static void pp_sais_buckets(const int32_t *s, int32_t n, int32_t k, int32_t *bkt, int end) {
+    int32_t sum = 0;
+    memset(bkt, 0, k * sizeof(int32_t));
+    for (int32_t i = 0; i < n; i++) bkt[s[i]]++;
+    for (int32_t c = 0; c < k; c++) {
+        sum += bkt[c];
+        bkt[c] = end ? sum : sum - bkt[c];
+    }
+}
+
+// L-type suffixes from the sorted LMS ones, then S-type from those. The
+// virtual sentinel after s[n - 1] sorts first, so n - 1 is placed first.
+static void pp_sais_induce(const int32_t *s, int32_t *sa, const uint8_t *stype,
+                           int32_t n, int32_t k, int32_t *bkt) {
+    pp_sais_buckets(s, n, k, bkt, 0);
+    sa[bkt[s[n - 1]]++] = n - 1;
+    for (int32_t i = 0; i < n; i++) {
+        int32_t j = sa[i] - 1;
+        if (sa[i] > 0 && !stype[j]) sa[bkt[s[j]]++] = j;
+    }
+    pp_sais_buckets(s, n, k, bkt, 1);
+    for (int32_t i = n - 1; i >= 0; i--) {
+        int32_t j = sa[i] - 1;
+        if (sa[i] > 0 && stype[j]) sa[--bkt[s[j]]] = j;
+    }
+}
+
+#define PP_SAIS_LMS(i) ((i) > 0 && stype[i] && !stype[(i) - 1])
+
+// Suffix array of s[0..n) over symbols [0, k) (Nong, Zhang and Chan);
+// returns -1 if scratch memory cannot be allocated
+static int pp_sais(const int32_t *s, int32_t *sa, int32_t n, int32_t k) {
+    if (n == 0) return 0;
+    uint8_t *stype = (uint8_t*)malloc(n);
+    int32_t *bkt = (int32_t*)malloc(k * sizeof(int32_t));
+    if (!stype || !bkt) {
+        free(stype);
+        free(bkt);
+        return -1;
+    }
+
+    stype[n - 1] = 0;
+    for (int32_t i = n - 2; i >= 0; i--) {
+        stype[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && stype[i + 1]);
+    }
+
+    // Sort LMS substrings by inducing from their unsorted positions
+    pp_sais_buckets(s, n, k, bkt, 1);
+    for (int32_t i = 0; i < n; i++) sa[i] = PP_SA_EMPTY;
+    for (int32_t i = 1; i < n; i++) {
+        if (PP_SAIS_LMS(i)) sa[--bkt[s[i]]] = i;
+    }
+    pp_sais_induce(s, sa, stype, n, k, bkt);
+
+    // Name them; equal substrings share a name
+    int32_t n1 = 0;
+    for (int32_t i = 0; i < n; i++) {
+        if (PP_SAIS_LMS(sa[i])) sa[n1++] = sa[i];
+    }
+    for (int32_t i = n1; i < n; i++) sa[i] = PP_SA_EMPTY;
+    int32_t name = 0, prev = -1;
+    for (int32_t i = 0; i < n1; i++) {
+        int32_t pos = sa[i], diff = prev < 0;
+        for (int32_t d = 0; !diff; d++) {
+            // The sentinel is unique, so reaching it means a difference
+            if (pos + d == n || prev + d == n || s[pos + d] != s[prev + d] ||
+                stype[pos + d] != stype[prev + d]) {
+                diff = 1;
+            } else if (d > 0 && (PP_SAIS_LMS(pos + d) || PP_SAIS_LMS(prev + d))) {
+                break;
+            }
+        }
+        if (diff) {
+            name++;
+            prev = pos;
+        }
+        sa[n1 + pos / 2] = name - 1;
+    }
+    for (int32_t i = n - 1, j = n - 1; i >= n1; i--) {
+        if (sa[i] >= 0) sa[j--] = sa[i];
+    }
+
+    // Order of the LMS suffixes: recurse while names repeat
+    int32_t *s1 = sa + n - n1;
+    int result = 0;
+    if (name < n1) {
+        result = pp_sais(s1, sa, n1, name);
+    } else {
+        for (int32_t i = 0; i < n1; i++) sa[s1[i]] = i;
+    }
+
+    // Seed the buckets with the sorted LMS suffixes and induce the rest
+    if (result == 0) {
+        for (int32_t i = 1, j = 0; i < n; i++) {
+            if (PP_SAIS_LMS(i)) s1[j++] = i;
+        }
+        for (int32_t i = 0; i < n1; i++) sa[i] = s1[sa[i]];
+        for (int32_t i = n1; i < n; i++) sa[i] = PP_SA_EMPTY;
+        pp_sais_buckets(s, n, k, bkt, 1);
+        for (int32_t i = n1 - 1; i >= 0; i--) {
+            int32_t j = sa[i];
+            sa[i] = PP_SA_EMPTY;
+            sa[--bkt[s[j]]] = j;
+        }
+        pp_sais_induce(s, sa, stype, n, k, bkt);
+    }
+    free(stype);
+    free(bkt);
+    return result;
+}
+
+#undef PP_SAIS_LMS
+
+// Grow the per-position arrays to n entries; -1 on allocation failure
+static int pp_sa_reserve(PP_Context *ctx, uint32_t n) {
+    if (ctx->sa_cap >= n) return 0;
+    free(ctx->sa_buf);
+    ctx->sa_buf = (int32_t*)malloc((size_t)n * 8 * sizeof(int32_t));
+    ctx->sa_cap = ctx->sa_buf ? n : 0;
+    return ctx->sa_buf ? 0 : -1;
+}
+
+// For each position of ctx->input, the earlier positions just before and
+// after it in suffix order with their match lengths (ctx->sa_prev/next,
+// -1 when absent). Returns -1 if memory runs out.
+static int pp_sa_candidates(PP_Context *ctx) {
+    int32_t n = (int32_t)ctx->input_size;
+    const uint8_t *in = ctx->input;
+    if (pp_sa_reserve(ctx, ctx->input_size) != 0) return -1;
+
+    int32_t *sa = ctx->sa_buf;
+    int32_t *work = sa + ctx->sa_cap;         // Phi, then the stack
+    int32_t *lcp = work + ctx->sa_cap;
+    int32_t *gap = lcp + ctx->sa_cap;
+    ctx->sa_prev = gap + ctx->sa_cap;         // Symbols while sorting
+    ctx->sa_next = ctx->sa_prev + ctx->sa_cap;
+    ctx->sa_prev_len = (uint32_t*)(ctx->sa_next + ctx->sa_cap);
+    ctx->sa_next_len = ctx->sa_prev_len + ctx->sa_cap;
+
+    int32_t *text = ctx->sa_prev;
+    for (int32_t i = 0; i < n; i++) text[i] = in[i];
+    if (pp_sais(text, sa, n, 256) != 0) return -1;
+
+    // LCP of each suffix with its predecessor in suffix order, computed in
+    // text order through phi (Kasai et al., Karkkainen et al.)
+    int32_t *phi = work, *plcp = gap;
+    phi[sa[0]] = -1;
+    for (int32_t r = 1; r < n; r++) phi[sa[r]] = sa[r - 1];
+    for (int32_t i = 0, h = 0; i < n; i++) {
+        int32_t j = phi[i];
+        if (j < 0) {
+            plcp[i] = h = 0;
+            continue;
+        }
+        while (i + h < n && j + h < n && in[i + h] == in[j + h]) h++;
+        plcp[i] = h;
+        if (h > 0) h--;
+    }
+    for (int32_t r = 0; r < n; r++) lcp[r] = plcp[sa[r]];
+
+    // Nearest smaller text position on each side of every rank. The stack
+    // holds ranks with increasing positions; gap[k] is the LCP minimum
+    // between entries k and k + 1, run the minimum from the top to rank r.
+    int32_t *stack = work, top = -1, run = 0;
+    for (int32_t r = 0; r <= n; r++) {
+        int32_t p = r < n ? sa[r] : -1;       // Rank n: a sentinel below all
+        if (r < n && top >= 0 && lcp[r] < run) run = lcp[r];
+        while (top >= 0 && sa[stack[top]] > p) {
+            int32_t q = sa[stack[top]];
+            ctx->sa_next[q] = p;
+            ctx->sa_next_len[q] = p >= 0 ? (uint32_t)run : 0;
+            if (--top >= 0 && gap[top] < run) run = gap[top];
+        }
+        if (r == n) break;
+        ctx->sa_prev[p] = top >= 0 ? sa[stack[top]] : -1;
+        ctx->sa_prev_len[p] = top >= 0 ? (uint32_t)run : 0;
+        if (top >= 0) gap[top] = run;
+        stack[++top] = r;
+        run = INT32_MAX;
+    }
+    return 0;
+}
+
+/* ---------- Dictionaries ---------- */
+
+void pp_dict_free(PP_Dict *dict) {
+    if (!dict) return;
+    free(dict->data);
+    free(dict->hash_table);
+    free(dict->prev);
+    free(dict);
+}
+
+// Build a dictionary from sample content; only the last MAX_WINDOW_SIZE
+// bytes are reachable from a block, so only those are kept
+PP_Dict* pp_dict_create(const uint8_t *data, uint32_t size) {
+    if (!data || size < PP_MIN_MATCH) return NULL;
+    if (size > MAX_WINDOW_SIZE) {
+        data += size - MAX_WINDOW_SIZE;
+        size = MAX_WINDOW_SIZE;
+    }
+
+    PP_Dict *dict = (PP_Dict*)calloc(1, sizeof(PP_Dict));
+    if (!dict) return NULL;
+    dict->data = (uint8_t*)malloc(size);
+    dict->hash_table = (int32_t*)malloc(HASH_SIZE * sizeof(int32_t));
+    dict->prev = (int32_t*)malloc(MAX_WINDOW_SIZE * sizeof(int32_t));
+    if (!dict->data || !dict->hash_table || !dict->prev) {
+        pp_dict_free(dict);
+        return NULL;
+    }
+
+    memcpy(dict->data, data, size);
+    dict->size = size;
+    dict->id = pp_xxh32(data, size, 0);
+    if (dict->id == 0) dict->id = 1;
+
+    memset(dict->hash_table, -1, HASH_SIZE * sizeof(int32_t));
+    memset(dict->prev, -1, MAX_WINDOW_SIZE * sizeof(int32_t));
+    for (uint32_t pos = 0; pos + PP_MIN_MATCH <= size; pos++) {
+        uint32_t hash = hash_func(data + pos, HASH_BITS);
+        dict->prev[pos] = dict->hash_table[hash];
+        dict->hash_table[hash] = (int32_t)pos;
+    }
+    return dict;
+}
+
+// Load a dictionary file; NULL if unreadable or too short
+PP_Dict* pp_dict_load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    off_t size = (fseeko(f, 0, SEEK_END) == 0) ? ftello(f) : -1;
+    off_t start = size > MAX_WINDOW_SIZE ? size - MAX_WINDOW_SIZE : 0;
+    uint8_t *data = (uint8_t*)malloc(MAX_WINDOW_SIZE);
+    PP_Dict *dict = NULL;
+    if (data && size > 0 && fseeko(f, start, SEEK_SET) == 0 &&
+        fread(data, 1, (size_t)(size - start), f) == (size_t)(size - start)) {
+        dict = pp_dict_create(data, (uint32_t)(size - start));
+    }
+    fclose(f);
+    free(data);
+    return dict;
+}
+
+uint32_t pp_dict_id(const PP_Dict *dict) {
+    return dict ? dict->id : 0;
+}
+
+/* ---------- Analysis ---------- */
+
+// Detect file type for optimization
+static uint8_t pp_detect_filetype(const uint8_t *data, uint32_t size) {
+    if (size < 4) return PP_FILETYPE_BINARY;
+
+    // Check for common file signatures
+    if (memcmp(data, "\x89PNG", 4) == 0) return PP_FILETYPE_PNG;
+    if (memcmp(data, "\xFF\xD8\xFF", 3) == 0) return PP_FILETYPE_JPEG;
+    if (memcmp(data, "GIF8", 4) == 0) return PP_FILETYPE_GIF;
+    if (memcmp(data, "\x50\x4B\x03\x04", 4) == 0) return PP_FILETYPE_ZIP;
+    if (memcmp(data, "%PDF", 4) == 0) return PP_FILETYPE_PDF;
+    if (memcmp(data, "\x1F\x8B", 2) == 0) return PP_FILETYPE_GZIP;
+    if (memcmp(data, "BZh", 3) == 0 ||
+        memcmp(data, "\x28\xB5\x2F\xFD", 4) == 0 ||
+        (size >= 6 && (memcmp(data, "\xFD" "7zXZ", 5) == 0 ||
+                       memcmp(data, "7z\xBC\xAF\x27\x1C", 6) == 0))) {
+        return PP_FILETYPE_PACKED;
+    }
+
+    // Check for text-based content
+    uint32_t text_chars = 0;
+    uint32_t sample_size = (size < 1024) ? size : 1024;
+    for (uint32_t i = 0; i < sample_size; i++) {
+        // Branch-free so that the loop vectorizes: small messages pay it per call
+        uint8_t c = data[i];
+        text_chars += ((uint8_t)(c - 32) < 95) | (c == '\n') | (c == '\r') | (c == '\t');
+    }
+
+    if (text_chars > sample_size * 0.9) return PP_FILETYPE_TEXT;
+
+    return PP_FILETYPE_BINARY;
+}
+
+// log2(x) in 8.8 fixed point (linear interpolation of the mantissa)
+static inline uint32_t pp_log2_q8(uint32_t x) {
+    uint32_t hb = pp_highbit(x);
+    uint32_t frac = (hb >= 8) ? (x >> (hb - 8)) & 0xFF : (x << (8 - hb)) & 0xFF;
+    return (hb << 8) | frac;
+}
+
+#define PP_EST_CHUNKS 16
+#define PP_EST_CHUNK_SIZE 1024
+#define PP_EST_PROBE_BITS 12
+
+// Sample a block: order-0 entropy over evenly spread chunks, plus the hit
+// rate of a sparse 4-byte hash probe over the same chunks
+static PP_BlockEstimate pp_estimate_block(const uint8_t *data, uint32_t size) {
+    PP_BlockEstimate est = {0, 0};
+    uint32_t hist[4][256];
+    uint32_t probe[1 << PP_EST_PROBE_BITS];
+    uint32_t chunks, chunk_size, stride;
+    uint32_t sampled = 0, probes = 0, hits = 0;
+
+    if (size < 16) {
+        est.entropy = 8 << 8;
+        return est;
+    }
+
+    if (size <= PP_EST_CHUNKS * PP_EST_CHUNK_SIZE) {
+        chunks = 1;
+        chunk_size = size;
+        stride = size;
+    } else {
+        chunks = PP_EST_CHUNKS;
+        chunk_size = PP_EST_CHUNK_SIZE;
+        stride = size / PP_EST_CHUNKS;
+    }
+
+    memset(hist, 0, sizeof(hist));
+    memset(probe, 0, sizeof(probe));
+
+    for (uint32_t c = 0; c < chunks; c++) {
+        const uint8_t *p = data + c * stride;
+        uint32_t n = chunk_size & ~15u;
+
+        // Four interleaved sub-histograms break the store-to-load dependency
+        // between consecutive equal bytes
+        for (uint32_t i = 0; i < n; i += 16) {
+            uint64_t a = pp_read64(p + i);
+            uint64_t b = pp_read64(p + i + 8);
+            for (int k = 0; k < 64; k += 16) {
+                hist[0][(a >> k) & 0xFF]++;
+                hist[1][(a >> (k + 8)) & 0xFF]++;
+                hist[2][(b >> k) & 0xFF]++;
+                hist[3][(b >> (k + 8)) & 0xFF]++;
+            }
+        }
+        sampled += n;
+
+        // Sparse probe every 4th position; positions are chunk-relative + 1
+        for (uint32_t i = 0; i + 4 <= n; i += 4) {
+            uint32_t v = pp_read32(p + i);
+            uint32_t h = (v * PP_XXH_PRIME1) >> (32 - PP_EST_PROBE_BITS);
+            uint32_t cand = probe[h];
+            if (cand && pp_read32(data + cand - 1) == v) hits++;
+            probe[h] = (uint32_t)(p + i - data) + 1;
+            probes++;
+        }
+    }
+
+    // H = log2(N) - (1/N) * sum(c * log2(c))
+    uint64_t sum = 0;
+    for (int s = 0; s < 256; s++) {
+        uint32_t c = hist[0][s] + hist[1][s] + hist[2][s] + hist[3][s];
+        if (c) sum += (uint64_t)c * pp_log2_q8(c);
+    }
+    int64_t entropy = (int64_t)pp_log2_q8(sampled) - (int64_t)(sum / sampled);
+    est.entropy = entropy < 0 ? 0 : (uint32_t)entropy;
+    est.match_rate = probes ? (hits * 1024) / probes : 0;
+    return est;
+}
+
+// Pick the store, fast or strong path for a block
+static int pp_route_block(const PP_BlockEstimate *est, uint8_t level) {
+    // Near-random bytes with no repeats: LZ cannot win
+    if (est->entropy >= (7 << 8) + 160 && est->match_rate < 16) {
+        return PP_ROUTE_STORE;
+    }
+    // High entropy and few repeats: a deep search will not pay for itself
+    if (level > 2 && est->entropy >= (6 << 8) + 128 && est->match_rate < 128) {
+        return PP_ROUTE_FAST;
+    }
+    return (level > 2) ? PP_ROUTE_STRONG : PP_ROUTE_FAST;
+}
+
+/* ---------- Structured-text filter ---------- */
+
+// Delimiters split text into words; a token is a frequent word together with
+// its surrounding delimiters, e.g. ,"level":" in JSON or ;status= in logs
+static inline int pp_text_is_delim(uint8_t c) {
+    switch (c) {
+        case ' ': case '\t': case '\n': case '\r': case '"': case '\'':
+        case ',': case ':': case ';': case '=': case '{': case '}':
+        case '[': case ']': case '(': case ')': case '<': case '>':
+        case '/': case '|': case '&': case '?': case '-': case '.':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+typedef struct {
+    uint32_t hash;
+    uint32_t count;
+    uint32_t pos;
+    uint32_t len;
+} PP_TextSlot;
+
+// Choose tokens for a block. Codes are byte values absent from the block, so
+// the transformed stream needs no escaping. Returns the number of tokens.
+static uint32_t pp_text_select(const uint8_t *data, uint32_t size, PP_TextTokens *tokens) {
+    uint32_t hist[256] = {0};
+    uint32_t printable = 0;
+    PP_TextSlot *slots;
+
+    tokens->count = 0;
+    if (size < 4096) return 0;
+
+    for (uint32_t i = 0; i < size; i++) hist[data[i]]++;
+    for (int c = 32; c < 127; c++) printable += hist[c];
+    printable += hist['\n'] + hist['\r'] + hist['\t'];
+    if (printable < size - size / 16) return 0;
+
+    uint8_t codes[PP_TEXT_MAX_TOKENS];
+    uint32_t free_codes = 0;
+    for (int c = 255; c >= 0; c--) {
+        if (!hist[c] && free_codes < PP_TEXT_MAX_TOKENS) codes[free_codes++] = (uint8_t)c;
+    }
+    if (free_codes < 8) return 0;
+
+    slots = (PP_TextSlot*)calloc(1u << PP_TEXT_SLOTS_LOG, sizeof(PP_TextSlot));
+    if (!slots) return 0;
+
+    // Count candidates over the first 64KB: up to 2 delimiters + word + up
+    // to 3 delimiters. Codes above must be absent from the whole block.
+    uint32_t scan = (size < 65536) ? size : 65536;
+    uint32_t mask = (1u << PP_TEXT_SLOTS_LOG) - 1;
+    uint32_t i = 0;
+    while (i < scan) {
+        if (pp_text_is_delim(data[i])) {
+            i++;
+            continue;
+        }
+        uint32_t w = i;
+        while (i < scan && !pp_text_is_delim(data[i])) i++;
+
+        uint32_t start = w;
+        while (start > 0 && w - start < 2 && pp_text_is_delim(data[start - 1])) start--;
+        uint32_t end = i;
+        while (end < scan && end - i < 3 && pp_text_is_delim(data[end])) end++;
+
+        uint32_t len = end - start;
+        if (len < PP_TEXT_MIN_LEN || len > PP_TEXT_MAX_LEN || i - w < 2) continue;
+
+        uint32_t h = pp_xxh32(data + start, len, 0);
+        for (uint32_t probe = 0; probe < 8; probe++) {
+            PP_TextSlot *slot = &slots[(h + probe) & mask];
+            if (slot->count == 0) {
+                slot->hash = h;
+                slot->count = 1;
+                slot->pos = start;
+                slot->len = len;
+                break;
+            }
+            if (slot->hash == h && slot->len == len &&
+                memcmp(data + slot->pos, data + start, len) == 0) {
+                slot->count++;
+                break;
+            }
+        }
+    }
+
+    // Keep the best-scoring candidates (saved bytes minus table cost)
+    int64_t score[PP_TEXT_MAX_TOKENS];
+    uint32_t pick[PP_TEXT_MAX_TOKENS];
+    uint32_t picked = 0;
+
+    for (uint32_t k = 0; k <= mask; k++) {
+        const PP_TextSlot *slot = &slots[k];
+        if (slot->count < 8) continue;
+
+        int64_t sc = (int64_t)slot->count * (slot->len - 1) - (slot->len + 2);
+        if (picked < free_codes) {
+            pick[picked] = k;
+            score[picked++] = sc;
+        } else {
+            uint32_t worst = 0;
+            for (uint32_t j = 1; j < picked; j++) {
+                if (score[j] < score[worst]) worst = j;
+            }
+            if (sc <= score[worst]) continue;
+            pick[worst] = k;
+            score[worst] = sc;
+        }
+    }
+
+    for (uint32_t j = 0; j < picked; j++) {
+        const PP_TextSlot *slot = &slots[pick[j]];
+        tokens->code[j] = codes[j];
+        tokens->len[j] = (uint8_t)slot->len;
+        memcpy(tokens->data[j], data + slot->pos, slot->len);
+    }
+    tokens->count = picked;
+
+    free(slots);
+    return picked;
+}
+
+// Replace tokens with their codes, longest token first at each position
+static uint32_t pp_text_encode(const uint8_t *data, uint32_t size,
+                               const PP_TextTokens *tokens, uint8_t *out) {
+    uint8_t order[PP_TEXT_MAX_TOKENS];
+    uint16_t bucket[257] = {0};
+    uint16_t fill[256];
+
+    // Bucket tokens by first byte, longest first within a bucket
+    for (uint32_t j = 0; j < tokens->count; j++) bucket[tokens->data[j][0] + 1]++;
+    for (int c = 0; c < 256; c++) bucket[c + 1] += bucket[c];
+    memcpy(fill, bucket, sizeof(fill));
+    for (uint32_t j = 0; j < tokens->count; j++) {
+        uint16_t a = fill[tokens->data[j][0]]++;
+        while (a > bucket[tokens->data[j][0]] && tokens->len[order[a - 1]] < tokens->len[j]) {
+            order[a] = order[a - 1];
+            a--;
+        }
+        order[a] = (uint8_t)j;
+    }
+
+    uint32_t head[PP_TEXT_MAX_TOKENS];
+    for (uint32_t j = 0; j < tokens->count; j++) head[j] = pp_read32(tokens->data[j]);
+
+    uint32_t op = 0;
+    uint32_t i = 0;
+    while (i < size) {
+        uint8_t c = data[i];
+        int matched = 0;
+
+        for (uint32_t a = bucket[c]; a < bucket[c + 1] && i + 4 <= size; a++) {
+            uint32_t j = order[a];
+            uint32_t len = tokens->len[j];
+            if (head[j] == pp_read32(data + i) && len <= size - i &&
+                memcmp(data + i, tokens->data[j], len) == 0) {
+                out[op++] = tokens->code[j];
+                i += len;
+                matched = 1;
+                break;
+            }
+        }
+        if (!matched) {
+            out[op++] = c;
+            i++;
+        }
+    }
+    return op;
+}
+
+// Token table: count (1), then per token code (1), length (1), bytes
+static uint32_t pp_text_write_table(const PP_TextTokens *tokens, uint8_t *out) {
+    uint32_t pos = 0;
+    out[pos++] = (uint8_t)tokens->count;
+    for (uint32_t j = 0; j < tokens->count; j++) {
+        out[pos++] = tokens->code[j];
+        out[pos++] = tokens->len[j];
+        memcpy(out + pos, tokens->data[j], tokens->len[j]);
+        pos += tokens->len[j];
+    }
+    return pos;
+}
+
+// Parse a token table; returns bytes consumed or 0 if malformed
+static uint32_t pp_text_read_table(const uint8_t *in, uint32_t in_size, PP_TextTokens *tokens) {
+    uint32_t pos = 0;
+    if (in_size < 1) return 0;
+    tokens->count = in[pos++];
+    if (tokens->count > PP_TEXT_MAX_TOKENS) return 0;
+
+    for (uint32_t j = 0; j < tokens->count; j++) {
+        if (in_size - pos < 2) return 0;
+        tokens->code[j] = in[pos++];
+        tokens->len[j] = in[pos++];
+        if (tokens->len[j] == 0 || tokens->len[j] > PP_TEXT_MAX_LEN ||
+            tokens->len[j] > in_size - pos) {
+            return 0;
+        }
+        memcpy(tokens->data[j], in + pos, tokens->len[j]);
+        pos += tokens->len[j];
+    }
+    return pos;
+}
+
+// Expand codes back into tokens; returns 0 on success
+static int pp_text_decode(const uint8_t *in, uint32_t in_size, const PP_TextTokens *tokens,
+                          uint8_t *out, uint32_t out_size) {
+    int16_t map[256];
+    for (int c = 0; c < 256; c++) map[c] = -1;
+    for (uint32_t j = 0; j < tokens->count; j++) map[tokens->code[j]] = (int16_t)j;
+
+    uint32_t op = 0;
+    for (uint32_t i = 0; i < in_size; i++) {
+        int16_t t = map[in[i]];
+        if (t < 0) {
+            if (op >= out_size) return -4;
+            out[op++] = in[i];
+        } else {
+            uint32_t len = tokens->len[t];
+            if (len > out_size - op) return -4;
+            memcpy(out + op, tokens->data[t], len);
+            op += len;
+        }
+    }
+    return (op == out_size) ? 0 : -4;
+}
+
+/* ---------- LZ block coding ---------- */
+
+// Parse a block into literals and sequences
+static void pp_lz_parse(PP_Context *ctx, const PP_LevelParams *params) {
+    uint32_t size = ctx->input_size;
+    uint32_t pos = ctx->prefix, anchor = pos, inserted = pos;
+
+    ctx->chain_limit = params->chain_limit;
+    ctx->good_length = params->good_length;
+    ctx->nice_length = params->nice_length;
+
+    // Rows are rebuilt per block, dictionary included; chains stay the
+    // fallback if their tables cannot be allocated. Chains over a linked
+    // block's history are built here too.
+    ctx->rows = params->row && pp_row_reset(ctx) == 0;
+    if (ctx->rows || ctx->linked) pp_update_hash_range(ctx, 0, pos);
+    uint32_t far = 0;   // Next long-distance match
+
+    while (pos + PP_MIN_MATCH <= size) {
+        // Long-distance match reached: emit what the previous sequence
+        // left of it
+        if (far < ctx->ldm_count && pos >= ctx->ldm_seq[far].pos) {
+            const PP_LdmMatch *m = &ctx->ldm_seq[far++];
+            uint32_t end = m->pos + m->len;
+            if (end < pos + PP_MIN_MATCH) continue;
+
+            uint32_t n = ctx->seq_count++;
+            ctx->seq_ll[n] = pos - anchor;
+            ctx->seq_ml[n] = end - pos;
+            ctx->seq_off[n] = m->off;
+            memcpy(ctx->lit_buf + ctx->lit_count, ctx->input + anchor, pos - anchor);
+            ctx->lit_count += pos - anchor;
+            ctx->stats.matches_found++;
+
+            pp_update_hash_match(ctx, inserted, end, params->insert_step);
+            if (end > inserted) inserted = end;
+            pos = end;
+            anchor = pos;
+            continue;
+        }
+
+        // Runs of one byte value hash into a single bucket and build long
+        // chains of offset-1 self-matches; emit them directly instead
+        if (pos > 0 && ctx->input[pos] == ctx->input[pos - 1] &&
+            pp_read32(ctx->input + pos) == pp_read32(ctx->input + pos - 1)) {
+            uint32_t run = pp_run_length(ctx->input + pos, size - pos);
+            if (run >= PP_RUN_MIN) {
+                uint32_t n = ctx->seq_count++;
+                ctx->seq_ll[n] = pos - anchor;
+                ctx->seq_ml[n] = run;
+                ctx->seq_off[n] = 1;
+                memcpy(ctx->lit_buf + ctx->lit_count, ctx->input + anchor, pos - anchor);
+                ctx->lit_count += pos - anchor;
+
+                // Only the run's tail goes into the hash chains
+                pos += run;
+                anchor = pos;
+                pp_update_hash_range(ctx, pos - PP_MIN_MATCH, pos);
+                inserted = pos;
+                continue;
+            }
+        }
+
+        pp_prefetch_match(ctx, pos);
+        LZ77_Match match = pp_find_longest_match(ctx, pos);
+        if (pos >= inserted) {
+            pp_update_hash(ctx, pos);
+            inserted = pos + 1;
+        }
+
+        if (match.length < PP_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+
+        // Lazy matching: prefer a longer match starting a little later
+        for (uint32_t step = 0; step < params->lazy && match.length < params->target_length; step++) {
+            if (pos + 1 + PP_MIN_MATCH > size) break;
+            LZ77_Match next = pp_find_longest_match(ctx, pos + 1);
+            if (pos + 1 >= inserted) {
+                pp_update_hash(ctx, pos + 1);
+                inserted = pos + 2;
+            }
+            if (next.length <= match.length) break;
+            pos++;
+            match = next;
+        }
+
+        uint32_t n = ctx->seq_count++;
+        ctx->seq_ll[n] = pos - anchor;
+        ctx->seq_ml[n] = match.length;
+        ctx->seq_off[n] = match.offset;
+        memcpy(ctx->lit_buf + ctx->lit_count, ctx->input + anchor, pos - anchor);
+        ctx->lit_count += pos - anchor;
+
+        // Insert the positions in the match, sparsely at fast levels
+        uint32_t end = pos + match.length;
+        pp_update_hash_match(ctx, inserted, end, params->insert_step);
+        if (end > inserted) inserted = end;
+
+        pos = end;
+        anchor = pos;
+    }
+
+    memcpy(ctx->lit_buf + ctx->lit_count, ctx->input + anchor, size - anchor);
+    ctx->lit_count += size - anchor;
+}
+
+// Fast levels (--fast=N): one probe of a position-only hash table, no
+// chains and no lazy step. Each miss advances by a step that starts at N
+// and grows by one every 2^PP_FAST_SKIP_LOG misses, so data without
+// repeats is crossed faster the longer it lasts, as in LZ4.
+static void pp_lz_parse_fast(PP_Context *ctx, uint32_t accel) {
+    const uint8_t *in = ctx->input;
+    uint32_t size = ctx->input_size;
+    uint32_t pos = ctx->prefix, anchor = pos;
+    uint32_t limit = size >= PP_FAST_TAIL ? size - PP_FAST_TAIL : 0;
+    uint32_t bits = ctx->hash_log;
+    int32_t *table = ctx->hash_table;
+
+    while (pos < limit) {
+        // Empty slots hold -1, which no position is below
+        uint32_t probes = accel << PP_FAST_SKIP_LOG, cand;
+        for (;;) {
+            uint32_t h = hash_func(in + pos, bits);
+            cand = (uint32_t)table[h];
+            table[h] = (int32_t)pos;
+            if (cand < pos && pp_read32(in + cand) == pp_read32(in + pos)) break;
+            pos += probes++ >> PP_FAST_SKIP_LOG;
+            if (pos >= limit) goto done;
+        }
+
+        // Extend into the pending literals, then forward
+        while (pos > anchor && cand > 0 && in[pos - 1] == in[cand - 1]) {
+            pos--;
+            cand--;
+        }
+        uint32_t len = PP_MIN_MATCH + pp_count_match(in + cand + PP_MIN_MATCH, in + pos + PP_MIN_MATCH,
+                                                     size - pos - PP_MIN_MATCH);
+
+        uint32_t n = ctx->seq_count++;
+        ctx->seq_ll[n] = pos - anchor;
+        ctx->seq_ml[n] = len;
+        ctx->seq_off[n] = pos - cand;
+        memcpy(ctx->lit_buf + ctx->lit_count, in + anchor, pos - anchor);
+        ctx->lit_count += pos - anchor;
+
+        // One position near the end keeps the table current
+        pos += len;
+        anchor = pos;
+        if (pos < limit) table[hash_func(in + pos - 2, bits)] = (int32_t)(pos - 2);
+    }
+
+done:
+    ctx->stats.matches_found += ctx->seq_count;
+    memcpy(ctx->lit_buf + ctx->lit_count, in + anchor, size - anchor);
+    ctx->lit_count += size - anchor;
+}
+
+// Price-based parse for the strongest levels. Prices are in 1/256 bits,
+// from the block's byte histogram on the first pass and from the previous
+// pass's literals and sequence codes after that.
+typedef struct {
+    uint32_t lit[256];
+    uint32_t ll[PP_LL_CODES];
+    uint32_t ml[PP_ML_CODES];
+    uint32_t of[PP_OF_CODES];
+} PP_Prices;
+
+static void pp_price_fill(uint32_t *price, const uint32_t *freq, int n) {
+    uint32_t total = n;
+    for (int i = 0; i < n; i++) total += freq[i];
+    uint32_t log_total = pp_log2_q8(total);
+    for (int i = 0; i < n; i++) {
+        uint32_t p = log_total - pp_log2_q8(freq[i] + 1);
+        price[i] = p < 256 ? 256 : p;
+    }
+}
+
+static void pp_opt_prices(const PP_Context *ctx, PP_Prices *prices, int first) {
+    uint32_t lit[256] = {0}, ll[PP_LL_CODES] = {0}, ml[PP_ML_CODES] = {0}, of[PP_OF_CODES] = {0};
+
+    if (first) {
+        // Short literal runs, short matches and nearby offsets are the norm
+        for (uint32_t i = ctx->prefix; i < ctx->input_size; i++) lit[ctx->input[i]]++;
+        for (int c = 0; c < 16; c++) {
+            ll[c] = 64 >> (c / 2);
+            ml[c] = 64 >> (c / 3);
+        }
+        for (int c = 0; c < 18; c++) of[c] = 16;
+    } else {
+        for (uint32_t i = 0; i < ctx->lit_count; i++) lit[ctx->lit_buf[i]]++;
+        for (uint32_t i = 0; i < ctx->seq_count; i++) {
+            ll[pp_length_code(ctx->seq_ll[i])]++;
+            ml[pp_length_code(ctx->seq_ml[i] - PP_MIN_MATCH)]++;
+            of[pp_offset_code(ctx->seq_off[i])]++;
+        }
+    }
+    pp_price_fill(prices->lit, lit, 256);
+    pp_price_fill(prices->ll, ll, PP_LL_CODES);
+    pp_price_fill(prices->ml, ml, PP_ML_CODES);
+    pp_price_fill(prices->of, of, PP_OF_CODES);
+}
+
+static inline uint32_t pp_length_price(const uint32_t *table, uint32_t v) {
+    uint32_t code = pp_length_code(v);
+    return table[code] + (pp_length_extra(code) << 8);
+}
+
+static inline void pp_opt_relax(PP_OptNode *node, uint32_t price, uint32_t len, uint32_t off,
+                                uint32_t litlen) {
+    if (price < node->price) {
+        node->price = price;
+        node->len = len;
+        node->off = off;
+        node->litlen = litlen;
+    }
+}
+
+// One forward pass over the block, then the cheapest path is emitted as
+// literals and sequences
+static void pp_opt_pass(PP_Context *ctx, const PP_Prices *prices, uint32_t nice) {
+    const uint8_t *in = ctx->input;
+    uint32_t start = ctx->prefix, size = ctx->input_size, n = size - start;
+    PP_OptNode *opt = ctx->opt;
+
+    opt[0].price = 0;
+    opt[0].len = 0;
+    opt[0].litlen = 0;
+    for (uint32_t i = 1; i <= n; i++) opt[i].price = UINT32_MAX;
+
+    uint32_t skip = 0, far = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        // Positions inside a match of nice length or more are not
+        // searched from: the match is taken as a whole
+        if (i < skip) continue;
+        uint32_t pos = start + i, price = opt[i].price, litlen = opt[i].litlen;
+
+        pp_opt_relax(&opt[i + 1], price + prices->lit[in[pos]], 0, 0, litlen + 1);
+        if (pos + PP_MIN_MATCH > size) continue;
+
+        // So are long-distance matches, from the first position reached
+        while (far < ctx->ldm_count && ctx->ldm_seq[far].pos + ctx->ldm_seq[far].len < pos + PP_MIN_MATCH) {
+            far++;
+        }
+        if (far < ctx->ldm_count && ctx->ldm_seq[far].pos <= pos) {
+            const PP_LdmMatch *m = &ctx->ldm_seq[far];
+            uint32_t l = m->pos + m->len - pos, ofc = pp_offset_code(m->off);
+            pp_opt_relax(&opt[i + l], price + pp_length_price(prices->ll, litlen) + prices->of[ofc] +
+                                      (ofc << 8) + pp_length_price(prices->ml, l - PP_MIN_MATCH),
+                         l, m->off, 0);
+            skip = i + l;
+            continue;
+        }
+
+        // Two candidates; the shorter one prices the lengths up to its own
+        uint32_t len[2] = { ctx->sa_prev_len[pos], ctx->sa_next_len[pos] };
+        int32_t from[2] = { ctx->sa_prev[pos], ctx->sa_next[pos] };
+        if (len[1] < len[0]) {
+            uint32_t t = len[0];
+            int32_t f = from[0];
+            len[0] = len[1];
+            from[0] = from[1];
+            len[1] = t;
+            from[1] = f;
+        }
+        uint32_t base = price + pp_length_price(prices->ll, litlen);
+        uint32_t done = PP_MIN_MATCH - 1;
+        for (int c = 0; c < 2; c++) {
+            if (from[c] < 0) continue;
+            uint32_t l = len[c] < size - pos ? len[c] : size - pos;
+            if (l <= done) continue;
+            uint32_t off = pos - (uint32_t)from[c];
+            uint32_t ofc = pp_offset_code(off);
+            uint32_t match_base = base + prices->of[ofc] + (ofc << 8);
+
+            if (l >= nice) {
+                pp_opt_relax(&opt[i + l], match_base + pp_length_price(prices->ml, l - PP_MIN_MATCH),
+                             l, off, 0);
+                skip = i + l;
+                break;
+            }
+            for (uint32_t k = done + 1; k <= l; k++) {
+                pp_opt_relax(&opt[i + k], match_base + pp_length_price(prices->ml, k - PP_MIN_MATCH),
+                             k, off, 0);
+            }
+            done = l;
+        }
+    }
+
+    // Walk back from the end; each step's start records the step going
+    // forward (litlen: match length or 0, price: offset)
+    for (uint32_t i = n; i > 0; ) {
+        uint32_t len = opt[i].len, off = opt[i].off;
+        i -= len ? len : 1;
+        opt[i].litlen = len;
+        opt[i].price = off;
+    }
+
+    ctx->lit_count = 0;
+    ctx->seq_count = 0;
+    uint32_t anchor = start;
+    for (uint32_t i = 0; i < n; ) {
+        uint32_t len = opt[i].litlen;
+        if (!len) {
+            i++;
+            continue;
+        }
+        uint32_t pos = start + i, k = ctx->seq_count++;
+        ctx->seq_ll[k] = pos - anchor;
+        ctx->seq_ml[k] = len;
+        ctx->seq_off[k] = opt[i].price;
+        memcpy(ctx->lit_buf + ctx->lit_count, in + anchor, pos - anchor);
+        ctx->lit_count += pos - anchor;
+        ctx->stats.matches_found++;
+        anchor = pos + len;
+        i += len;
+    }
+    memcpy(ctx->lit_buf + ctx->lit_count, in + anchor, size - anchor);
+    ctx->lit_count += size - anchor;
+}
+
+// Parse a block with suffix-array candidates and params->optimal pricing
+// passes; falls back to hash chains if the arrays cannot be allocated
+static void pp_lz_parse_optimal(PP_Context *ctx, const PP_LevelParams *params) {
+    if (!ctx->opt) ctx->opt = (PP_OptNode*)malloc((PP_BLOCK_SIZE + 1) * sizeof(PP_OptNode));
+    if (!ctx->opt || ctx->input_size - ctx->prefix > PP_BLOCK_SIZE || pp_sa_candidates(ctx) != 0) {
+        pp_lz_parse(ctx, params);
+        return;
+    }
+
+    PP_Prices prices;
+    for (int pass = 0; pass < params->optimal; pass++) {
+        pp_opt_prices(ctx, &prices, pass == 0);
+        pp_opt_pass(ctx, &prices, params->nice_length);
+    }
+}
+
+// Encode the parsed block; returns body size (> cap means it did not fit)
+static uint32_t pp_lz_encode(PP_Context *ctx, const PP_LevelParams *params,
+                             uint8_t *out, uint32_t cap, uint8_t *flags) {
+    uint32_t lit_freq[256] = {0};
+    uint32_t ll_freq[PP_LL_CODES] = {0};
+    uint32_t ml_freq[PP_ML_CODES] = {0};
+    uint32_t of_freq[PP_OF_CODES] = {0};
+    PP_Huffman lit_huf, ll_huf, ml_huf, of_huf;
+    uint32_t pos;
+
+    *flags = 0;
+    if (cap < 8) return cap + 1;
+
+    pp_write_le32(out, ctx->lit_count);
+    pp_write_le32(out + 4, ctx->seq_count);
+    pos = 8;
+
+    // Literals: Huffman if it beats raw bytes
+    int lit_huffman = 0;
+    if (params->huffman >= PP_HUF_ALL && ctx->lit_count > 256) {
+        for (uint32_t i = 0; i < ctx->lit_count; i++) lit_freq[ctx->lit_buf[i]]++;
+        pp_huf_build_lengths(lit_freq, 256, lit_huf.lengths);
+        uint64_t bytes = (pp_huf_cost(lit_freq, lit_huf.lengths, 256) + 7) / 8 + 128 + 4;
+        lit_huffman = bytes < ctx->lit_count;
+    }
+
+    if (lit_huffman) {
+        pp_huf_build_codes(&lit_huf, 256, 0);
+        if (pos + 132 > cap) return cap + 1;
+        pp_huf_write_lengths(out + pos, lit_huf.lengths, 256);
+        pos += 132;
+
+        PP_BitWriter bw;
+        pp_bw_init(&bw, out + pos, cap - pos);
+        for (uint32_t i = 0; i < ctx->lit_count; i++) {
+            uint8_t b = ctx->lit_buf[i];
+            pp_bw_put(&bw, lit_huf.codes[b], lit_huf.lengths[b]);
+        }
+        uint32_t stream = pp_bw_finish(&bw);
+        pp_write_le32(out + pos - 4, stream);
+        pos += stream;
+        if (pos > cap) return cap + 1;
+        *flags |= PP_BF_LIT_HUFFMAN;
+    } else {
+        if (pos + ctx->lit_count > cap) return cap + 1;
+        memcpy(out + pos, ctx->lit_buf, ctx->lit_count);
+        pos += ctx->lit_count;
+    }
+
+    if (ctx->seq_count == 0) return pos;
+
+    // Sequences: code frequencies, then Huffman tables if they pay off
+    for (uint32_t i = 0; i < ctx->seq_count; i++) {
+        ll_freq[pp_length_code(ctx->seq_ll[i])]++;
+        ml_freq[pp_length_code(ctx->seq_ml[i] - PP_MIN_MATCH)]++;
+        of_freq[pp_offset_code(ctx->seq_off[i])]++;
+    }
+
+    int seq_huffman = 0;
+    if (params->huffman >= PP_HUF_SEQ && ctx->seq_count > 32) {
+        pp_huf_build_lengths(ll_freq, PP_LL_CODES, ll_huf.lengths);
+        pp_huf_build_lengths(ml_freq, PP_ML_CODES, ml_huf.lengths);
+        pp_huf_build_lengths(of_freq, PP_OF_CODES, of_huf.lengths);
+        uint64_t huf_bits = pp_huf_cost(ll_freq, ll_huf.lengths, PP_LL_CODES) +
+                            pp_huf_cost(ml_freq, ml_huf.lengths, PP_ML_CODES) +
+                            pp_huf_cost(of_freq, of_huf.lengths, PP_OF_CODES) +
+                            (PP_LL_CODES + PP_ML_CODES + PP_OF_CODES) * 4;
+        uint64_t raw_bits = (uint64_t)ctx->seq_count * (6 + 6 + 5);
+        seq_huffman = huf_bits < raw_bits;
+    }
+
+    if (seq_huffman) {
+        pp_huf_build_codes(&ll_huf, PP_LL_CODES, 0);
+        pp_huf_build_codes(&ml_huf, PP_ML_CODES, 0);
+        pp_huf_build_codes(&of_huf, PP_OF_CODES, 0);
+        if (pos + 56 > cap) return cap + 1;
+        pp_huf_write_lengths(out + pos, ll_huf.lengths, PP_LL_CODES);
+        pp_huf_write_lengths(out + pos + 20, ml_huf.lengths, PP_ML_CODES);
+        pp_huf_write_lengths(out + pos + 40, of_huf.lengths, PP_OF_CODES);
+        pos += 56;
+        *flags |= PP_BF_SEQ_HUFFMAN;
+    }
+
+    PP_BitWriter bw;
+    pp_bw_init(&bw, out + pos, cap - pos);
+    for (uint32_t i = 0; i < ctx->seq_count; i++) {
+        uint32_t ll = ctx->seq_ll[i];
+        uint32_t ml = ctx->seq_ml[i] - PP_MIN_MATCH;
+        uint32_t off = ctx->seq_off[i];
+        uint32_t llc = pp_length_code(ll);
+        uint32_t mlc = pp_length_code(ml);
+        uint32_t ofc = pp_offset_code(off);
+
+        if (seq_huffman) {
+            pp_bw_put(&bw, ll_huf.codes[llc], ll_huf.lengths[llc]);
+            pp_bw_put(&bw, ml_huf.codes[mlc], ml_huf.lengths[mlc]);
+            pp_bw_put(&bw, of_huf.codes[ofc], of_huf.lengths[ofc]);
+        } else {
+            pp_bw_put(&bw, llc | (mlc << 6) | (ofc << 12), 17);
+        }
+        pp_bw_put(&bw, ll - pp_length_base(llc), pp_length_extra(llc));
+        pp_bw_put(&bw, ml - pp_length_base(mlc), pp_length_extra(mlc));
+        pp_bw_put(&bw, off - (1u << ofc), ofc);
+    }
+    pos += pp_bw_finish(&bw);
+
+    return pos;
+}
+
+// Copy a match inside the output buffer; bytes up to limit may be overwritten
+static inline void pp_copy_match(uint8_t *op, uint32_t offset, uint32_t length, uint8_t *limit) {
+    const uint8_t *src = op - offset;
+
+    if (offset == 1) {
+        memset(op, *src, length);
+    } else if (offset >= 8 && op + length + 8 <= limit) {
+        for (uint32_t i = 0; i < length; i += 8) {
+            memcpy(op + i, src + i, 8);
+        }
+    } else {
+        for (uint32_t i = 0; i < length; i++) {
+            op[i] = src[i];
+        }
+    }
+}
+
+// Decode an LZ block body into out[0..raw_size); matches may reach back
+// into the prefix bytes of history that precede out
+static int pp_lz_decode(const uint8_t *in, uint32_t in_size, uint8_t flags,
+                        uint8_t *out, uint32_t raw_size, uint32_t prefix) {
+    PP_Huffman ll_huf, ml_huf, of_huf;
+    const uint8_t *literals;
+    uint8_t *lit_tmp = NULL;
+    uint32_t pos;
+
+    if (in_size < 8) return -4;
+    uint32_t lit_size = pp_read_le32(in);
+    uint32_t seq_count = pp_read_le32(in + 4);
+    pos = 8;
+
+    if (lit_size > raw_size || seq_count > raw_size / PP_MIN_MATCH) return -4;
+
+    if (flags & PP_BF_LIT_HUFFMAN) {
+        PP_Huffman lit_huf;
+        if (in_size - pos < 132) return -4;
+        pp_huf_read_lengths(in + pos, lit_huf.lengths, 256);
+        uint32_t stream = pp_read_le32(in + pos + 128);
+        pos += 132;
+        if (stream > in_size - pos || pp_huf_build_codes(&lit_huf, 256, 1) != 0) return -4;
+
+        // Decode literals at the tail of the block; the sequence copy below
+        // never overtakes them because output grows by at least ll per step
+        literals = out + raw_size - lit_size;
+        lit_tmp = (uint8_t*)literals;
+        PP_BitReader br;
+        pp_br_init(&br, in + pos, stream);
+        for (uint32_t i = 0; i < lit_size; i++) {
+            lit_tmp[i] = (uint8_t)pp_huf_decode(&lit_huf, &br);
+        }
+        if (pp_br_overrun(&br)) return -4;
+        pos += stream;
+    } else {
+        if (lit_size > in_size - pos) return -4;
+        literals = in + pos;
+        pos += lit_size;
+    }
+
+    if (flags & PP_BF_SEQ_HUFFMAN) {
+        if (in_size - pos < 56) return -4;
+        pp_huf_read_lengths(in + pos, ll_huf.lengths, PP_LL_CODES);
+        pp_huf_read_lengths(in + pos + 20, ml_huf.lengths, PP_ML_CODES);
+        pp_huf_read_lengths(in + pos + 40, of_huf.lengths, PP_OF_CODES);
+        pos += 56;
+        if (pp_huf_build_codes(&ll_huf, PP_LL_CODES, 1) != 0 ||
+            pp_huf_build_codes(&ml_huf, PP_ML_CODES, 1) != 0 ||
+            pp_huf_build_codes(&of_huf, PP_OF_CODES, 1) != 0) {
+            return -4;
+        }
+    }
+
+    PP_BitReader br;
+    pp_br_init(&br, in + pos, in_size - pos);
+    uint8_t *op = out;
+    uint8_t *out_end = out + raw_size;
+    const uint8_t *lp = literals;
+    const uint8_t *lit_end = literals + lit_size;
+
+    for (uint32_t i = 0; i < seq_count; i++) {
+        uint32_t llc, mlc, ofc;
+
+        if (flags & PP_BF_SEQ_HUFFMAN) {
+            llc = pp_huf_decode(&ll_huf, &br);
+            mlc = pp_huf_decode(&ml_huf, &br);
+            ofc = pp_huf_decode(&of_huf, &br);
+        } else {
+            uint32_t v = pp_br_get(&br, 17);
+            llc = v & 0x3F;
+            mlc = (v >> 6) & 0x3F;
+            ofc = v >> 12;
+        }
+        if (llc >= PP_LL_CODES || mlc >= PP_ML_CODES) return -4;
+
+        uint32_t ll = pp_length_base(llc) + pp_br_get(&br, pp_length_extra(llc));
+        uint32_t ml = pp_length_base(mlc) + pp_br_get(&br, pp_length_extra(mlc)) + PP_MIN_MATCH;
+        uint32_t off = (1u << ofc) + pp_br_get(&br, ofc);
+
+        if (ll > (uint32_t)(lit_end - lp) || ll > (uint32_t)(out_end - op)) return -4;
+        memmove(op, lp, ll);
+        op += ll;
+        lp += ll;
+
+        if (off > (uint32_t)(op - out) + prefix || ml > (uint32_t)(out_end - op)) return -4;
+        pp_copy_match(op, off, ml, lit_tmp ? (uint8_t*)lp : out_end);
+        op += ml;
+    }
+    if (pp_br_overrun(&br)) return -4;
+
+    uint32_t rest = (uint32_t)(lit_end - lp);
+    if (rest != (uint32_t)(out_end - op)) return -4;
+    memmove(op, lp, rest);
+
+    return 0;
+}
+
+/* ---------- Parallel jobs ---------- */
+
+#define PP_MAX_THREADS 64
+
+// Job callback: index of the job and id of the worker running it (0..threads-1)
+typedef void (*PP_JobFunc)(void *arg, uint32_t index, int worker);
+
+#ifdef PP_HAVE_THREADS
+typedef struct {
+    PP_JobFunc fn;
+    void *arg;
+    uint32_t count;
+    uint32_t next;
+    pthread_mutex_t lock;
+} PP_ParallelJob;
+
+typedef struct {
+    PP_ParallelJob *job;
+    int id;
+} PP_Worker;
+
+static void* pp_parallel_worker(void *p) {
+    PP_ParallelJob *job = ((PP_Worker*)p)->job;
+    int id = ((PP_Worker*)p)->id;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        uint32_t i = job->next < job->count ? job->next++ : job->count;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count) return NULL;
+        job->fn(job->arg, i, id);
+    }
+}
+#endif
+
+// Run fn(arg, i) for i in [0, count) on up to `threads` threads. Indices are
+// handed out in increasing order, so a job may wait for its predecessors.
+static void pp_parallel_for(uint32_t count, int threads, PP_JobFunc fn, void *arg) {
+#ifdef PP_HAVE_THREADS
+    if (threads > 1 && count > 1) {
+        PP_ParallelJob job = { fn, arg, count, 0, PTHREAD_MUTEX_INITIALIZER };
+        PP_Worker workers[PP_MAX_THREADS];
+        pthread_t tids[PP_MAX_THREADS];
+        int n = (threads < PP_MAX_THREADS ? threads : PP_MAX_THREADS) - 1;
+        if ((uint32_t)n > count - 1) n = (int)(count - 1);
+
+        int started = 0;
+        for (int i = 0; i <= n; i++) {
+            workers[i].job = &job;
+            workers[i].id = i;
+        }
+        while (started < n &&
+               pthread_create(&tids[started], NULL, pp_parallel_worker, &workers[started + 1]) == 0) {
+            started++;
+        }
+        pp_parallel_worker(&workers[0]);
+        for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+        pthread_mutex_destroy(&job.lock);
+        return;
+    }
+#else
+    (void)threads;
+#endif
+    for (uint32_t i = 0; i < count; i++) fn(arg, i, 0);
+}
+
+int pp_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+}
+
+/* ---------- Frame ---------- */
+
+static void pp_write_block_header(uint8_t *p, uint8_t type, uint8_t flags,
+                                  uint32_t raw_size, uint32_t stored_size,
+                                  uint32_t checksum) {
+    p[0] = type;
+    p[1] = flags;
+    p[2] = 0;
+    p[3] = 0;
+    pp_write_le32(p + 4, raw_size);
+    pp_write_le32(p + 8, stored_size);
+    pp_write_le32(p + 12, checksum);
+}
+
+// v5 frame header for the resolved options
+static void pp_write_frame_header(uint8_t *header, const PP_Options *opts, int8_t level,
+                                  uint8_t file_type, uint64_t size, const PP_Dict *dict) {
+    memset(header, 0, PP_FRAME_HEADER_SIZE);
+    header[0] = PP_MAGIC & 0xFF;
+    header[1] = PP_MAGIC >> 8;
+    header[2] = PP_FRAME_VERSION;
+    header[4] = PP_FRAME_BLOCK_CHECKSUM | PP_FRAME_STORED_CHECKSUM | PP_FRAME_SEEK_INDEX;
+    header[5] = (uint8_t)level;
+    header[6] = file_type;
+    header[7] = PP_BLOCK_LOG;
+    pp_write_le64(header + 8, size);
+    header[16] = (uint8_t)opts->filters;
+    header[17] = opts->strategy;
+    if (dict) pp_write_le32(header + 20, dict->id);
+    if (opts->window_log) {
+        header[3] = opts->window_log;
+        header[4] |= PP_FRAME_LINKED;
+    }
+}
+
+// Compress one block into ctx->output (header + body); returns total bytes
+static uint32_t pp_compress_block(PP_Context *ctx, const uint8_t *block, uint32_t size,
+                                  const PP_Options *opts) {
+    uint8_t *out = ctx->output;
+    uint8_t *body = out + PP_BLOCK_HEADER_SIZE;
+    uint32_t cap = size;   // Never store more than the raw bytes
+    uint32_t checksum = pp_xxh32(block, size, 0);
+    int8_t level = opts->level;
+    if (level > pp_strategy_table[opts->strategy].max_level ||
+        pp_strategy_table[opts->strategy].max_level == 0) {
+        level = (int8_t)pp_strategy_table[opts->strategy].max_level;
+    }
+
+    // Every block of a linked frame feeds the long-distance matcher
+    if (ctx->link_window) pp_ldm_scan(ctx, size);
+
+    // Zero pages and other single-byte blocks: one byte of payload
+    if (size > 1 && pp_run_length(block + 1, size - 1) == size - 1) {
+        ctx->stats.rle_blocks++;
+        pp_write_block_header(out, PP_BLOCK_RLE, 0, size, 1, checksum);
+        body[0] = block[0];
+        return PP_BLOCK_HEADER_SIZE + 1;
+    }
+
+    // Fast levels skip the estimate: their parse crosses data without
+    // repeats about as fast, and a block that does not shrink is stored
+    PP_BlockEstimate est = { 8 << 8, 0 };
+    int route = level < 0 ? PP_ROUTE_FAST : PP_ROUTE_STORE;
+    if (level > 0) {
+        est = pp_estimate_block(block, size);
+        route = pp_route_block(&est, level);
+
+        // The estimate only sees repeats within the block
+        if (route == PP_ROUTE_STORE && ctx->ldm_count) route = PP_ROUTE_FAST;
+    }
+
+    // Max mode: context mixing replaces LZ for every compressible block
+    if (route != PP_ROUTE_STORE && level >= PP_LEVEL_MAX) {
+        if (!ctx->cm) ctx->cm = pp_cm_create();
+
+        uint32_t n = ctx->cm ? pp_cm_encode(ctx->cm, block, size, body, cap) : 0;
+        if (n) {
+            ctx->stats.cm_blocks++;
+            ctx->stats.routes[route]++;
+            pp_write_block_header(out, PP_BLOCK_CM, 0, size, n, checksum);
+            return PP_BLOCK_HEADER_SIZE + n;
+        }
+        route = PP_ROUTE_STORE;
+    }
+
+    if (route != PP_ROUTE_STORE) {
+        PP_LevelParams tuned = level < 0 ? pp_fast_params
+                             : pp_level_table[route == PP_ROUTE_FAST ? 1 : level];
+        int8_t shift = pp_strategy_table[opts->strategy].chain_shift;
+        if (level > 0) {
+            tuned.chain_limit = shift < 0 ? tuned.chain_limit >> -shift : tuned.chain_limit << shift;
+        }
+        const PP_LevelParams *params = &tuned;
+        const uint8_t *src = block;
+        uint32_t src_size = size;
+        uint32_t pos = 0;
+        uint8_t flags = 0, lz_flags = 0;
+
+        // Text filter: token table and filtered size precede the LZ body.
+        // A dictionary already covers the repeated field names it targets.
+        PP_TextTokens tokens;
+        if ((opts->filters & PP_FILTER_TEXT) && level > 0 && !ctx->dict && est.entropy < (6 << 8) &&
+            pp_text_select(block, size, &tokens)) {
+            if (!ctx->filter_buf) ctx->filter_buf = (uint8_t*)malloc(PP_BLOCK_SIZE);
+
+            if (ctx->filter_buf) {
+                uint32_t filtered = pp_text_encode(block, size, &tokens, ctx->filter_buf);
+                if (filtered < size - size / 4) {
+                    pp_write_le32(body, filtered);
+                    pos = 4 + pp_text_write_table(&tokens, body + 4);
+                    src = ctx->filter_buf;
+                    src_size = filtered;
+                    flags |= PP_BF_TEXT;
+                    ctx->stats.filtered_blocks++;
+                }
+            }
+        }
+
+        if (ctx->link_window && src == block) {
+            pp_reset_block_linked(ctx, size, params->hash_log);
+        } else if (!ctx->dict || pp_reset_block_dict(ctx, src, src_size) != 0) {
+            pp_reset_block(ctx, src, src_size, params->hash_log);
+        }
+        if (level < 0) {
+            pp_lz_parse_fast(ctx, (uint32_t)-level);
+        } else if (params->optimal) {
+            pp_lz_parse_optimal(ctx, params);
+        } else {
+            pp_lz_parse(ctx, params);
+        }
+        uint32_t n = pp_lz_encode(ctx, params, body + pos, cap - pos, &lz_flags);
+
+        if (pos + n < cap) {
+            ctx->stats.routes[route]++;
+            pp_write_block_header(out, PP_BLOCK_LZ, flags | lz_flags, size, pos + n, checksum);
+            return PP_BLOCK_HEADER_SIZE + pos + n;
+        }
+    }
+
+    ctx->stats.routes[PP_ROUTE_STORE]++;
+    pp_write_block_header(out, PP_BLOCK_RAW, 0, size, size, checksum);
+    memcpy(body, block, size);
+    return PP_BLOCK_HEADER_SIZE + size;
+}
+
+// Worst-case compressed size for an input of the given size
+uint32_t pp_compress_bound(uint32_t input_size) {
+    uint32_t blocks = input_size / PP_BLOCK_SIZE + 1;
+    return PP_FRAME_HEADER_SIZE + input_size +
+           blocks * (PP_BLOCK_HEADER_SIZE + 4 + PP_SEEK_ENTRY_SIZE) +
+           PP_BLOCK_HEADER_SIZE + PP_SEEK_FOOTER_SIZE;
+}
+
+// Requested level within [-PP_LEVEL_FAST_MAX, PP_LEVEL_MAX]; 0 means 1
+static int8_t pp_resolve_level(int level) {
+    if (level < -PP_LEVEL_FAST_MAX) return -PP_LEVEL_FAST_MAX;
+    if (level > PP_LEVEL_MAX) return PP_LEVEL_MAX;
+    return (int8_t)(level ? level : 1);
+}
+
+// Unlinked frames on several threads: a batch of blocks, one per worker,
+// compresses in parallel and goes out in order
+#define PP_FRAME_SLOT (PP_BLOCK_HEADER_SIZE + PP_BLOCK_SIZE)
+
+typedef struct {
+    PP_Context *ctx;                      // Worker 0; the others are ctx->workers
+    const PP_Options *opts;
+    const uint8_t *raw;                   // First byte of the batch
+    uint32_t raw_size;
+    uint8_t *slots;                       // Per block: header and body
+    uint32_t sizes[PP_MAX_THREADS];
+    int error;
+} PP_FrameBatch;
+
+static void pp_frame_block(void *p, uint32_t index, int worker) {
+    PP_FrameBatch *b = (PP_FrameBatch*)p;
+    PP_Context *ctx = b->ctx;
+    if (worker > 0) {
+        PP_Context **w = &b->ctx->workers[worker - 1];
+        if (!*w) *w = pp_init_context(NULL, PP_BLOCK_SIZE);
+        if (!*w) {
+            b->error = 1;
+            return;
+        }
+        ctx = *w;
+        ctx->dict = b->ctx->dict;
+    }
+
+    uint32_t pos = index * PP_BLOCK_SIZE;
+    uint32_t n = (b->raw_size - pos < PP_BLOCK_SIZE) ? b->raw_size - pos : PP_BLOCK_SIZE;
+    b->sizes[index] = pp_compress_block(ctx, b->raw + pos, n, b->opts);
+    memcpy(b->slots + (size_t)index * PP_FRAME_SLOT, ctx->output, b->sizes[index]);
+}
+
+// Fold a worker's block counts into the frame's
+static void pp_stats_merge(PP_Stats *to, const PP_Stats *from) {
+    to->matches_found += from->matches_found;
+    for (int i = 0; i < 3; i++) to->routes[i] += from->routes[i];
+    to->rle_blocks += from->rle_blocks;
+    to->cm_blocks += from->cm_blocks;
+    to->filtered_blocks += from->filtered_blocks;
+}
+
+// Compress into one frame with a caller-owned context (and its dictionary,
+// if set), created for at least one block; fills *stats when given
+static int pp_compress_frame_with(PP_Context *ctx, const uint8_t *input, uint32_t input_size,
+                                  uint8_t *output, uint32_t *output_size,
+                                  const PP_Options *options, PP_Stats *stats) {
+
+    if (!input || !output || !output_size || !options || input_size == 0) {
+        return PP_ERROR_INVALID;
+    }
+
+    PP_Options opts = *options;
+    opts.level = pp_resolve_level(opts.level);
+    int8_t level = opts.level;
+
+    // Resolve the pipeline for this content
+    uint8_t file_type = pp_detect_filetype(input, input_size);
+    if (opts.strategy == PP_STRATEGY_AUTO || opts.strategy >= PP_STRATEGY_COUNT) {
+        opts.strategy = pp_filetype_strategy[file_type];
+    }
+    opts.filters |= pp_strategy_table[opts.strategy].filters;
+
+    // Linked blocks: a dictionary plays the same part, a single block or a
+    // stored strategy has nothing to link, and fast levels keep to one block
+    uint32_t window_log = opts.window_log;
+    if (window_log < PP_WINDOW_LOG_MIN) window_log = window_log ? PP_WINDOW_LOG_MIN : 0;
+    if (window_log > PP_WINDOW_LOG_MAX) window_log = PP_WINDOW_LOG_MAX;
+    if (ctx->dict || input_size <= PP_BLOCK_SIZE || pp_strategy_table[opts.strategy].max_level == 0 ||
+        level < 0) {
+        window_log = 0;
+    }
+    if (window_log) {
+        uint32_t window = 1u << window_log;
+        if (pp_ldm_reset(ctx, input_size < window ? input_size : window) != 0) window_log = 0;
+    }
+    opts.window_log = (uint8_t)window_log;
+    ctx->link_window = window_log ? 1u << window_log : 0;
+    ctx->frame = input;
+
+    uint32_t block_count = (input_size - 1) / PP_BLOCK_SIZE + 1;
+    uint32_t seek_size = block_count * PP_SEEK_ENTRY_SIZE + PP_SEEK_FOOTER_SIZE;
+    uint8_t *seek = (uint8_t*)malloc(seek_size);
+    if (!seek) return PP_ERROR_INVALID;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+
+    // Linked blocks depend on the ones before them and stay on one thread;
+    // without the memory for workers, so do the others
+    int threads = window_log || block_count == 1 ? 1 : ctx->threads;
+    PP_FrameBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    if (threads > 1) {
+        if (!ctx->workers) ctx->workers = (PP_Context**)calloc(threads - 1, sizeof(PP_Context*));
+        batch.slots = (uint8_t*)malloc((size_t)threads * PP_FRAME_SLOT);
+        if (!ctx->workers || !batch.slots) threads = 1;
+        for (int i = 0; threads > 1 && i < threads - 1; i++) {
+            if (ctx->workers[i]) memset(&ctx->workers[i]->stats, 0, sizeof(PP_Stats));
+        }
+    }
+    batch.ctx = ctx;
+    batch.opts = &opts;
+
+    // Write frame header
+    uint8_t header[PP_FRAME_HEADER_SIZE];
+    pp_write_frame_header(header, &opts, level, file_type, input_size, ctx->dict);
+
+    uint64_t total = PP_FRAME_HEADER_SIZE;
+    if (total <= *output_size) {
+        memcpy(output, header, PP_FRAME_HEADER_SIZE);
+    }
+
+    for (uint32_t pos = 0; pos < input_size && !batch.error; ) {
+        uint32_t count = 1;
+        if (threads > 1) {
+            uint32_t batch_cap = (uint32_t)threads * PP_BLOCK_SIZE;
+            batch.raw = input + pos;
+            batch.raw_size = input_size - pos < batch_cap ? input_size - pos : batch_cap;
+            count = (batch.raw_size + PP_BLOCK_SIZE - 1) / PP_BLOCK_SIZE;
+            pp_parallel_for(count, threads, pp_frame_block, &batch);
+            if (batch.error) break;
+        } else {
+            uint32_t size = (input_size - pos < PP_BLOCK_SIZE) ? input_size - pos : PP_BLOCK_SIZE;
+            ctx->frame_pos = pos;
+            batch.sizes[0] = pp_compress_block(ctx, input + pos, size, &opts);
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            const uint8_t *block = threads > 1 ? batch.slots + (size_t)i * PP_FRAME_SLOT : ctx->output;
+            uint32_t size = (input_size - pos < PP_BLOCK_SIZE) ? input_size - pos : PP_BLOCK_SIZE;
+            uint32_t n = batch.sizes[i];
+
+            if (total + n + 4 <= *output_size) {
+                memcpy(output + total, block, n);
+                pp_write_le32(output + total + n, pp_xxh32(block, n, 0));
+            }
+            total += n + 4;
+
+            pp_write_le32(seek + ctx->stats.blocks * PP_SEEK_ENTRY_SIZE, n + 4);
+            pp_write_le32(seek + ctx->stats.blocks * PP_SEEK_ENTRY_SIZE + 4, size);
+            ctx->stats.blocks++;
+            pos += size;
+        }
+    }
+    free(batch.slots);
+    for (int i = 0; threads > 1 && i < threads - 1; i++) {
+        if (ctx->workers[i]) pp_stats_merge(&ctx->stats, &ctx->workers[i]->stats);
+    }
+    if (batch.error) {
+        free(seek);
+        ctx->frame = NULL;
+        return PP_ERROR_INVALID;
+    }
+
+    // End-of-frame marker carrying the seek index
+    uint8_t *footer = seek + block_count * PP_SEEK_ENTRY_SIZE;
+    pp_write_le32(footer, block_count);
+    pp_write_le32(footer + 4, pp_xxh32(seek, block_count * PP_SEEK_ENTRY_SIZE, 0));
+    pp_write_le32(footer + 8, PP_SEEK_MAGIC);
+    if (total + PP_BLOCK_HEADER_SIZE + seek_size <= *output_size) {
+        pp_write_block_header(output + total, PP_BLOCK_END, 0, 0, seek_size, 0);
+        memcpy(output + total + PP_BLOCK_HEADER_SIZE, seek, seek_size);
+    }
+    total += PP_BLOCK_HEADER_SIZE + seek_size;
+    free(seek);
+    ctx->link_window = 0;
+    ctx->frame = NULL;
+
+    if (total > *output_size) {
+        *output_size = (uint32_t)total;
+        return PP_ERROR_BUFFER;
+    }
+    *output_size = (uint32_t)total;
+
+    if (stats) {
+        *stats = ctx->stats;
+        stats->input_size = input_size;
+        stats->output_size = *output_size;
+        stats->file_type = file_type;
+        stats->strategy = opts.strategy;
+        stats->level = level;
+        stats->filters = opts.filters;
+    }
+    return 0;
+}
+
+// Compress into one frame, optionally against a dictionary
+static int pp_compress_frame(const uint8_t *input, uint32_t input_size,
+                             uint8_t *output, uint32_t *output_size,
+                             const PP_Options *options, const PP_Dict *dict, PP_Stats *stats) {
+    PP_Context *ctx = input ? pp_init_context(input, input_size) : NULL;
+    if (!ctx) return PP_ERROR_INVALID;
+    ctx->dict = dict;
+    int result = pp_compress_frame_with(ctx, input, input_size, output, output_size, options, stats);
+    pp_free_context(ctx);
+    return result;
+}
+
+// Compression against a dictionary; decompressing needs the same one
+int pp_compress_dict(const uint8_t *input, uint32_t input_size,
+                     uint8_t *output, uint32_t *output_size,
+                     const PP_Options *options, const PP_Dict *dict) {
+    return pp_compress_frame(input, input_size, output, output_size, options, dict, NULL);
+}
+
+// Compression with explicit options
+int pp_compress_ex(const uint8_t *input, uint32_t input_size,
+                   uint8_t *output, uint32_t *output_size,
+                   const PP_Options *options) {
+    return pp_compress_dict(input, input_size, output, output_size, options, NULL);
+}
+
+// Main compression function
+int pp_compress(const uint8_t *input, uint32_t input_size,
+                uint8_t *output, uint32_t *output_size,
+                int8_t level) {
+    PP_Options opts = { level, 0, PP_STRATEGY_AUTO, 0, 0, 0 };
+    return pp_compress_ex(input, input_size, output, output_size, &opts);
+}
+
+// Reusable context sized for a full block, so one serves inputs of any size
+PP_Context* pp_context_create(void) {
+    return pp_init_context(NULL, PP_BLOCK_SIZE);
+}
+
+void pp_context_free(PP_Context *ctx) {
+    pp_free_context(ctx);
+}
+
+// Dictionary for the following frames; NULL compresses without one
+void pp_context_set_dict(PP_Context *ctx, const PP_Dict *dict) {
+    if (ctx) ctx->dict = dict;
+}
+
+// Threads for the blocks of the following unlinked frames; 1 by default
+void pp_context_set_threads(PP_Context *ctx, int threads) {
+    if (!ctx) return;
+    if (threads < 1) threads = 1;
+    if (threads > PP_MAX_THREADS) threads = PP_MAX_THREADS;
+    if (ctx->workers) {
+        for (int i = 0; i < ctx->threads - 1; i++) pp_free_context(ctx->workers[i]);
+        free(ctx->workers);
+        ctx->workers = NULL;
+    }
+    ctx->threads = threads;
+}
+
+int pp_compress_ctx(PP_Context *ctx, const uint8_t *input, uint32_t input_size,
+                    uint8_t *output, uint32_t *output_size,
+                    const PP_Options *options, PP_Stats *stats) {
+    if (!ctx) return -1;
+    return pp_compress_frame_with(ctx, input, input_size, output, output_size, options, stats);
+}
+
+const char* pp_version(void) {
+    return PP_VERSION;
+}
+
+const char* pp_strategy_name(uint8_t strategy) {
+    return strategy < PP_STRATEGY_COUNT ? pp_strategy_table[strategy].name : "?";
+}
+
+int pp_strategy_from_name(const char *name) {
+    for (int k = 0; k < PP_STRATEGY_COUNT; k++) {
+        if (strcmp(name, pp_strategy_table[k].name) == 0) return k;
+    }
+    return -1;
+}
+
+// Decode one block body into dst[0..raw_size). Filtered and context-mixing
+// blocks use the caller's scratch state, which is grown as needed. In a
+// linked frame, history bytes of earlier content precede dst.
+static int pp_decode_block(uint8_t type, uint8_t flags, const uint8_t *src, uint32_t stored_size,
+                           uint8_t *dst, uint32_t raw_size, uint32_t history,
+                           PP_Decoder *scratch) {
+    if (type == PP_BLOCK_RAW) {
+        if (stored_size != raw_size) return -4;
+        memcpy(dst, src, raw_size);
+        return 0;
+    }
+    if (type == PP_BLOCK_RLE) {
+        if (stored_size != 1) return -4;
+        memset(dst, src[0], raw_size);
+        return 0;
+    }
+    if (type == PP_BLOCK_CM) {
+        if (!scratch->cm) scratch->cm = pp_cm_create();
+        if (!scratch->cm) return -1;
+        return pp_cm_decode(scratch->cm, src, stored_size, dst, raw_size);
+    }
+    if (type != PP_BLOCK_LZ) {
+        return -4; // Unknown block type
+    }
+    if (!(flags & PP_BF_TEXT) && scratch->dict && !history) {
+        // Decode after a copy of the dictionary so matches can reach into it
+        uint32_t prefix = scratch->dict->size;
+        if (scratch->window_size < prefix + raw_size) {
+            uint8_t *grown = (uint8_t*)realloc(scratch->window, prefix + raw_size);
+            if (!grown) return -1;
+            if (!scratch->window) memcpy(grown, scratch->dict->data, prefix);
+            scratch->window = grown;
+            scratch->window_size = prefix + raw_size;
+        }
+        int r = pp_lz_decode(src, stored_size, flags, scratch->window + prefix, raw_size, prefix);
+        if (r == 0) memcpy(dst, scratch->window + prefix, raw_size);
+        return r;
+    }
+    if (!(flags & PP_BF_TEXT)) {
+        return pp_lz_decode(src, stored_size, flags, dst, raw_size, history);
+    }
+
+    PP_TextTokens tokens;
+    if (stored_size < 4) return -4;
+    uint32_t filtered = pp_read_le32(src);
+    uint32_t table = pp_text_read_table(src + 4, stored_size - 4, &tokens);
+    if (table == 0 || filtered > raw_size) return -4;
+
+    if (scratch->size < filtered) {
+        uint8_t *grown = (uint8_t*)realloc(scratch->buf, filtered);
+        if (!grown) return -1;
+        scratch->buf = grown;
+        scratch->size = filtered;
+    }
+
+    int r = pp_lz_decode(src + 4 + table, stored_size - 4 - table, flags, scratch->buf, filtered, 0);
+    if (r != 0) return r;
+    return pp_text_decode(scratch->buf, filtered, &tokens, dst, raw_size);
+}
+
+static void pp_scratch_free(PP_Decoder *scratch) {
+    free(scratch->buf);
+    free(scratch->window);
+    pp_cm_free(scratch->cm);
+}
+
+// Point a reused scratch at another dictionary; its window holds a copy
+static void pp_scratch_set_dict(PP_Decoder *scratch, const PP_Dict *dict) {
+    if (scratch->dict == dict) return;
+    free(scratch->window);
+    scratch->window = NULL;
+    scratch->window_size = 0;
+    scratch->dict = dict;
+}
+
+// Check that the dictionary a frame was written with is the one given
+static int pp_frame_dict_ok(const uint8_t *header, const PP_Dict *dict) {
+    uint32_t id = pp_read_le32(header + 20);
+    return id == 0 || (dict && dict->id == id);
+}
+
+// History window a frame's blocks match into: 0 for independent blocks,
+// UINT32_MAX for a malformed header
+static uint32_t pp_frame_window(const uint8_t *header) {
+    if (!(header[4] & PP_FRAME_LINKED)) return 0;
+    if (header[3] < PP_WINDOW_LOG_MIN || header[3] > PP_WINDOW_LOG_MAX) return UINT32_MAX;
+    return 1u << header[3];
+}
+
+// Decompress a v5 block frame; scratch (and its dictionary) may be reused
+// across frames
+static int pp_decompress_frame(const uint8_t *input, uint32_t input_size,
+                               uint8_t *output, uint32_t *output_size,
+                               PP_Decoder *scratch) {
+    if (input_size < PP_FRAME_HEADER_SIZE) return -1;
+    if (!pp_frame_dict_ok(input, scratch->dict)) return -5; // Dictionary missing or different
+
+    uint8_t frame_flags = input[4];
+    uint64_t content_size = pp_read_le64(input + 8);
+    uint32_t window = pp_frame_window(input);
+    if (window == UINT32_MAX) return -4;
+
+    if (*output_size < content_size) {
+        *output_size = (uint32_t)content_size;
+        return -2;
+    }
+
+    uint32_t in_pos = PP_FRAME_HEADER_SIZE;
+    uint64_t out_pos = 0;
+    int result = 0;
+
+    for (;;) {
+        if (input_size - in_pos < PP_BLOCK_HEADER_SIZE) {
+            result = -4;
+            break;
+        }
+
+        const uint8_t *bh = input + in_pos;
+        uint8_t type = bh[0];
+        uint8_t flags = bh[1];
+        uint32_t raw_size = pp_read_le32(bh + 4);
+        uint32_t stored_size = pp_read_le32(bh + 8);
+        uint32_t checksum = pp_read_le32(bh + 12);
+        in_pos += PP_BLOCK_HEADER_SIZE;
+
+        if (type == PP_BLOCK_END) break;
+        if (stored_size > input_size - in_pos || raw_size > content_size - out_pos) {
+            result = -4;
+            break;
+        }
+
+        if (frame_flags & PP_FRAME_STORED_CHECKSUM) {
+            if (input_size - in_pos - stored_size < 4) {
+                result = -4;
+                break;
+            }
+            if (pp_xxh32(bh, PP_BLOCK_HEADER_SIZE + stored_size, 0) !=
+                pp_read_le32(input + in_pos + stored_size)) {
+                result = -3; // Stored bytes damaged
+                break;
+            }
+        }
+
+        uint8_t *dst = output + out_pos;
+        uint32_t history = out_pos < window ? (uint32_t)out_pos : window;
+        result = pp_decode_block(type, flags, input + in_pos, stored_size, dst, raw_size, history,
+                                 scratch);
+        if (result != 0) break;
+
+        if ((frame_flags & PP_FRAME_BLOCK_CHECKSUM) &&
+            pp_xxh32(dst, raw_size, 0) != checksum) {
+            result = -3; // Checksum mismatch
+            break;
+        }
+
+        in_pos += stored_size + ((frame_flags & PP_FRAME_STORED_CHECKSUM) ? 4 : 0);
+        out_pos += raw_size;
+    }
+
+    if (result != 0) return result;
+    if (out_pos != content_size) return -4;
+
+    *output_size = (uint32_t)out_pos;
+    return 0;
+}
+
+/* ---------- Legacy formats (v1-v4) ---------- */
+
+// Single-bitstream files from before the v5 frame: v1 from the old engine,
+// and v2-v4 from lib/piedpiper.js. All carry the raw size at byte 4, the
+// bitstream size at byte 8 and a 16-bit additive checksum of the content.
+//   v1      16-byte header, bitstream after it. 1 flag bit: 0 raw 8-bit
+//           literal, 1 match (15-bit offset, 8-bit length + 3)
+//   v2-v4   16-byte header (v4: 20, with mode @14, strategy @15 and the
+//           checksum @16), u32 tree size, a preorder Huffman tree
+//           (MSB-first; 0 = internal node, left then right, 1 + 8 bits =
+//           leaf), then the bitstream.
+//   v2      1 flag bit: 0 literal, 1 match (16-bit offset, 8-bit length + 3)
+//   v3, v4  2 flag bits: 00 end, 10 literal run (8-bit count), 11 match
+//           (offset - 1 and length - 4 in 16/9 bits for v3, 17/10 for v4)
+// The decoder is incremental so that pp_upgrade can stream these files
+// through a window-sized buffer.
+#define PP_WEB_MAX_NODES 512
+#define PP_WEB_MAX_DEPTH 32
+#define PP_WEB_TABLE_BITS 10
+#define PP_WEB_NONE INT16_MIN             // Absent child (single-symbol trees)
+#define PP_LEGACY_WINDOW (1 << 17)        // Largest match offset (v4)
+#define PP_LEGACY_SLACK 2048              // Bytes one token may write past its target
+
+// Children are node indexes, or ~symbol for leaves. Table entries resolve
+// the first PP_WEB_TABLE_BITS code bits: a symbol and its code length, or
+// the node reached after all of them.
+typedef struct {
+    int16_t child[PP_WEB_MAX_NODES][2];
+    int16_t root;
+    uint16_t nodes;
+    uint32_t bits;                        // Tree size in bits
+    uint32_t pos;
+    struct { int16_t next; uint8_t len; } table[1 << PP_WEB_TABLE_BITS];
+} PP_WebTree;
+
+typedef struct {
+    uint8_t version;
+    uint8_t ended;                        // End marker seen; the rest is zeros
+    uint16_t checksum;
+    uint16_t sum;
+    uint32_t content_size;
+    uint32_t done;                        // Bytes decoded so far
+    PP_BitReader br;
+    PP_WebTree *tree;                     // v2-v4
+} PP_LegacyDecoder;
+
+static inline uint32_t pp_web_tree_bit(PP_WebTree *t, const uint8_t *data) {
+    uint32_t bit = (data[t->pos >> 3] >> (7 - (t->pos & 7))) & 1;
+    t->pos++;
+    return bit;
+}
+
+// Parse one subtree; a node that cannot fit a leaf is the padding the
+// encoder leaves after a lone symbol's missing right child
+static int pp_web_read_node(PP_WebTree *t, const uint8_t *data, int depth, int16_t *node) {
+    if (t->bits - t->pos < 9) {
+        *node = PP_WEB_NONE;
+        return 0;
+    }
+    if (depth > PP_WEB_MAX_DEPTH) return -4;
+
+    if (pp_web_tree_bit(t, data)) {
+        uint32_t symbol = 0;
+        for (int i = 0; i < 8; i++) {
+            symbol = (symbol << 1) | pp_web_tree_bit(t, data);
+        }
+        *node = (int16_t)~symbol;
+        return 0;
+    }
+
+    if (t->nodes >= PP_WEB_MAX_NODES) return -4;
+    int16_t index = (int16_t)t->nodes++;
+    for (int side = 0; side < 2; side++) {
+        int16_t child;
+        if (pp_web_read_node(t, data, depth + 1, &child) != 0) return -4;
+        t->child[index][side] = child;
+    }
+    *node = index;
+    return 0;
+}
+
+static int pp_web_tree_build(PP_WebTree *t, const uint8_t *data, uint32_t size) {
+    t->nodes = 0;
+    t->pos = 0;
+    t->bits = size * 8;
+    if (pp_web_read_node(t, data, 0, &t->root) != 0 || t->root == PP_WEB_NONE) {
+        return -4;
+    }
+
+    // Walk every table index through the tree, LSB (first code bit) first
+    for (uint32_t i = 0; i < (1u << PP_WEB_TABLE_BITS); i++) {
+        int16_t node = t->root;
+        uint8_t len = 0;
+        while (node >= 0 && len < PP_WEB_TABLE_BITS) {
+            node = t->child[node][(i >> len) & 1];
+            len++;
+        }
+        t->table[i].next = node;
+        t->table[i].len = len;
+    }
+    return 0;
+}
+
+// Next literal, or -1 on a code that leads nowhere
+static inline int pp_web_symbol(const PP_WebTree *t, PP_BitReader *br) {
+    if (br->count < PP_WEB_TABLE_BITS) pp_br_refill(br);
+    uint32_t index = (uint32_t)br->buf & ((1u << PP_WEB_TABLE_BITS) - 1);
+    int16_t node = t->table[index].next;
+    uint32_t len = t->table[index].len;
+    br->buf >>= len;
+    br->count -= len;
+
+    while (node >= 0) {
+        node = t->child[node][pp_br_get(br, 1)];
+    }
+    return node == PP_WEB_NONE ? -1 : (uint8_t)~node;
+}
+
+// Parse the header (and tree) of a v1-v4 file
+static int pp_legacy_open(PP_LegacyDecoder *d, const uint8_t *input, uint32_t input_size) {
+    memset(d, 0, sizeof(*d));
+    if (input_size < 16) return -1;
+    d->version = input[2];
+    if (d->version < 1 || d->version > 4) return -1;
+
+    uint32_t header_size = (d->version == 4) ? 20 : 16;
+    const uint8_t *sum_ptr = input + ((d->version == 4) ? 16 : 14);
+    if (input_size < header_size) return -1;
+    d->content_size = pp_read_le32(input + 4);
+    d->checksum = (uint16_t)(sum_ptr[0] | (sum_ptr[1] << 8));
+
+    // v1 (the first C engine) stores the whole file size here, header
+    // included; v2-v4 store the bitstream size
+    uint32_t stream_size = pp_read_le32(input + 8);
+    uint32_t pos = header_size;
+    if (d->version == 1) {
+        if (stream_size < header_size) return -4;
+        stream_size -= header_size;
+    } else {
+        if (input_size - pos < 4) return -4;
+        uint32_t tree_size = pp_read_le32(input + pos);
+        pos += 4;
+        if (tree_size == 0 || tree_size > input_size - pos) return -4;
+
+        d->tree = (PP_WebTree*)malloc(sizeof(PP_WebTree));
+        if (!d->tree) return -1;
+        if (pp_web_tree_build(d->tree, input + pos, tree_size) != 0) return -4;
+        pos += tree_size;
+    }
+    if (stream_size > input_size - pos) return -4;
+    pp_br_init(&d->br, input + pos, stream_size);
+    return 0;
+}
+
+static void pp_legacy_close(PP_LegacyDecoder *d) {
+    free(d->tree);
+    d->tree = NULL;
+}
+
+// Decode into buf, where buf[pos] is content byte d->done, until pos
+// reaches target or the content is complete. Tokens are never split, so
+// up to PP_LEGACY_SLACK bytes past target may be written; buf must hold
+// the previous PP_LEGACY_WINDOW bytes before pos (or all of them, if
+// fewer). *out_pos receives the new position. Returns 0, -3 once the
+// content is complete with the wrong checksum, or -4.
+static int pp_legacy_decode(PP_LegacyDecoder *d, uint8_t *buf, uint32_t pos, uint32_t target,
+                            uint8_t *limit, uint32_t *out_pos) {
+    PP_BitReader *br = &d->br;
+    uint32_t start = pos;
+    uint32_t end = pos + (d->content_size - d->done);
+    if (target > end) target = end;
+    int result = 0;
+
+    while (pos < target && result == 0) {
+        uint32_t offset = 0, length = 0;
+
+        if (d->ended) {
+            // The encoder may end early; the rest of the content is zero
+            memset(buf + pos, 0, target - pos);
+            pos = target;
+            break;
+        }
+
+        if (d->version <= 2) {
+            if (pp_br_get(br, 1)) {
+                offset = pp_br_get(br, d->version == 1 ? 15 : 16);
+                length = pp_br_get(br, 8) + 3;
+                if (offset == 0) result = -4;
+            } else if (d->version == 1) {
+                buf[pos++] = (uint8_t)pp_br_get(br, 8);
+            } else {
+                int symbol = pp_web_symbol(d->tree, br);
+                if (symbol < 0) result = -4;
+                buf[pos++] = (uint8_t)symbol;
+            }
+        } else {
+            uint32_t flag = pp_br_get(br, 2);
+            if (flag == 0) {
+                d->ended = 1;
+            } else if (flag == 2) {
+                uint32_t run = pp_br_get(br, 8);
+                if (run > end - pos) run = end - pos;
+                for (uint32_t i = 0; i < run && result == 0; i++) {
+                    int symbol = pp_web_symbol(d->tree, br);
+                    if (symbol < 0) result = -4;
+                    buf[pos++] = (uint8_t)symbol;
+                }
+            } else if (flag == 3) {
+                offset = pp_br_get(br, d->version == 4 ? 17 : 16) + 1;
+                length = pp_br_get(br, d->version == 4 ? 10 : 9) + 4;
+            } else {
+                result = -4;
+            }
+        }
+
+        if (length && result == 0) {
+            if (offset > pos) {
+                result = -4;
+            } else {
+                if (length > end - pos) length = end - pos;
+                pp_copy_match(buf + pos, offset, length, limit);
+                pos += length;
+            }
+        }
+        if (pp_br_overrun(br)) result = -4;
+    }
+
+    for (uint32_t i = start; i < pos; i++) {
+        d->sum = (uint16_t)(d->sum + buf[i]);
+    }
+    d->done += pos - start;
+    *out_pos = pos;
+    if (result == 0 && d->done == d->content_size && d->sum != d->checksum) {
+        result = -3;
+    }
+    return result;
+}
+
+// Decompress a whole v1-v4 file
+static int pp_decompress_legacy(const uint8_t *input, uint32_t input_size,
+                                uint8_t *output, uint32_t *output_size) {
+    PP_LegacyDecoder d;
+    int result = pp_legacy_open(&d, input, input_size);
+
+    if (result == 0 && *output_size < d.content_size) {
+        *output_size = d.content_size;
+        result = -2;
+    }
+    if (result == 0) {
+        uint32_t pos = 0;
+        result = pp_legacy_decode(&d, output, 0, d.content_size, output + d.content_size, &pos);
+        if (result == 0) *output_size = pos;
+    }
+    pp_legacy_close(&d);
+    return result;
+}
+
+/* ---------- Decompression ---------- */
+
+// Decompressed size recorded in a .pp header (0 if unknown or invalid)
+uint64_t pp_get_decompressed_size(const uint8_t *input, uint32_t input_size) {
+    if (!input || input_size < 16) return 0;
+    if ((input[0] | (input[1] << 8)) != PP_MAGIC) return 0;
+
+    if (input[2] == PP_FRAME_VERSION && input_size >= PP_FRAME_HEADER_SIZE) {
+        return pp_read_le64(input + 8);
+    }
+    if (input[2] >= 1 && input[2] <= 4) {
+        return pp_read_le32(input + 4);
+    }
+    return 0;
+}
+
+// Size of the frame (or v1-v4 file) at the start of input, which may hold only
+// part of it. Returns 0 once the size is known; -2 while more input is
+// needed, with *frame_size the length to have before asking again.
+int pp_frame_size(const uint8_t *input, uint32_t input_size, uint64_t *frame_size) {
+    if (!frame_size || (!input && input_size)) return -1;
+    *frame_size = sizeof(PP_Header);
+    if (input_size < sizeof(PP_Header)) return -2;
+    if ((input[0] | (input[1] << 8)) != PP_MAGIC) return -1;
+
+    if (input[2] == 1) {
+        // Whole file size, header included
+        *frame_size = pp_read_le32(input + 8);
+        return *frame_size < sizeof(PP_Header) ? -1 : 0;
+    }
+    if (input[2] >= 2 && input[2] <= 4) {
+        // Header, tree size, tree, bitstream
+        uint32_t header_size = (input[2] == 4) ? 20 : 16;
+        *frame_size = header_size + 4;
+        if (input_size < *frame_size) return -2;
+        *frame_size += (uint64_t)pp_read_le32(input + header_size) + pp_read_le32(input + 8);
+        return 0;
+    }
+    if (input[2] != PP_FRAME_VERSION) return -1;
+
+    // Hop over block headers up to the end block
+    uint32_t trailer = (input[4] & PP_FRAME_STORED_CHECKSUM) ? 4 : 0;
+    uint64_t pos = PP_FRAME_HEADER_SIZE;
+    while (pos + PP_BLOCK_HEADER_SIZE <= input_size) {
+        const uint8_t *bh = input + pos;
+        pos += PP_BLOCK_HEADER_SIZE + (uint64_t)pp_read_le32(bh + 8);
+        if (bh[0] == PP_BLOCK_END) {
+            *frame_size = pos;
+            return 0;
+        }
+        pos += trailer;
+    }
+    *frame_size = pos + PP_BLOCK_HEADER_SIZE;
+    return -2;
+}
+
+// Decompress a v1-v4 file or a v5 frame with the given decoder state
+static int pp_decompress_with(PP_Decoder *scratch, const uint8_t *input, uint32_t input_size,
+                              uint8_t *output, uint32_t *output_size) {
+
+    if (!input || !output || !output_size || input_size < 16) {
+        return -1;
+    }
+
+    // Validate header
+    if ((input[0] | (input[1] << 8)) != PP_MAGIC) {
+        return -1;
+    }
+
+    switch (input[2]) {
+        case 1:
+        case 2:
+        case 3:
+        case 4:
+            return pp_decompress_legacy(input, input_size, output, output_size);
+        case PP_FRAME_VERSION:
+            return pp_decompress_frame(input, input_size, output, output_size, scratch);
+        default:
+            return -1; // Unsupported version
+    }
+}
+
+// Decompression of frames written with a dictionary (dict may be NULL)
+int pp_decompress_dict(const uint8_t *input, uint32_t input_size,
+                       uint8_t *output, uint32_t *output_size, const PP_Dict *dict) {
+    PP_Decoder scratch = { NULL, 0, NULL, dict, NULL, 0 };
+    int result = pp_decompress_with(&scratch, input, input_size, output, output_size);
+    pp_scratch_free(&scratch);
+    return result;
+}
+
+// Decompression function
+int pp_decompress(const uint8_t *input, uint32_t input_size,
+                  uint8_t *output, uint32_t *output_size) {
+    return pp_decompress_dict(input, input_size, output, output_size, NULL);
+}
+
+// Reusable decoder: scratch buffers and the context-mixing model persist
+PP_Decoder* pp_decoder_create(void) {
+    return (PP_Decoder*)calloc(1, sizeof(PP_Decoder));
+}
+
+void pp_decoder_free(PP_Decoder *dec) {
+    if (!dec) return;
+    pp_scratch_free(dec);
+    free(dec);
+}
+
+void pp_decoder_set_dict(PP_Decoder *dec, const PP_Dict *dict) {
+    if (dec) pp_scratch_set_dict(dec, dict);
+}
+
+int pp_decompress_ctx(PP_Decoder *dec, const uint8_t *input, uint32_t input_size,
+                      uint8_t *output, uint32_t *output_size) {
+    if (!dec) return -1;
+    return pp_decompress_with(dec, input, input_size, output, output_size);
+}
+
+/* ---------- Password envelope ---------- */
+
+// The web app's password format (flag byte 0x02, see lib/piedpiper.js):
+// a 32-byte header, then fixed-size segments of the sealed bytes, each
+// AES-256-GCM encrypted with its own 16-byte tag. The key comes from
+// PBKDF2-HMAC-SHA256; the nonce is the header's 7-byte prefix, the segment
+// index (u32 big-endian) and a last-segment byte; the header is the
+// associated data of every segment. Segments are sealed and opened on the
+// parallel job pool. AES-NI and PCLMULQDQ are used when the CPU has them,
+// with a portable fallback producing the same bytes.
+
+#define PP_ENVELOPE_VERSION 1
+#define PP_ENVELOPE_KDF_PBKDF2 1
+#define PP_ENVELOPE_SEGMENT_LOG 18
+#define PP_ENVELOPE_ITERATIONS 600000
+#define PP_ENVELOPE_MAX_ITERATIONS 10000000
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(PP_NO_AESNI)
+#include <immintrin.h>
+#define PP_HAVE_AESNI 1
+#define PP_AESNI_TARGET __attribute__((target("aes,pclmul,sse4.1,ssse3")))
+#endif
+
+// SHA-256 (FIPS 180-4)
+static const uint32_t pp_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+typedef struct {
+    uint32_t h[8];
+    uint8_t buf[64];
+    uint64_t length;
+} PP_Sha256;
+
+static inline uint32_t pp_rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t pp_read_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void pp_write_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void pp_sha256_block(uint32_t *h, const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) w[i] = pp_read_be32(p + 4 * i);
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = pp_rotr32(w[i - 15], 7) ^ pp_rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = pp_rotr32(w[i - 2], 17) ^ pp_rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (pp_rotr32(e, 6) ^ pp_rotr32(e, 11) ^ pp_rotr32(e, 25)) +
+                      ((e & f) ^ (~e & g)) + pp_sha256_k[i] + w[i];
+        uint32_t t2 = (pp_rotr32(a, 2) ^ pp_rotr32(a, 13) ^ pp_rotr32(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void pp_sha256_init(PP_Sha256 *s) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(s->h, iv, sizeof(iv));
+    s->length = 0;
+}
+
+static void pp_sha256_update(PP_Sha256 *s, const uint8_t *data, size_t size) {
+    uint32_t fill = (uint32_t)(s->length & 63);
+    s->length += size;
+    while (size > 0) {
+        uint32_t n = 64 - fill < size ? 64 - fill : (uint32_t)size;
+        memcpy(s->buf + fill, data, n);
+        fill += n;
+        data += n;
+        size -= n;
+        if (fill == 64) {
+            pp_sha256_block(s->h, s->buf);
+            fill = 0;
+        }
+    }
+}
+
+static void pp_sha256_final(PP_Sha256 *s, uint8_t *digest) {
+    uint64_t bits = s->length * 8;
+    uint8_t pad[72] = { 0x80 };
+    uint32_t fill = (uint32_t)(s->length & 63);
+    uint32_t n = (fill < 56 ? 56 : 120) - fill;
+    for (int i = 0; i < 8; i++) pad[n + i] = (uint8_t)(bits >> (56 - 8 * i));
+    pp_sha256_update(s, pad, n + 8);
+    for (int i = 0; i < 8; i++) pp_write_be32(digest + 4 * i, s->h[i]);
+}
+
+// PBKDF2-HMAC-SHA256 for one 32-byte output block. The HMAC pads are
+// hashed once; each iteration is then two compressions of a pre-padded
+// block holding the previous digest.
+static void pp_pbkdf2_sha256(const uint8_t *password, size_t password_size,
+                             const uint8_t *salt, size_t salt_size,
+                             uint32_t iterations, uint8_t *key) {
+    uint8_t block[64] = {0}, pad[64];
+    if (password_size > 64) {
+        PP_Sha256 s;
+        pp_sha256_init(&s);
+        pp_sha256_update(&s, password, password_size);
+        pp_sha256_final(&s, block);
+    } else {
+        memcpy(block, password, password_size);
+    }
+
+    PP_Sha256 inner, outer;
+    for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x36;
+    pp_sha256_init(&inner);
+    pp_sha256_update(&inner, pad, 64);
+    for (int i = 0; i < 64; i++) pad[i] = block[i] ^ 0x5c;
+    pp_sha256_init(&outer);
+    pp_sha256_update(&outer, pad, 64);
+
+    // U1 = HMAC(password, salt || INT(1))
+    uint8_t u[32];
+    static const uint8_t one[4] = { 0, 0, 0, 1 };
+    PP_Sha256 s = inner;
+    pp_sha256_update(&s, salt, salt_size);
+    pp_sha256_update(&s, one, 4);
+    pp_sha256_final(&s, u);
+    s = outer;
+    pp_sha256_update(&s, u, 32);
+    pp_sha256_final(&s, u);
+    memcpy(key, u, 32);
+
+    // Ui = HMAC(password, Ui-1): 32 bytes after a 64-byte pad, 768 bits
+    uint8_t msg[64] = {0};
+    msg[32] = 0x80;
+    msg[62] = 0x03;
+    memcpy(msg, u, 32);
+    for (uint32_t n = 1; n < iterations; n++) {
+        uint32_t h[8];
+        memcpy(h, inner.h, sizeof(h));
+        pp_sha256_block(h, msg);
+        for (int i = 0; i < 8; i++) pp_write_be32(msg + 4 * i, h[i]);
+        memcpy(h, outer.h, sizeof(h));
+        pp_sha256_block(h, msg);
+        for (int i = 0; i < 8; i++) {
+            pp_write_be32(msg + 4 * i, h[i]);
+            key[4 * i] ^= msg[4 * i];
+            key[4 * i + 1] ^= msg[4 * i + 1];
+            key[4 * i + 2] ^= msg[4 * i + 2];
+            key[4 * i + 3] ^= msg[4 * i + 3];
+        }
+    }
+}
+
+// AES-256 (FIPS 197): byte-oriented key schedule shared by both paths
+static const uint8_t pp_aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+typedef struct {
+    uint8_t rk[15][16];                   // Round keys
+    uint8_t h[16];                        // GHASH key E(K, 0)
+    uint64_t hl[16], hh[16];              // Portable GHASH: multiples of H by 4-bit values
+    int aesni;
+} PP_GcmKey;
+
+static void pp_aes256_expand(const uint8_t *key, uint8_t rk[15][16]) {
+    uint8_t *w = &rk[0][0];
+    uint8_t rcon = 1;
+    memcpy(w, key, 32);
+    for (int i = 8; i < 60; i++) {
+        uint8_t t[4];
+        memcpy(t, w + 4 * (i - 1), 4);
+        if (i % 8 == 0) {
+            uint8_t first = t[0];
+            t[0] = pp_aes_sbox[t[1]] ^ rcon;
+            t[1] = pp_aes_sbox[t[2]];
+            t[2] = pp_aes_sbox[t[3]];
+            t[3] = pp_aes_sbox[first];
+            rcon = (uint8_t)((rcon << 1) ^ ((rcon >> 7) * 0x1b));
+        } else if (i % 8 == 4) {
+            for (int j = 0; j < 4; j++) t[j] = pp_aes_sbox[t[j]];
+        }
+        for (int j = 0; j < 4; j++) w[4 * i + j] = w[4 * (i - 8) + j] ^ t[j];
+    }
+}
+
+// MixColumns on one little-endian column word: 2a0 ^ 3a1 ^ a2 ^ a3, ...
+static inline uint32_t pp_aes_mix(uint32_t w) {
+    uint32_t r = (w >> 8) | (w << 24);
+    uint32_t x = w ^ r;
+    x = ((x & 0x7f7f7f7f) << 1) ^ (((x >> 7) & 0x01010101) * 0x1b);
+    return x ^ r ^ ((w >> 16) | (w << 16)) ^ ((w >> 24) | (w << 8));
+}
+
+static void pp_aes256_encrypt(const uint8_t rk[15][16], const uint8_t *in, uint8_t *out) {
+    uint8_t s[16], t[16];
+    for (int i = 0; i < 16; i++) s[i] = in[i] ^ rk[0][i];
+    for (int round = 1; round <= 14; round++) {
+        // SubBytes and ShiftRows: byte r of column c comes from column c + r
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) t[4 * c + r] = pp_aes_sbox[s[4 * ((c + r) & 3) + r]];
+        }
+        if (round < 14) {
+            for (int c = 0; c < 4; c++) {
+                uint32_t w = pp_aes_mix(pp_read_le32(t + 4 * c));
+                pp_write_le32(t + 4 * c, w);
+            }
+        }
+        for (int i = 0; i < 16; i++) s[i] = t[i] ^ rk[round][i];
+    }
+    memcpy(out, s, 16);
+}
+
+// Portable GHASH: Shoup's 4-bit tables
+static void pp_ghash_table(PP_GcmKey *k) {
+    uint64_t vh = pp_read_be32(k->h) * 0x100000000ULL + pp_read_be32(k->h + 4);
+    uint64_t vl = pp_read_be32(k->h + 8) * 0x100000000ULL + pp_read_be32(k->h + 12);
+    k->hl[8] = vl;
+    k->hh[8] = vh;
+    k->hl[0] = k->hh[0] = 0;
+    for (int i = 4; i > 0; i >>= 1) {
+        uint64_t t = (vl & 1) * 0xe1000000ULL;
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ (t << 32);
+        k->hl[i] = vl;
+        k->hh[i] = vh;
+    }
+    for (int i = 2; i <= 8; i *= 2) {
+        for (int j = 1; j < i; j++) {
+            k->hh[i + j] = k->hh[i] ^ k->hh[j];
+            k->hl[i + j] = k->hl[i] ^ k->hl[j];
+        }
+    }
+}
+
+static void pp_ghash_mult(const PP_GcmKey *k, uint8_t *x) {
+    static const uint64_t last4[16] = {
+        0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+        0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+    };
+    uint8_t lo = x[15] & 0xf;
+    uint64_t zh = k->hh[lo], zl = k->hl[lo];
+
+    for (int i = 15; i >= 0; i--) {
+        lo = x[i] & 0xf;
+        uint8_t hi = x[i] >> 4;
+        if (i != 15) {
+            uint8_t rem = (uint8_t)(zl & 0xf);
+            zl = (zh << 60) | (zl >> 4);
+            zh = (zh >> 4) ^ (last4[rem] << 48);
+            zh ^= k->hh[lo];
+            zl ^= k->hl[lo];
+        }
+        uint8_t rem = (uint8_t)(zl & 0xf);
+        zl = (zh << 60) | (zl >> 4);
+        zh = (zh >> 4) ^ (last4[rem] << 48);
+        zh ^= k->hh[hi];
+        zl ^= k->hl[hi];
+    }
+    pp_write_be32(x, (uint32_t)(zh >> 32));
+    pp_write_be32(x + 4, (uint32_t)zh);
+    pp_write_be32(x + 8, (uint32_t)(zl >> 32));
+    pp_write_be32(x + 12, (uint32_t)zl);
+}
+
+// Fold data into the GHASH state y, zero-padding the last partial block
+static void pp_ghash_portable(const PP_GcmKey *k, uint8_t *y, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        size_t n = size < 16 ? size : 16;
+        for (size_t i = 0; i < n; i++) y[i] ^= data[i];
+        pp_ghash_mult(k, y);
+        data += n;
+        size -= n;
+    }
+}
+
+// CTR keystream from counter block ctr (inc32 after each block)
+static void pp_ctr_portable(const PP_GcmKey *k, uint8_t *ctr, const uint8_t *in, uint8_t *out,
+                            size_t size) {
+    uint8_t ks[16];
+    while (size > 0) {
+        size_t n = size < 16 ? size : 16;
+        pp_aes256_encrypt(k->rk, ctr, ks);
+        pp_write_be32(ctr + 12, pp_read_be32(ctr + 12) + 1);
+        for (size_t i = 0; i < n; i++) out[i] = in[i] ^ ks[i];
+        in += n;
+        out += n;
+        size -= n;
+    }
+}
+
+#ifdef PP_HAVE_AESNI
+PP_AESNI_TARGET
+static inline __m128i pp_aesni_block(const __m128i *rk, __m128i b) {
+    b = _mm_xor_si128(b, rk[0]);
+    for (int r = 1; r < 14; r++) b = _mm_aesenc_si128(b, rk[r]);
+    return _mm_aesenclast_si128(b, rk[14]);
+}
+
+// 256-bit carry-less product of two byte-reflected field elements
+PP_AESNI_TARGET
+static inline void pp_clmul(__m128i a, __m128i b, __m128i *lo, __m128i *hi) {
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    *lo = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(mid, 8));
+    *hi = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(mid, 8));
+}
+
+// Shift the product left by one bit and reduce modulo x^128 + x^7 + x^2 + x + 1
+PP_AESNI_TARGET
+static inline __m128i pp_clmul_reduce(__m128i lo, __m128i hi) {
+    __m128i c_lo = _mm_srli_epi32(lo, 31), c_hi = _mm_srli_epi32(hi, 31);
+    lo = _mm_or_si128(_mm_slli_epi32(lo, 1), _mm_slli_si128(c_lo, 4));
+    hi = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(hi, 1), _mm_slli_si128(c_hi, 4)),
+                      _mm_srli_si128(c_lo, 12));
+
+    __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                              _mm_slli_epi32(lo, 25));
+    __m128i b = _mm_srli_si128(a, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+    __m128i c = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                              _mm_srli_epi32(lo, 7));
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, _mm_xor_si128(c, b)));
+}
+
+// GHASH over data, four blocks per reduction with H^4..H
+PP_AESNI_TARGET
+static void pp_ghash_aesni(const __m128i *hp, uint8_t *y, const uint8_t *data, size_t size) {
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)y), bswap);
+
+    for (; size >= 64; data += 64, size -= 64) {
+        __m128i lo, hi, l, h;
+        __m128i b0 = _mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), bswap));
+        pp_clmul(b0, hp[3], &lo, &hi);
+        for (int i = 1; i < 4; i++) {
+            __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * i)), bswap);
+            pp_clmul(b, hp[3 - i], &l, &h);
+            lo = _mm_xor_si128(lo, l);
+            hi = _mm_xor_si128(hi, h);
+        }
+        x = pp_clmul_reduce(lo, hi);
+    }
+    while (size > 0) {
+        uint8_t block[16] = {0};
+        size_t n = size < 16 ? size : 16;
+        memcpy(block, data, n);
+        __m128i lo, hi;
+        x = _mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)block), bswap));
+        pp_clmul(x, hp[0], &lo, &hi);
+        x = pp_clmul_reduce(lo, hi);
+        data += n;
+        size -= n;
+    }
+    _mm_storeu_si128((__m128i*)y, _mm_shuffle_epi8(x, bswap));
+}
+
+// CTR, eight blocks at a time to fill the AES pipeline
+PP_AESNI_TARGET
+static void pp_ctr_aesni(const PP_GcmKey *k, uint8_t *ctr, const uint8_t *in, uint8_t *out,
+                         size_t size) {
+    __m128i rk[15];
+    for (int r = 0; r < 15; r++) rk[r] = _mm_loadu_si128((const __m128i*)k->rk[r]);
+    __m128i base = _mm_loadu_si128((const __m128i*)ctr);
+    uint32_t counter = pp_read_be32(ctr + 12);
+
+    for (; size >= 128; in += 128, out += 128, size -= 128) {
+        __m128i b[8];
+        for (int i = 0; i < 8; i++) {
+            b[i] = _mm_insert_epi32(base, (int)__builtin_bswap32(counter + i), 3);
+            b[i] = _mm_xor_si128(b[i], rk[0]);
+        }
+        for (int r = 1; r < 14; r++) {
+            for (int i = 0; i < 8; i++) b[i] = _mm_aesenc_si128(b[i], rk[r]);
+        }
+        for (int i = 0; i < 8; i++) {
+            b[i] = _mm_aesenclast_si128(b[i], rk[14]);
+            __m128i d = _mm_loadu_si128((const __m128i*)(in + 16 * i));
+            _mm_storeu_si128((__m128i*)(out + 16 * i), _mm_xor_si128(d, b[i]));
+        }
+        counter += 8;
+    }
+    while (size > 0) {
+        uint8_t ks[16];
+        size_t n = size < 16 ? size : 16;
+        __m128i b = _mm_insert_epi32(base, (int)__builtin_bswap32(counter++), 3);
+        _mm_storeu_si128((__m128i*)ks, pp_aesni_block(rk, b));
+        for (size_t i = 0; i < n; i++) out[i] = in[i] ^ ks[i];
+        in += n;
+        out += n;
+        size -= n;
+    }
+    pp_write_be32(ctr + 12, counter);
+}
+
+// H^1..H^4, byte-reflected
+PP_AESNI_TARGET
+static void pp_ghash_powers(const PP_GcmKey *k, __m128i *hp) {
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    hp[0] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)k->h), bswap);
+    for (int i = 1; i < 4; i++) {
+        __m128i lo, hi;
+        pp_clmul(hp[i - 1], hp[0], &lo, &hi);
+        hp[i] = pp_clmul_reduce(lo, hi);
+    }
+}
+#endif
+
+static void pp_gcm_init(PP_GcmKey *k, const uint8_t *key) {
+    static const uint8_t zero[16] = {0};
+    pp_aes256_expand(key, k->rk);
+    pp_aes256_encrypt(k->rk, zero, k->h);
+    pp_ghash_table(k);
+    k->aesni = 0;
+#ifdef PP_HAVE_AESNI
+    __builtin_cpu_init();
+    k->aesni = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+               __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3");
+#endif
+}
+
+// One GCM operation with a 12-byte nonce; the tag covers aad and the
+// ciphertext (out when sealing, in when opening)
+static void pp_gcm_crypt(const PP_GcmKey *k, const uint8_t *nonce, const uint8_t *aad,
+                         size_t aad_size, const uint8_t *in, uint8_t *out, size_t size,
+                         int decrypt, uint8_t *tag) {
+    uint8_t j0[16], ctr[16], y[16] = {0}, lengths[16];
+    memcpy(j0, nonce, 12);
+    pp_write_be32(j0 + 12, 1);
+    memcpy(ctr, j0, 16);
+    pp_write_be32(ctr + 12, 2);
+    pp_write_be32(lengths, (uint32_t)((uint64_t)aad_size * 8 >> 32));
+    pp_write_be32(lengths + 4, (uint32_t)(aad_size * 8));
+    pp_write_be32(lengths + 8, (uint32_t)((uint64_t)size * 8 >> 32));
+    pp_write_be32(lengths + 12, (uint32_t)(size * 8));
+    const uint8_t *cipher = decrypt ? in : out;
+
+#ifdef PP_HAVE_AESNI
+    if (k->aesni) {
+        __m128i hp[4];
+        pp_ghash_powers(k, hp);
+        pp_ghash_aesni(hp, y, aad, aad_size);
+        // Hash ciphertext in slices, right after producing it when sealing
+        for (size_t pos = 0; pos < size; pos += 4096) {
+            size_t n = size - pos < 4096 ? size - pos : 4096;
+            if (decrypt) pp_ghash_aesni(hp, y, cipher + pos, n);
+            pp_ctr_aesni(k, ctr, in + pos, out + pos, n);
+            if (!decrypt) pp_ghash_aesni(hp, y, cipher + pos, n);
+        }
+        pp_ghash_aesni(hp, y, lengths, 16);
+        pp_ctr_aesni(k, j0, y, tag, 16);
+        return;
+    }
+#endif
+    pp_ghash_portable(k, y, aad, aad_size);
+    if (decrypt) pp_ghash_portable(k, y, cipher, size);
+    pp_ctr_portable(k, ctr, in, out, size);
+    if (!decrypt) pp_ghash_portable(k, y, cipher, size);
+    pp_ghash_portable(k, y, lengths, 16);
+    pp_ctr_portable(k, j0, y, tag, 16);
+}
+
+typedef struct {
+    const PP_GcmKey *key;
+    const uint8_t *header;
+    const uint8_t *in;
+    uint8_t *out;
+    uint64_t size;                        // Plaintext size
+    uint32_t segment;
+    uint32_t count;
+    int decrypt;
+    int failed;
+} PP_EnvelopeJob;
+
+static void pp_envelope_segment(void *arg, uint32_t index, int worker) {
+    PP_EnvelopeJob *job = (PP_EnvelopeJob*)arg;
+    (void)worker;
+    uint64_t start = (uint64_t)index * job->segment;
+    size_t n = (size_t)(job->size - start < job->segment ? job->size - start : job->segment);
+    const uint8_t *sealed = (job->decrypt ? job->in : job->out) + start + (uint64_t)index * PP_ENVELOPE_TAG_SIZE;
+    const uint8_t *src = job->decrypt ? sealed : job->in + start;
+    uint8_t *dst = job->decrypt ? job->out + start : (uint8_t*)sealed;
+
+    uint8_t nonce[12], tag[16];
+    memcpy(nonce, job->header + 24, 7);
+    pp_write_be32(nonce + 7, index);
+    nonce[11] = index == job->count - 1;
+    pp_gcm_crypt(job->key, nonce, job->header, PP_ENVELOPE_HEADER_SIZE, src, dst, n,
+                 job->decrypt, tag);
+
+    if (job->decrypt) {
+        uint8_t diff = 0;
+        for (int i = 0; i < 16; i++) diff |= tag[i] ^ sealed[n + i];
+        if (diff) job->failed = 1;
+    } else {
+        memcpy(dst + n, tag, 16);
+    }
+}
+
+// Check an envelope header; returns the segment size or 0
+static uint32_t pp_envelope_check(const uint8_t *header, uint64_t size) {
+    if (size < PP_ENVELOPE_HEADER_SIZE || header[0] != PP_ENVELOPE_FLAG ||
+        header[1] != PP_ENVELOPE_VERSION || header[2] != PP_ENVELOPE_KDF_PBKDF2 ||
+        header[3] < 12 || header[3] > 24) {
+        return 0;
+    }
+    uint32_t iterations = pp_read_le32(header + 4);
+    if (iterations == 0 || iterations > PP_ENVELOPE_MAX_ITERATIONS) return 0;
+    return 1u << header[3];
+}
+
+static uint32_t pp_envelope_count(uint64_t size, uint32_t segment) {
+    uint64_t count = (size + segment - 1) / segment;
+    return count > 0 ? (uint32_t)count : 1;
+}
+
+static int pp_random_bytes(uint8_t *buf, size_t size) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0) return PP_ERROR_INVALID;
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, buf + got, size - got);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            close(fd);
+            return PP_ERROR_INVALID;
+        }
+        got += (size_t)n;
+    }
+    close(fd);
+    return PP_OK;
+}
+
+static void pp_envelope_key(PP_GcmKey *key, const uint8_t *header, const char *password) {
+    uint8_t derived[32];
+    pp_pbkdf2_sha256((const uint8_t*)password, strlen(password), header + 8, 16,
+                     pp_read_le32(header + 4), derived);
+    pp_gcm_init(key, derived);
+    memset(derived, 0, sizeof(derived));
+}
+
+uint64_t pp_envelope_bound(uint64_t size) {
+    uint64_t segment = 1u << PP_ENVELOPE_SEGMENT_LOG;
+    uint64_t count = size > 0 ? (size + segment - 1) / segment : 1;
+    return PP_ENVELOPE_HEADER_SIZE + size + count * PP_ENVELOPE_TAG_SIZE;
+}
+
+int64_t pp_envelope_content_size(const uint8_t *input, uint64_t input_size) {
+    if (!input) return PP_ERROR_INVALID;
+    uint32_t segment = pp_envelope_check(input, input_size);
+    if (!segment) return PP_ERROR_INVALID;
+    uint64_t body = input_size - PP_ENVELOPE_HEADER_SIZE;
+    uint64_t count = (body + segment + PP_ENVELOPE_TAG_SIZE - 1) / (segment + PP_ENVELOPE_TAG_SIZE);
+    if (count == 0) count = 1;
+    if (count > UINT32_MAX) return PP_ERROR_CORRUPT;
+    // Every segment, the last one included, carries at least its tag
+    if (body < (count - 1) * (segment + PP_ENVELOPE_TAG_SIZE) + PP_ENVELOPE_TAG_SIZE) {
+        return PP_ERROR_CORRUPT;
+    }
+    return (int64_t)(body - count * PP_ENVELOPE_TAG_SIZE);
+}
+
+int pp_envelope_seal(const uint8_t *input, uint64_t input_size, uint8_t *output,
+                     uint64_t *output_size, const char *password, uint32_t iterations,
+                     int threads) {
+    if ((!input && input_size > 0) || !output || !output_size || !password) return PP_ERROR_INVALID;
+    if (iterations == 0) iterations = PP_ENVELOPE_ITERATIONS;
+    if (iterations > PP_ENVELOPE_MAX_ITERATIONS) return PP_ERROR_INVALID;
+    if (*output_size < pp_envelope_bound(input_size)) {
+        *output_size = pp_envelope_bound(input_size);
+        return PP_ERROR_BUFFER;
+    }
+    if (input_size / (1u << PP_ENVELOPE_SEGMENT_LOG) >= UINT32_MAX) return PP_ERROR_INVALID;
+
+    uint8_t header[PP_ENVELOPE_HEADER_SIZE] = {0};
+    header[0] = PP_ENVELOPE_FLAG;
+    header[1] = PP_ENVELOPE_VERSION;
+    header[2] = PP_ENVELOPE_KDF_PBKDF2;
+    header[3] = PP_ENVELOPE_SEGMENT_LOG;
+    pp_write_le32(header + 4, iterations);
+    int result = pp_random_bytes(header + 8, 23);
+    if (result != PP_OK) return result;
+
+    PP_GcmKey key;
+    pp_envelope_key(&key, header, password);
+    memcpy(output, header, PP_ENVELOPE_HEADER_SIZE);
+
+    uint32_t segment = 1u << PP_ENVELOPE_SEGMENT_LOG;
+    PP_EnvelopeJob job = { &key, header, input, output + PP_ENVELOPE_HEADER_SIZE, input_size,
+                           segment, pp_envelope_count(input_size, segment), 0, 0 };
+    pp_parallel_for(job.count, threads, pp_envelope_segment, &job);
+    memset(&key, 0, sizeof(key));
+
+    *output_size = pp_envelope_bound(input_size);
+    return PP_OK;
+}
+
+int pp_envelope_open(const uint8_t *input, uint64_t input_size, uint8_t *output,
+                     uint64_t *output_size, const char *password, int threads) {
+    if (!input || !output_size || !password) return PP_ERROR_INVALID;
+    int64_t content = pp_envelope_content_size(input, input_size);
+    if (content < 0) return (int)content;
+    if (!output && content > 0) return PP_ERROR_INVALID;
+    if (*output_size < (uint64_t)content) {
+        *output_size = (uint64_t)content;
+        return PP_ERROR_BUFFER;
+    }
+
+    PP_GcmKey key;
+    pp_envelope_key(&key, input, password);
+
+    uint32_t segment = pp_envelope_check(input, input_size);
+    uint32_t count = pp_envelope_count(input_size - PP_ENVELOPE_HEADER_SIZE,
+                                       segment + PP_ENVELOPE_TAG_SIZE);
+    PP_EnvelopeJob job = { &key, input, input + PP_ENVELOPE_HEADER_SIZE, output, (uint64_t)content,
+                           segment, count, 1, 0 };
+    pp_parallel_for(job.count, threads, pp_envelope_segment, &job);
+    memset(&key, 0, sizeof(key));
+
+    if (job.failed) {
+        if (content > 0) memset(output, 0, (size_t)content);
+        return PP_ERROR_CHECKSUM;
+    }
+    *output_size = (uint64_t)content;
+    return PP_OK;
+}
+
+/* ---------- Streaming ---------- */
+
+// Compress a file block by block into a sink, choosing each block's level
+// from how fast the sink drains. A writer thread empties a small queue of
+// finished blocks: when the compressor has to wait for a free slot the sink
+// is the bottleneck and spare CPU buys a higher level; when the writer sits
+// idle on an empty queue the compressor is the bottleneck and the level
+// drops. Memory stays at a few blocks whatever the input size.
+
+#define PP_STREAM_QUEUE 4
+
+typedef struct {
+    FILE *out;
+    uint8_t *slots[PP_STREAM_QUEUE];
+    uint32_t sizes[PP_STREAM_QUEUE];
+    uint32_t slot_size;       // Largest chunk pp_stream_push takes
+    uint32_t head;
+    uint32_t count;
+    uint32_t stalled;         // Producer waited for a free slot
+    uint32_t starved;         // Writer waited for a block
+    int done;
+    int error;
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_t thread;
+#else
+    double write_time;        // Seconds spent in the last write
+    double push_time;         // When the last write returned
+#endif
+} PP_StreamWriter;
+
+static int pp_stream_write(PP_StreamWriter *w, const uint8_t *data, uint32_t size) {
+    return fwrite(data, 1, size, w->out) == size && fflush(w->out) == 0;
+}
+
+#ifdef PP_HAVE_THREADS
+static void* pp_stream_writer(void *p) {
+    PP_StreamWriter *w = (PP_StreamWriter*)p;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        if (w->count == 0 && !w->done) {
+            w->starved++;
+            while (w->count == 0 && !w->done) pthread_cond_wait(&w->not_empty, &w->lock);
+        }
+        if (w->count == 0) break;
+
+        uint32_t slot = w->head;
+        pthread_mutex_unlock(&w->lock);
+        int ok = pp_stream_write(w, w->slots[slot], w->sizes[slot]);
+        pthread_mutex_lock(&w->lock);
+
+        if (!ok) w->error = 1;
+        w->head = (w->head + 1) % PP_STREAM_QUEUE;
+        w->count--;
+        pthread_cond_signal(&w->not_full);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+#else
+static double pp_stream_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+#endif
+
+// Start the writer; on failure everything is released again, and the
+// writer must not be passed to pp_stream_close
+static int pp_stream_open(PP_StreamWriter *w, FILE *out, uint32_t slot_size) {
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    w->slot_size = slot_size;
+    for (int i = 0; i < PP_STREAM_QUEUE; i++) {
+        w->slots[i] = (uint8_t*)malloc(slot_size);
+        if (!w->slots[i]) {
+            while (i-- > 0) free(w->slots[i]);
+            return -1;
+        }
+    }
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->not_empty, NULL);
+    pthread_cond_init(&w->not_full, NULL);
+    if (pthread_create(&w->thread, NULL, pp_stream_writer, w) != 0) {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->not_empty);
+        pthread_cond_destroy(&w->not_full);
+        for (int i = 0; i < PP_STREAM_QUEUE; i++) free(w->slots[i]);
+        return -1;
+    }
+#else
+    w->push_time = pp_stream_clock();
+#endif
+    return 0;
+}
+
+// Queue one chunk of at most slot_size bytes for the sink; blocks while
+// the queue is full
+static int pp_stream_push(PP_StreamWriter *w, const uint8_t *data, uint32_t size) {
+    if (size > w->slot_size) return -1;
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_lock(&w->lock);
+    if (w->count == PP_STREAM_QUEUE) {
+        w->stalled++;
+        while (w->count == PP_STREAM_QUEUE) pthread_cond_wait(&w->not_full, &w->lock);
+    }
+    int error = w->error;
+    pthread_mutex_unlock(&w->lock);
+
+    // Only this thread fills slots, so the copy needs no lock
+    uint32_t slot = (w->head + w->count) % PP_STREAM_QUEUE;
+    memcpy(w->slots[slot], data, size);
+    w->sizes[slot] = size;
+
+    pthread_mutex_lock(&w->lock);
+    w->count++;
+    pthread_cond_signal(&w->not_empty);
+    pthread_mutex_unlock(&w->lock);
+    return error ? -1 : 0;
+#else
+    // Without a writer thread, compare the write with the compression
+    // time since the previous write
+    double start = pp_stream_clock();
+    int ok = pp_stream_write(w, data, size);
+    double end = pp_stream_clock();
+    if (end - start > start - w->push_time) {
+        w->stalled++;
+    } else {
+        w->starved++;
+    }
+    w->push_time = end;
+    return ok ? 0 : -1;
+#endif
+}
+
+// Drain the queue and stop the writer; returns -1 if any write failed
+static int pp_stream_close(PP_StreamWriter *w) {
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_lock(&w->lock);
+    w->done = 1;
+    pthread_cond_signal(&w->not_empty);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->not_empty);
+    pthread_cond_destroy(&w->not_full);
+#endif
+    for (int i = 0; i < PP_STREAM_QUEUE; i++) free(w->slots[i]);
+    return w->error ? -1 : 0;
+}
+
+// Sink pressure since the last call: +1 raise the level, -1 lower it
+static int pp_stream_pressure(PP_StreamWriter *w) {
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_lock(&w->lock);
+#endif
+    int pressure = w->stalled ? 1 : (w->starved && w->count <= 1) ? -1 : 0;
+    w->stalled = 0;
+    w->starved = 0;
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_unlock(&w->lock);
+#endif
+    return pressure;
+}
+
+// Compress size bytes from in into out as one v5 frame (against dict, if
+// given). With opts->adaptive_max set, the level adapts per block within
+// [opts->adaptive_min, opts->adaptive_max]; otherwise every block uses
+// opts->level, fast levels included. stats->levels counts the blocks
+// written at each level from 1 up. Blocks are compressed as they are read,
+// so they cannot be linked.
+int pp_compress_stream(FILE *in, uint64_t size, FILE *out,
+                       const PP_Options *options, const PP_Dict *dict, PP_Stats *stats) {
+    if (!in || !out || !options || size == 0 || options->window_log) return PP_ERROR_INVALID;
+
+    PP_Options opts = *options;
+    int8_t fixed = pp_resolve_level(opts.level);
+    int8_t min_level = opts.adaptive_max ? (int8_t)(opts.adaptive_min ? opts.adaptive_min : 1) : fixed;
+    int8_t max_level = opts.adaptive_max ? (int8_t)opts.adaptive_max : fixed;
+    if (max_level > PP_LEVEL_MAX) max_level = PP_LEVEL_MAX;
+    if (min_level > max_level) min_level = max_level;
+    opts.level = opts.level < min_level ? min_level : opts.level > max_level ? max_level : opts.level;
+
+    uint32_t block_count = (uint32_t)((size - 1) / PP_BLOCK_SIZE + 1);
+    uint32_t seek_size = block_count * PP_SEEK_ENTRY_SIZE + PP_SEEK_FOOTER_SIZE;
+    uint8_t *seek = (uint8_t*)malloc(seek_size);
+    uint8_t *block = (uint8_t*)malloc(PP_BLOCK_SIZE);
+    PP_Context *ctx = (seek && block) ? pp_init_context(NULL, PP_BLOCK_SIZE) : NULL;
+    PP_StreamWriter w;
+    int result = 0;
+    if (ctx) ctx->dict = dict;
+    if (!ctx || pp_stream_open(&w, out, ctx->output_size + 4) != 0) {
+        pp_free_context(ctx);
+        free(block);
+        free(seek);
+        return -1;
+    }
+
+    // The pipeline is chosen from the first block, as the header needs it up front
+    uint32_t first = size < PP_BLOCK_SIZE ? (uint32_t)size : PP_BLOCK_SIZE;
+    if (fread(block, 1, first, in) != first) result = -1;
+    uint8_t file_type = pp_detect_filetype(block, first);
+    if (opts.strategy == PP_STRATEGY_AUTO || opts.strategy >= PP_STRATEGY_COUNT) {
+        opts.strategy = pp_filetype_strategy[file_type];
+    }
+    opts.filters |= pp_strategy_table[opts.strategy].filters;
+
+    uint8_t header[PP_FRAME_HEADER_SIZE];
+    pp_write_frame_header(header, &opts, max_level, file_type, size, dict);
+    if (result == 0) result = pp_stream_push(&w, header, PP_FRAME_HEADER_SIZE);
+
+    uint64_t total = PP_FRAME_HEADER_SIZE;
+    for (uint64_t pos = 0; result == 0 && pos < size; pos += PP_BLOCK_SIZE) {
+        uint32_t n = (size - pos < PP_BLOCK_SIZE) ? (uint32_t)(size - pos) : PP_BLOCK_SIZE;
+        if (pos > 0 && fread(block, 1, n, in) != n) {
+            result = -1;
+            break;
+        }
+
+        // The writer always starts out idle, so the first block keeps the start level
+        int pressure = pp_stream_pressure(&w);
+        if (pos == 0) pressure = 0;
+        if (pressure > 0 && opts.level < max_level) opts.level++;
+        if (pressure < 0 && opts.level > min_level) opts.level--;
+        if (opts.level > 0) ctx->stats.levels[opts.level]++;
+
+        uint32_t m = pp_compress_block(ctx, block, n, &opts);
+        pp_write_le32(ctx->output + m, pp_xxh32(ctx->output, m, 0));
+        result = pp_stream_push(&w, ctx->output, m + 4);
+        total += m + 4;
+
+        pp_write_le32(seek + ctx->stats.blocks * PP_SEEK_ENTRY_SIZE, m + 4);
+        pp_write_le32(seek + ctx->stats.blocks * PP_SEEK_ENTRY_SIZE + 4, n);
+        ctx->stats.blocks++;
+    }
+
+    // End-of-frame marker carrying the seek index
+    if (result == 0) {
+        uint8_t end[PP_BLOCK_HEADER_SIZE];
+        uint8_t *footer = seek + block_count * PP_SEEK_ENTRY_SIZE;
+        pp_write_le32(footer, block_count);
+        pp_write_le32(footer + 4, pp_xxh32(seek, block_count * PP_SEEK_ENTRY_SIZE, 0));
+        pp_write_le32(footer + 8, PP_SEEK_MAGIC);
+        pp_write_block_header(end, PP_BLOCK_END, 0, 0, seek_size, 0);
+        result = pp_stream_push(&w, end, PP_BLOCK_HEADER_SIZE);
+
+        // The index outgrows a slot past about 32K blocks (8GB of input)
+        for (uint32_t done = 0; result == 0 && done < seek_size; ) {
+            uint32_t part = seek_size - done < w.slot_size ? seek_size - done : w.slot_size;
+            result = pp_stream_push(&w, seek + done, part);
+            done += part;
+        }
+        total += PP_BLOCK_HEADER_SIZE + seek_size;
+    }
+    if (pp_stream_close(&w) != 0) result = -1;
+
+    if (stats) {
+        *stats = ctx->stats;
+        stats->input_size = size;
+        stats->output_size = total;
+        stats->file_type = file_type;
+        stats->strategy = opts.strategy;
+        stats->level = max_level;
+        stats->filters = opts.filters;
+    }
+
+    pp_free_context(ctx);
+    free(block);
+    free(seek);
+    return result;
+}
+
+/* ---------- Integrity test ---------- */
+
+// Data block located by pp_scan_frame
+typedef struct {
+    uint64_t offset;          // Block header position in the frame
+    uint64_t out_offset;      // Position of its raw bytes in the content
+} PP_FrameBlock;
+
+typedef struct {
+    const uint8_t *frame;
+    uint8_t frame_flags;
+    const PP_FrameBlock *blocks;
+    int8_t *results;          // Per block: 0, or a negative error code
+    int8_t *decoded;
+    int quick;
+    uint32_t window;          // Linked frame: blocks decode in order after
+    uint32_t fill;            // up to window bytes of history in buf[0]
+    uint32_t buf_size;
+    uint8_t *buf[PP_MAX_THREADS];
+    PP_Decoder scratch[PP_MAX_THREADS];
+} PP_VerifyJob;
+
+// Walk the block headers of a v5 frame without decoding anything
+static int pp_scan_frame(const uint8_t *input, uint64_t input_size,
+                         PP_FrameBlock **blocks, uint32_t *count) {
+    if (input_size < PP_FRAME_HEADER_SIZE || (input[0] | (input[1] << 8)) != PP_MAGIC ||
+        input[2] != PP_FRAME_VERSION || input[7] > 30) {
+        return -1;
+    }
+    if (pp_frame_window(input) == UINT32_MAX) return -4;
+
+    uint64_t content_size = pp_read_le64(input + 8);
+    uint32_t trailer = (input[4] & PP_FRAME_STORED_CHECKSUM) ? 4 : 0;
+    uint32_t max_raw = 1u << input[7];
+    uint64_t pos = PP_FRAME_HEADER_SIZE, out = 0;
+    PP_FrameBlock *list = NULL;
+    uint32_t n = 0, cap = 0;
+
+    for (;;) {
+        if (input_size - pos < PP_BLOCK_HEADER_SIZE) break;
+        const uint8_t *bh = input + pos;
+        uint32_t raw_size = pp_read_le32(bh + 4);
+        uint64_t span = PP_BLOCK_HEADER_SIZE + (uint64_t)pp_read_le32(bh + 8) + trailer;
+
+        if (bh[0] == PP_BLOCK_END) {
+            if (out != content_size) break;
+            *blocks = list;
+            *count = n;
+            return 0;
+        }
+        if (span > input_size - pos || raw_size > max_raw || raw_size > content_size - out) break;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            PP_FrameBlock *grown = (PP_FrameBlock*)realloc(list, cap * sizeof(PP_FrameBlock));
+            if (!grown) {
+                free(list);
+                return -1;
+            }
+            list = grown;
+        }
+        list[n].offset = pos;
+        list[n].out_offset = out;
+        n++;
+        pos += span;
+        out += raw_size;
+    }
+
+    free(list);
+    return -4; // Truncated or inconsistent block headers
+}
+
+static void pp_verify_block(void *p, uint32_t index, int worker) {
+    PP_VerifyJob *job = (PP_VerifyJob*)p;
+    const uint8_t *bh = job->frame + job->blocks[index].offset;
+    const uint8_t *src = bh + PP_BLOCK_HEADER_SIZE;
+    uint32_t raw_size = pp_read_le32(bh + 4);
+    uint32_t stored_size = pp_read_le32(bh + 8);
+    uint32_t checksum = pp_read_le32(bh + 12);
+    int r = 0;
+
+    if (job->frame_flags & PP_FRAME_STORED_CHECKSUM) {
+        if (pp_xxh32(bh, PP_BLOCK_HEADER_SIZE + stored_size, 0) != pp_read_le32(src + stored_size)) {
+            r = -3;
+        }
+    }
+
+    // Quick mode trusts the stored checksum; otherwise decode into scratch
+    if (r == 0 && (!job->quick || !(job->frame_flags & PP_FRAME_STORED_CHECKSUM))) {
+        const uint8_t *raw = src;
+        if (bh[0] != PP_BLOCK_RAW || job->window) {
+            if (!job->buf[worker]) job->buf[worker] = (uint8_t*)malloc(job->buf_size);
+            uint8_t *dst = job->buf[worker];
+            uint32_t history = 0;
+            if (dst && job->window) {
+                // Slide the last window down once the buffer is full
+                if (job->fill + raw_size > job->buf_size) {
+                    memmove(dst, dst + job->fill - job->window, job->window);
+                    job->fill = job->window;
+                }
+                history = job->fill < job->window ? job->fill : job->window;
+                dst += job->fill;
+                job->fill += raw_size;
+            }
+            r = dst ? pp_decode_block(bh[0], bh[1], src, stored_size, dst, raw_size, history,
+                                      &job->scratch[worker])
+                    : -1;
+            raw = dst;
+        } else if (stored_size != raw_size) {
+            r = -4;
+        }
+        if (r == 0 && (job->frame_flags & PP_FRAME_BLOCK_CHECKSUM) &&
+            pp_xxh32(raw, raw_size, 0) != checksum) {
+            r = -3;
+        }
+        job->decoded[index] = 1;
+    }
+    job->results[index] = (int8_t)r;
+}
+
+// Check a v5 frame without producing output: every block is decoded into a
+// per-thread scratch buffer and checked against its xxh32. With quick set,
+// blocks that carry a checksum of their stored bytes are only hashed.
+int pp_verify(const uint8_t *input, uint64_t input_size, const PP_Dict *dict,
+              int quick, int threads, PP_VerifyResult *res) {
+    PP_FrameBlock *blocks = NULL;
+    uint32_t count = 0;
+
+    memset(res, 0, sizeof(*res));
+    int result = pp_scan_frame(input, input_size, &blocks, &count);
+    if (result != 0) return result;
+    if (!quick && !pp_frame_dict_ok(input, dict)) {
+        free(blocks);
+        return -5; // Dictionary missing or different
+    }
+
+    PP_VerifyJob *job = (PP_VerifyJob*)calloc(1, sizeof(PP_VerifyJob));
+    int8_t *flags = (int8_t*)calloc(2 * (size_t)count + 1, 1);
+    if (!job || !flags) {
+        free(job);
+        free(flags);
+        free(blocks);
+        return -1;
+    }
+    job->frame = input;
+    job->frame_flags = input[4];
+    job->blocks = blocks;
+    job->results = flags;
+    job->decoded = flags + count;
+    job->quick = quick;
+    job->buf_size = 1u << input[7];
+    for (int i = 0; i < PP_MAX_THREADS; i++) job->scratch[i].dict = dict;
+
+    // Linked blocks need the ones before them: decode in order, keeping two
+    // windows so the history slides once per window rather than per block
+    if (pp_frame_window(input) && !(quick && (job->frame_flags & PP_FRAME_STORED_CHECKSUM))) {
+        uint64_t content = pp_read_le64(input + 8);
+        job->window = content < pp_frame_window(input) ? (uint32_t)content : pp_frame_window(input);
+        job->buf_size += 2 * job->window;
+        threads = 1;
+    }
+
+    pp_parallel_for(count, threads, pp_verify_block, job);
+
+    res->blocks = count;
+    res->content_size = pp_read_le64(input + 8);
+    for (uint32_t i = 0; i < count; i++) {
+        res->decoded += (uint32_t)job->decoded[i];
+        if (result == 0 && job->results[i] != 0) {
+            result = job->results[i];
+            res->bad_block = i;
+            res->bad_offset = blocks[i].offset;
+        }
+    }
+
+    for (int i = 0; i < PP_MAX_THREADS; i++) {
+        free(job->buf[i]);
+        pp_scratch_free(&job->scratch[i]);
+    }
+    free(job);
+    free(flags);
+    free(blocks);
+    return result;
+}
+
+// Map a whole file read-only; returns NULL on failure
+static uint8_t* pp_map_file(const char *path, uint64_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        *size = (uint64_t)st.st_size;
+    }
+    close(fd);
+    return (map == MAP_FAILED) ? NULL : (uint8_t*)map;
+}
+
+static void pp_unmap_file(uint8_t *map, uint64_t size) {
+    if (map) munmap(map, (size_t)size);
+}
+
+/* ---------- Archive (.ppa) ---------- */
+
+// Multi-file container. Each group is an independent v5 frame over a slice
+// of the concatenated file contents; a central index at the end maps paths
+// to stream ranges, so one file is extracted by decoding only its groups.
+// Small files share solid groups; large files span several groups so a
+// single big file still uses every core.
+//
+//   Header (16)  "PPAR", u32 version, 8 reserved
+//   Groups       v5 frames, back to back
+//   Index        u32 group count, u32 entry count,
+//                groups  { u64 archive offset, u32 stored size, u32 raw size,
+//                          u64 stream offset }
+//                entries { u64 stream offset, u64 size, u64 mtime, u32 mode,
+//                          u16 path length, path }
+//   Footer (24)  u64 index offset, u32 index size, u32 index xxh32,
+//                u32 reserved, "PPAR"
+
+#define PP_ARCHIVE_MAGIC "PPAR"
+#define PP_ARCHIVE_VERSION 1
+#define PP_ARCHIVE_HEADER_SIZE 16
+#define PP_ARCHIVE_FOOTER_SIZE 24
+#define PP_ARCHIVE_GROUP_BYTES 24
+#define PP_ARCHIVE_ENTRY_BYTES 30            // Fixed part, path follows
+#define PP_ARCHIVE_GROUP_SIZE (8u << 20)     // Raw bytes per group
+#define PP_ARCHIVE_SOLID_MAX (1u << 20)      // Smaller files share groups
+
+typedef struct {
+    char *path;               // Relative, '/'-separated
+    uint64_t offset;          // Offset in the concatenated content stream
+    uint64_t size;
+    uint64_t mtime;
+    uint32_t mode;
+    uint8_t selected;         // Extraction: requested by the caller
+} PP_ArchiveEntry;
+
+typedef struct {
+    uint64_t offset;          // Frame offset in the archive file
+    uint32_t stored_size;
+    uint32_t raw_size;
+    uint64_t stream_offset;
+} PP_ArchiveGroup;
+
+typedef struct {
+    PP_ArchiveEntry *entries;
+    uint32_t entry_count;
+    uint32_t entry_cap;
+    PP_ArchiveGroup *groups;
+    uint32_t group_count;
+    uint32_t group_cap;
+    uint32_t *jobs;           // Extraction: groups to decode
+    char *root;               // Source directory, or extraction target
+    const char *archive_path;
+    FILE *file;
+    PP_Options opts;
+    uint64_t write_pos;
+    uint32_t next_write;
+    int error;
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+#endif
+} PP_Archive;
+
+static void pp_archive_lock(PP_Archive *arc) {
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_lock(&arc->lock);
+#else
+    (void)arc;
+#endif
+}
+
+static void pp_archive_unlock(PP_Archive *arc) {
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_unlock(&arc->lock);
+#else
+    (void)arc;
+#endif
+}
+
+static PP_Archive* pp_archive_new(const char *root) {
+    PP_Archive *arc = (PP_Archive*)calloc(1, sizeof(PP_Archive));
+    if (!arc) return NULL;
+    arc->root = strdup(root);
+    if (!arc->root) {
+        free(arc);
+        return NULL;
+    }
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_init(&arc->lock, NULL);
+    pthread_cond_init(&arc->turn, NULL);
+#endif
+    return arc;
+}
+
+static void pp_archive_free(PP_Archive *arc) {
+    if (!arc) return;
+    for (uint32_t i = 0; i < arc->entry_count; i++) free(arc->entries[i].path);
+    free(arc->entries);
+    free(arc->groups);
+    free(arc->jobs);
+    free(arc->root);
+    if (arc->file) fclose(arc->file);
+#ifdef PP_HAVE_THREADS
+    pthread_mutex_destroy(&arc->lock);
+    pthread_cond_destroy(&arc->turn);
+#endif
+    free(arc);
+}
+
+static int pp_archive_add_group(PP_Archive *arc, uint64_t start, uint64_t end) {
+    if (end <= start) return 0;
+    if (arc->group_count == arc->group_cap) {
+        uint32_t cap = arc->group_cap ? arc->group_cap * 2 : 64;
+        PP_ArchiveGroup *grown = (PP_ArchiveGroup*)realloc(arc->groups, cap * sizeof(PP_ArchiveGroup));
+        if (!grown) return -1;
+        arc->groups = grown;
+        arc->group_cap = cap;
+    }
+    PP_ArchiveGroup *g = &arc->groups[arc->group_count++];
+    memset(g, 0, sizeof(*g));
+    g->stream_offset = start;
+    g->raw_size = (uint32_t)(end - start);
+    return 0;
+}
+
+static int pp_archive_add_entry(PP_Archive *arc, const char *path, const struct stat *st) {
+    if (arc->entry_count == arc->entry_cap) {
+        uint32_t cap = arc->entry_cap ? arc->entry_cap * 2 : 256;
+        PP_ArchiveEntry *grown = (PP_ArchiveEntry*)realloc(arc->entries, cap * sizeof(PP_ArchiveEntry));
+        if (!grown) return -1;
+        arc->entries = grown;
+        arc->entry_cap = cap;
+    }
+    PP_ArchiveEntry *e = &arc->entries[arc->entry_count];
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    if (!e->path) return -1;
+    e->size = (uint64_t)st->st_size;
+    e->mtime = (uint64_t)st->st_mtime;
+    e->mode = (uint32_t)st->st_mode & 07777;
+    arc->entry_count++;
+    return 0;
+}
+
+// Collect regular files below root/rel; symlinks and special files are skipped
+static int pp_archive_scan(PP_Archive *arc, const char *rel, const struct stat *skip) {
+    size_t root_len = strlen(arc->root);
+    size_t rel_len = strlen(rel);
+    char *dir_path = (char*)malloc(root_len + rel_len + 2);
+    if (!dir_path) return -1;
+    sprintf(dir_path, "%s%s%s", arc->root, rel_len ? "/" : "", rel);
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        free(dir_path);
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent *de;
+    while (result == 0 && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        size_t name_len = strlen(de->d_name);
+        char *child_rel = (char*)malloc(rel_len + name_len + 2);
+        char *child_path = (char*)malloc(root_len + rel_len + name_len + 3);
+        if (!child_rel || !child_path) {
+            free(child_rel);
+            free(child_path);
+            result = -1;
+            break;
+        }
+        sprintf(child_rel, "%s%s%s", rel, rel_len ? "/" : "", de->d_name);
+        sprintf(child_path, "%s/%s", arc->root, child_rel);
+
+        struct stat st;
+        if (lstat(child_path, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                result = pp_archive_scan(arc, child_rel, skip);
+            } else if (S_ISREG(st.st_mode) &&
+                       !(st.st_dev == skip->st_dev && st.st_ino == skip->st_ino)) {
+                result = pp_archive_add_entry(arc, child_rel, &st);
+            }
+        }
+        free(child_rel);
+        free(child_path);
+    }
+
+    closedir(dir);
+    free(dir_path);
+    return result;
+}
+
+static int pp_archive_entry_cmp(const void *a, const void *b) {
+    return strcmp(((const PP_ArchiveEntry*)a)->path, ((const PP_ArchiveEntry*)b)->path);
+}
+
+// Lay files out in the content stream and cut it into groups
+static int pp_archive_plan(PP_Archive *arc) {
+    uint64_t stream = 0, group_start = 0;
+
+    for (uint32_t i = 0; i < arc->entry_count; i++) {
+        PP_ArchiveEntry *e = &arc->entries[i];
+        e->offset = stream;
+
+        if (e->size >= PP_ARCHIVE_SOLID_MAX) {
+            if (pp_archive_add_group(arc, group_start, stream) != 0) return -1;
+            for (uint64_t off = 0; off < e->size; off += PP_ARCHIVE_GROUP_SIZE) {
+                uint64_t end = off + PP_ARCHIVE_GROUP_SIZE < e->size ? off + PP_ARCHIVE_GROUP_SIZE : e->size;
+                if (pp_archive_add_group(arc, stream + off, stream + end) != 0) return -1;
+            }
+            stream += e->size;
+            group_start = stream;
+        } else {
+            if (stream + e->size - group_start > PP_ARCHIVE_GROUP_SIZE) {
+                if (pp_archive_add_group(arc, group_start, stream) != 0) return -1;
+                group_start = stream;
+            }
+            stream += e->size;
+        }
+    }
+    return pp_archive_add_group(arc, group_start, stream);
+}
+
+// First entry whose stream range ends after pos
+static uint32_t pp_archive_find_entry(const PP_Archive *arc, uint64_t pos) {
+    uint32_t lo = 0, hi = arc->entry_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (arc->entries[mid].offset + arc->entries[mid].size <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Group holding stream position pos
+static uint32_t pp_archive_find_group(const PP_Archive *arc, uint64_t pos) {
+    uint32_t lo = 0, hi = arc->group_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (arc->groups[mid].stream_offset + arc->groups[mid].raw_size <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static char* pp_archive_join(const char *root, const char *rel) {
+    char *path = (char*)malloc(strlen(root) + strlen(rel) + 2);
+    if (path) sprintf(path, "%s/%s", root, rel);
+    return path;
+}
+
+// Read the group's slice of the content stream from the source files
+static int pp_archive_read_group(PP_Archive *arc, const PP_ArchiveGroup *g, uint8_t *raw) {
+    uint64_t start = g->stream_offset, end = start + g->raw_size;
+
+    for (uint32_t i = pp_archive_find_entry(arc, start);
+         i < arc->entry_count && arc->entries[i].offset < end; i++) {
+        const PP_ArchiveEntry *e = &arc->entries[i];
+        uint64_t from = e->offset > start ? e->offset : start;
+        uint64_t to = e->offset + e->size < end ? e->offset + e->size : end;
+        if (to <= from) continue;
+
+        char *path = pp_archive_join(arc->root, e->path);
+        FILE *f = path ? fopen(path, "rb") : NULL;
+        free(path);
+        if (!f) return -1;
+
+        int ok = fseeko(f, (off_t)(from - e->offset), SEEK_SET) == 0 &&
+                 fread(raw + (from - start), 1, (size_t)(to - from), f) == to - from;
+        fclose(f);
+        if (!ok) return -1; // Missing, unreadable or shrunk since the scan
+    }
+    return 0;
+}
+
+static void pp_archive_compress_group(void *p, uint32_t index, int worker) {
+    PP_Archive *arc = (PP_Archive*)p;
+    (void)worker;
+    PP_ArchiveGroup *g = &arc->groups[index];
+
+    uint32_t out_size = pp_compress_bound(g->raw_size);
+    uint8_t *raw = (uint8_t*)malloc(g->raw_size);
+    uint8_t *out = (uint8_t*)malloc(out_size);
+    int ok = raw && out && !arc->error &&
+             pp_archive_read_group(arc, g, raw) == 0 &&
+             pp_compress_frame(raw, g->raw_size, out, &out_size, &arc->opts, NULL, NULL) == 0;
+
+    // Frames go out in group order, so the archive is deterministic
+    pp_archive_lock(arc);
+#ifdef PP_HAVE_THREADS
+    while (arc->next_write != index) pthread_cond_wait(&arc->turn, &arc->lock);
+#endif
+    if (ok && !arc->error) {
+        g->offset = arc->write_pos;
+        g->stored_size = out_size;
+        if (fwrite(out, 1, out_size, arc->file) != out_size) arc->error = 1;
+        arc->write_pos += out_size;
+    } else {
+        arc->error = 1;
+    }
+    arc->next_write++;
+#ifdef PP_HAVE_THREADS
+    pthread_cond_broadcast(&arc->turn);
+#endif
+    pp_archive_unlock(arc);
+
+    free(raw);
+    free(out);
+}
+
+// Serialize the central index; returns its size, 0 on allocation failure
+static uint32_t pp_archive_write_index(const PP_Archive *arc, uint8_t **out) {
+    uint64_t size = 8 + (uint64_t)arc->group_count * PP_ARCHIVE_GROUP_BYTES;
+    for (uint32_t i = 0; i < arc->entry_count; i++) {
+        size += PP_ARCHIVE_ENTRY_BYTES + strlen(arc->entries[i].path);
+    }
+    if (size > UINT32_MAX) return 0;
+
+    uint8_t *p = (uint8_t*)malloc((size_t)size);
+    if (!p) return 0;
+    *out = p;
+
+    pp_write_le32(p, arc->group_count);
+    pp_write_le32(p + 4, arc->entry_count);
+    p += 8;
+    for (uint32_t i = 0; i < arc->group_count; i++) {
+        const PP_ArchiveGroup *g = &arc->groups[i];
+        pp_write_le64(p, g->offset);
+        pp_write_le32(p + 8, g->stored_size);
+        pp_write_le32(p + 12, g->raw_size);
+        pp_write_le64(p + 16, g->stream_offset);
+        p += PP_ARCHIVE_GROUP_BYTES;
+    }
+    for (uint32_t i = 0; i < arc->entry_count; i++) {
+        const PP_ArchiveEntry *e = &arc->entries[i];
+        uint16_t len = (uint16_t)strlen(e->path);
+        pp_write_le64(p, e->offset);
+        pp_write_le64(p + 8, e->size);
+        pp_write_le64(p + 16, e->mtime);
+        pp_write_le32(p + 24, e->mode);
+        p[28] = (uint8_t)len;
+        p[29] = (uint8_t)(len >> 8);
+        memcpy(p + PP_ARCHIVE_ENTRY_BYTES, e->path, len);
+        p += PP_ARCHIVE_ENTRY_BYTES + len;
+    }
+    return (uint32_t)size;
+}
+
+// Archive a directory (or a single file) into archive_path
+int pp_archive_create(const char *archive_path, const char *source,
+                      const PP_Options *opts, int threads, PP_ArchiveInfo *info) {
+    struct stat src_st, arc_st;
+    if (stat(source, &src_st) != 0) return -1;
+
+    // Keep a trailing-slash-free root; a single file is archived by name
+    size_t len = strlen(source);
+    while (len > 1 && source[len - 1] == '/') len--;
+    char *root = strndup(source, len);
+    if (!root) return -1;
+
+    PP_Archive *arc = NULL;
+    int result = -1;
+    if (S_ISDIR(src_st.st_mode)) {
+        arc = pp_archive_new(root);
+        if (arc) {
+            memset(&arc_st, 0, sizeof(arc_st));
+            if (stat(archive_path, &arc_st) != 0) arc_st.st_ino = 0;
+            result = pp_archive_scan(arc, "", &arc_st);
+        }
+    } else if (S_ISREG(src_st.st_mode)) {
+        char *slash = strrchr(root, '/');
+        if (slash) *slash = '\0';
+        arc = pp_archive_new(slash ? (slash == root ? "/" : root) : ".");
+        if (arc) result = pp_archive_add_entry(arc, slash ? slash + 1 : root, &src_st);
+    }
+    free(root);
+    if (!arc || result != 0) {
+        pp_archive_free(arc);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < arc->entry_count; i++) {
+        if (strlen(arc->entries[i].path) > 0xFFFF) {
+            pp_archive_free(arc);
+            return -1;
+        }
+    }
+    qsort(arc->entries, arc->entry_count, sizeof(PP_ArchiveEntry), pp_archive_entry_cmp);
+    if (pp_archive_plan(arc) != 0) {
+        pp_archive_free(arc);
+        return -1;
+    }
+
+    arc->file = fopen(archive_path, "wb");
+    if (!arc->file) {
+        pp_archive_free(arc);
+        return -1;
+    }
+
+    uint8_t header[PP_ARCHIVE_HEADER_SIZE] = {0};
+    memcpy(header, PP_ARCHIVE_MAGIC, 4);
+    pp_write_le32(header + 4, PP_ARCHIVE_VERSION);
+    fwrite(header, 1, PP_ARCHIVE_HEADER_SIZE, arc->file);
+
+    arc->opts = *opts;
+    arc->write_pos = PP_ARCHIVE_HEADER_SIZE;
+    if (opts->level >= PP_LEVEL_MAX) pp_cm_init_tables();
+    pp_parallel_for(arc->group_count, threads, pp_archive_compress_group, arc);
+
+    uint8_t *index = NULL;
+    uint32_t index_size = arc->error ? 0 : pp_archive_write_index(arc, &index);
+    if (index_size) {
+        uint8_t footer[PP_ARCHIVE_FOOTER_SIZE] = {0};
+        pp_write_le64(footer, arc->write_pos);
+        pp_write_le32(footer + 8, index_size);
+        pp_write_le32(footer + 12, pp_xxh32(index, index_size, 0));
+        memcpy(footer + 20, PP_ARCHIVE_MAGIC, 4);
+
+        result = (fwrite(index, 1, index_size, arc->file) == index_size &&
+                  fwrite(footer, 1, PP_ARCHIVE_FOOTER_SIZE, arc->file) == PP_ARCHIVE_FOOTER_SIZE) ? 0 : -1;
+    } else {
+        result = -1;
+    }
+    free(index);
+
+    if (fclose(arc->file) != 0) result = -1;
+    arc->file = NULL;
+
+    if (result == 0 && info) {
+        info->files = arc->entry_count;
+        info->groups = arc->group_count;
+        info->content_size = arc->group_count ? arc->groups[arc->group_count - 1].stream_offset +
+                                                arc->groups[arc->group_count - 1].raw_size : 0;
+        info->stored_size = arc->write_pos + index_size + PP_ARCHIVE_FOOTER_SIZE;
+    }
+    pp_archive_free(arc);
+    return result;
+}
+
+// Read and validate the index of an open archive
+static int pp_archive_read_index(PP_Archive *arc) {
+    FILE *f = arc->file;
+    uint8_t footer[PP_ARCHIVE_FOOTER_SIZE];
+
+    if (fseeko(f, 0, SEEK_END) != 0) return -1;
+    off_t file_size = ftello(f);
+    if (file_size < PP_ARCHIVE_HEADER_SIZE + PP_ARCHIVE_FOOTER_SIZE) return -1;
+    if (fseeko(f, file_size - PP_ARCHIVE_FOOTER_SIZE, SEEK_SET) != 0 ||
+        fread(footer, 1, PP_ARCHIVE_FOOTER_SIZE, f) != PP_ARCHIVE_FOOTER_SIZE ||
+        memcmp(footer + 20, PP_ARCHIVE_MAGIC, 4) != 0) {
+        return -1;
+    }
+
+    uint64_t index_offset = pp_read_le64(footer);
+    uint32_t index_size = pp_read_le32(footer + 8);
+    if (index_size < 8 || index_offset < PP_ARCHIVE_HEADER_SIZE ||
+        index_offset + index_size != (uint64_t)file_size - PP_ARCHIVE_FOOTER_SIZE) {
+        return -1;
+    }
+
+    uint8_t *index = (uint8_t*)malloc(index_size);
+    if (!index) return -1;
+    if (fseeko(f, (off_t)index_offset, SEEK_SET) != 0 ||
+        fread(index, 1, index_size, f) != index_size) {
+        free(index);
+        return -1;
+    }
+    if (pp_xxh32(index, index_size, 0) != pp_read_le32(footer + 12)) {
+        free(index);
+        return -3; // Index checksum mismatch
+    }
+
+    uint32_t groups = pp_read_le32(index), entries = pp_read_le32(index + 4);
+    const uint8_t *p = index + 8, *end = index + index_size;
+    int result = 0;
+
+    if ((uint64_t)groups * PP_ARCHIVE_GROUP_BYTES > (uint64_t)(end - p)) result = -4;
+    for (uint32_t i = 0; result == 0 && i < groups; i++, p += PP_ARCHIVE_GROUP_BYTES) {
+        uint64_t offset = pp_read_le64(p);
+        uint32_t stored = pp_read_le32(p + 8), raw = pp_read_le32(p + 12);
+        uint64_t stream = pp_read_le64(p + 16);
+        uint64_t prev_end = i ? arc->groups[i - 1].stream_offset + arc->groups[i - 1].raw_size : 0;
+        if (offset < PP_ARCHIVE_HEADER_SIZE || offset + stored > index_offset ||
+            stream != prev_end || raw == 0 || pp_archive_add_group(arc, stream, stream + raw) != 0) {
+            result = -4;
+            break;
+        }
+        arc->groups[i].offset = offset;
+        arc->groups[i].stored_size = stored;
+    }
+
+    uint64_t stream_end = groups ? arc->groups[groups - 1].stream_offset + arc->groups[groups - 1].raw_size : 0;
+    for (uint32_t i = 0; result == 0 && i < entries; i++) {
+        if (end - p < PP_ARCHIVE_ENTRY_BYTES) {
+            result = -4;
+            break;
+        }
+        uint16_t len = (uint16_t)(p[28] | (p[29] << 8));
+        if (end - p - PP_ARCHIVE_ENTRY_BYTES < len) {
+            result = -4;
+            break;
+        }
+
+        char *path = strndup((const char*)p + PP_ARCHIVE_ENTRY_BYTES, len);
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        if (!path || strlen(path) != len || pp_archive_add_entry(arc, path, &st) != 0) {
+            free(path);
+            result = -4;
+            break;
+        }
+        free(path);
+
+        PP_ArchiveEntry *e = &arc->entries[i];
+        e->offset = pp_read_le64(p);
+        e->size = pp_read_le64(p + 8);
+        e->mtime = pp_read_le64(p + 16);
+        e->mode = pp_read_le32(p + 24) & 07777;
+        uint64_t prev_end = i ? arc->entries[i - 1].offset + arc->entries[i - 1].size : 0;
+        if (e->offset != prev_end || e->size > stream_end - e->offset) result = -4;
+        p += PP_ARCHIVE_ENTRY_BYTES + len;
+    }
+
+    free(index);
+    return result;
+}
+
+// Open an archive and load its index
+static int pp_archive_open(const char *archive_path, const char *root, PP_Archive **out) {
+    PP_Archive *arc = pp_archive_new(root);
+    if (!arc) return -1;
+    arc->archive_path = archive_path;
+    arc->file = fopen(archive_path, "rb");
+
+    uint8_t header[PP_ARCHIVE_HEADER_SIZE];
+    if (!arc->file || fread(header, 1, PP_ARCHIVE_HEADER_SIZE, arc->file) != PP_ARCHIVE_HEADER_SIZE ||
+        memcmp(header, PP_ARCHIVE_MAGIC, 4) != 0 || pp_read_le32(header + 4) != PP_ARCHIVE_VERSION) {
+        pp_archive_free(arc);
+        return -1;
+    }
+    int result = pp_archive_read_index(arc);
+    if (result != 0) {
+        pp_archive_free(arc);
+        return result;
+    }
+    *out = arc;
+    return 0;
+}
+
+// Reject absolute paths and any ".." component
+static int pp_archive_safe_path(const char *path) {
+    if (path[0] == '\0' || path[0] == '/') return 0;
+    for (const char *p = path; *p; ) {
+        const char *slash = strchr(p, '/');
+        size_t n = slash ? (size_t)(slash - p) : strlen(p);
+        if (n == 0 || (n == 2 && p[0] == '.' && p[1] == '.')) return 0;
+        p += n + (slash ? 1 : 0);
+    }
+    return 1;
+}
+
+// Create every parent directory of root/rel
+static int pp_archive_make_parents(const char *root, const char *rel) {
+    char *path = pp_archive_join(root, rel);
+    if (!path) return -1;
+
+    for (char *p = path + strlen(root) + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+            free(path);
+            return -1;
+        }
+        *p = '/';
+    }
+    free(path);
+    return 0;
+}
+
+static void pp_archive_extract_group(void *p, uint32_t index, int worker) {
+    PP_Archive *arc = (PP_Archive*)p;
+    (void)worker;
+    const PP_ArchiveGroup *g = &arc->groups[arc->jobs[index]];
+    if (arc->error) return;
+
+    uint8_t *frame = (uint8_t*)malloc(g->stored_size ? g->stored_size : 1);
+    uint8_t *raw = (uint8_t*)malloc(g->raw_size);
+    FILE *f = fopen(arc->archive_path, "rb");
+    uint32_t raw_size = g->raw_size;
+
+    int ok = frame && raw && f &&
+             fseeko(f, (off_t)g->offset, SEEK_SET) == 0 &&
+             fread(frame, 1, g->stored_size, f) == g->stored_size &&
+             pp_get_decompressed_size(frame, g->stored_size) == g->raw_size &&
+             pp_decompress(frame, g->stored_size, raw, &raw_size) == 0;
+    if (f) fclose(f);
+
+    uint64_t start = g->stream_offset, end = start + g->raw_size;
+    for (uint32_t i = pp_archive_find_entry(arc, start);
+         ok && i < arc->entry_count && arc->entries[i].offset < end; i++) {
+        const PP_ArchiveEntry *e = &arc->entries[i];
+        uint64_t from = e->offset > start ? e->offset : start;
+        uint64_t to = e->offset + e->size < end ? e->offset + e->size : end;
+        if (!e->selected || to <= from) continue;
+
+        char *path = pp_archive_join(arc->root, e->path);
+        int fd = path ? open(path, O_WRONLY | O_NOFOLLOW) : -1;
+        free(path);
+        ok = fd >= 0 &&
+             pwrite(fd, raw + (from - start), (size_t)(to - from), (off_t)(from - e->offset)) ==
+                 (ssize_t)(to - from);
+        if (fd >= 0) close(fd);
+    }
+
+    if (!ok) {
+        pp_archive_lock(arc);
+        arc->error = 1;
+        pp_archive_unlock(arc);
+    }
+    free(frame);
+    free(raw);
+}
+
+// Extract all files, or only the given paths (and directories), into dest
+int pp_archive_extract(const char *archive_path, const char *dest,
+                       char **names, int name_count, int threads, PP_ArchiveInfo *info) {
+    PP_Archive *arc = NULL;
+    int result = pp_archive_open(archive_path, dest, &arc);
+    if (result != 0) return result;
+
+    // Select entries and check every path before touching dest, so a
+    // rejected archive leaves nothing behind
+    for (uint32_t i = 0; i < arc->entry_count; i++) {
+        PP_ArchiveEntry *e = &arc->entries[i];
+        e->selected = (name_count == 0);
+        for (int k = 0; k < name_count && !e->selected; k++) {
+            size_t n = strlen(names[k]);
+            while (n > 1 && names[k][n - 1] == '/') n--;
+            e->selected = strncmp(e->path, names[k], n) == 0 &&
+                          (e->path[n] == '\0' || e->path[n] == '/');
+        }
+        if (e->selected && !pp_archive_safe_path(e->path)) {
+            pp_archive_free(arc);
+            return -4; // Absolute path or ".." component
+        }
+    }
+
+    // Create directories and empty files up front so workers only ever
+    // write into existing files; a symlink already at the target is refused
+    uint32_t selected = 0;
+    for (uint32_t i = 0; i < arc->entry_count; i++) {
+        const PP_ArchiveEntry *e = &arc->entries[i];
+        if (!e->selected) continue;
+
+        char *path = pp_archive_join(dest, e->path);
+        int fd = (path && pp_archive_make_parents(dest, e->path) == 0)
+                 ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600) : -1;
+        free(path);
+        if (fd < 0) {
+            pp_archive_free(arc);
+            return -1;
+        }
+        close(fd);
+        selected++;
+    }
+
+    // Decode only the groups that hold selected files
+    arc->jobs = (uint32_t*)malloc((arc->group_count + 1) * sizeof(uint32_t));
+    if (!arc->jobs) {
+        pp_archive_free(arc);
+        return -1;
+    }
+    uint32_t jobs = 0;
+    for (uint32_t i = 0; i < arc->entry_count; i++) {
+        const PP_ArchiveEntry *e = &arc->entries[i];
+        if (!e->selected || e->size == 0) continue;
+        for (uint32_t g = pp_archive_find_group(arc, e->offset);
+             g < arc->group_count && arc->groups[g].stream_offset < e->offset + e->size; g++) {
+            if (jobs == 0 || arc->jobs[jobs - 1] < g) arc->jobs[jobs++] = g;
+        }
+    }
+    pp_parallel_for(jobs, threads, pp_archive_extract_group, arc);
+
+    result = arc->error ? -4 : 0;
+    for (uint32_t i = 0; result == 0 && i < arc->entry_count; i++) {
+        const PP_ArchiveEntry *e = &arc->entries[i];
+        if (!e->selected) continue;
+        char *path = pp_archive_join(dest, e->path);
+        if (path) {
+            struct utimbuf times = { (time_t)e->mtime, (time_t)e->mtime };
+            // Permission bits only: setuid, setgid and sticky come from an
+            // untrusted index
+            chmod(path, (mode_t)(e->mode & 0777));
+            utime(path, &times);
+        }
+        free(path);
+    }
+
+    if (result == 0 && info) {
+        info->files = selected;
+        info->groups = jobs;
+        info->content_size = 0;
+        for (uint32_t i = 0; i < arc->entry_count; i++) {
+            if (arc->entries[i].selected) info->content_size += arc->entries[i].size;
+        }
+        info->stored_size = 0;
+        for (uint32_t i = 0; i < jobs; i++) info->stored_size += arc->groups[arc->jobs[i]].stored_size;
+    }
+    pp_archive_free(arc);
+    return result;
+}
+
+// Verify the index and every group of an archive; res sums over all groups
+int pp_archive_test(const char *archive_path, int quick, int threads, PP_VerifyResult *res) {
+    PP_Archive *arc = NULL;
+    memset(res, 0, sizeof(*res));
+    int result = pp_archive_open(archive_path, ".", &arc);
+    if (result != 0) return result;
+
+    uint64_t map_size = 0;
+    uint8_t *map = pp_map_file(archive_path, &map_size);
+    if (!map) {
+        pp_archive_free(arc);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < arc->group_count; i++) {
+        const PP_ArchiveGroup *g = &arc->groups[i];
+        PP_VerifyResult r;
+        result = (g->offset + g->stored_size <= map_size)
+                 ? pp_verify(map + g->offset, g->stored_size, NULL, quick, threads, &r) : -4;
+        if (result == 0 && r.content_size != g->raw_size) result = -4;
+        if (result != 0) {
+            res->bad_block = res->blocks + r.bad_block;
+            res->bad_offset = g->offset + r.bad_offset;
+            break;
+        }
+        res->blocks += r.blocks;
+        res->decoded += r.decoded;
+        res->content_size += r.content_size;
+    }
+
+    pp_unmap_file(map, map_size);
+    pp_archive_free(arc);
+    return result;
+}
+
+// Totals and (optionally) the file list of an archive, from its index alone.
+// *files is a single allocation: the array, then the paths it points to.
+int pp_archive_info(const char *archive_path, PP_ArchiveInfo *info, PP_ArchiveFile **files) {
+    PP_Archive *arc = NULL;
+    int result = pp_archive_open(archive_path, ".", &arc);
+    if (result != 0) return result;
+
+    memset(info, 0, sizeof(*info));
+    info->files = arc->entry_count;
+    info->groups = arc->group_count;
+    for (uint32_t g = 0; g < arc->group_count; g++) {
+        info->content_size += arc->groups[g].raw_size;
+        info->stored_size += arc->groups[g].stored_size;
+    }
+
+    if (files) {
+        size_t size = (size_t)arc->entry_count * sizeof(PP_ArchiveFile);
+        for (uint32_t i = 0; i < arc->entry_count; i++) size += strlen(arc->entries[i].path) + 1;
+        PP_ArchiveFile *list = (PP_ArchiveFile*)malloc(size ? size : 1);
+        char *paths = (char*)(list + arc->entry_count);
+        for (uint32_t i = 0; list && i < arc->entry_count; i++) {
+            const PP_ArchiveEntry *e = &arc->entries[i];
+            size_t len = strlen(e->path) + 1;
+            memcpy(paths, e->path, len);
+            list[i].path = paths;
+            list[i].size = e->size;
+            list[i].mtime = e->mtime;
+            list[i].mode = e->mode;
+            paths += len;
+        }
+        *files = list;
+        if (!list) result = -1;
+    }
+
+    pp_archive_free(arc);
+    return result;
+}
+
+// Integrity test of a .pp frame or a .ppa archive, told apart by magic
+int pp_verify_file(const char *path, const PP_Dict *dict, int quick, int threads,
+                   PP_VerifyResult *res) {
+    uint64_t size = 0;
+    uint8_t *map = pp_map_file(path, &size);
+    memset(res, 0, sizeof(*res));
+    if (!map) return -1;
+
+    if (size >= 4 && memcmp(map, PP_ARCHIVE_MAGIC, 4) == 0) {
+        pp_unmap_file(map, size);
+        return pp_archive_test(path, quick, threads, res);
+    }
+    int result = pp_verify(map, size, dict, quick, threads, res);
+    pp_unmap_file(map, size);
+    return result;
+}
+
+/* ---------- Upgrade ---------- */
+
+// Rewrites v1-v4 files as v5 frames without holding them in memory: the
+// legacy decoder fills a buffer with PP_LEGACY_WINDOW bytes of history and
+// a batch of blocks, the batch compresses in parallel and goes out in
+// order, and the history slides down for the next batch. Files convert in
+// parallel; with fewer files than threads, each file's batches take the
+// spare threads.
+
+#define PP_UPGRADE_SUFFIX ".upgrade"
+
+typedef struct {
+    PP_Context **ctx;                     // One per batch worker, created on first use
+    const PP_Options *opts;
+    const uint8_t *raw;                   // First byte of the batch
+    uint32_t raw_size;
+    uint8_t *slots;                       // Per block: header, body and stored checksum
+    uint32_t sizes[PP_MAX_THREADS];
+    int error;
+} PP_UpgradeBatch;
+
+typedef struct {
+    char **paths;
+    PP_UpgradeResult *results;
+    const PP_Options *opts;
+    int inner;                            // Batch workers per file
+    PP_Context *ctx[PP_MAX_THREADS];
+} PP_UpgradeJob;
+
+#define PP_UPGRADE_SLOT (PP_BLOCK_HEADER_SIZE + PP_BLOCK_SIZE + 4)
+
+static void pp_upgrade_block(void *p, uint32_t index, int worker) {
+    PP_UpgradeBatch *b = (PP_UpgradeBatch*)p;
+    if (!b->ctx[worker]) b->ctx[worker] = pp_init_context(NULL, PP_BLOCK_SIZE);
+    PP_Context *ctx = b->ctx[worker];
+    if (!ctx) {
+        b->error = 1;
+        return;
+    }
+
+    uint32_t pos = index * PP_BLOCK_SIZE;
+    uint32_t n = (b->raw_size - pos < PP_BLOCK_SIZE) ? b->raw_size - pos : PP_BLOCK_SIZE;
+    uint32_t m = pp_compress_block(ctx, b->raw + pos, n, b->opts);
+    uint8_t *slot = b->slots + (size_t)index * PP_UPGRADE_SLOT;
+    memcpy(slot, ctx->output, m);
+    pp_write_le32(slot + m, pp_xxh32(slot, m, 0));
+    b->sizes[index] = m + 4;
+}
+
+// Stream one legacy file into a v5 frame written to out
+static int pp_upgrade_stream(PP_LegacyDecoder *d, FILE *out, const PP_Options *options,
+                             int threads, PP_Context **ctx, uint64_t *written) {
+    uint32_t size = d->content_size;
+    uint32_t block_count = (size - 1) / PP_BLOCK_SIZE + 1;
+    uint32_t batch_blocks = (uint32_t)threads < block_count ? (uint32_t)threads : block_count;
+    uint32_t batch_cap = batch_blocks * PP_BLOCK_SIZE;
+    uint32_t buf_size = (size < PP_LEGACY_WINDOW + batch_cap ? size : PP_LEGACY_WINDOW + batch_cap) +
+                        PP_LEGACY_SLACK;
+    uint32_t seek_size = block_count * PP_SEEK_ENTRY_SIZE + PP_SEEK_FOOTER_SIZE;
+
+    PP_UpgradeBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.ctx = ctx;
+    uint8_t *buf = (uint8_t*)malloc(buf_size);
+    uint8_t *seek = (uint8_t*)malloc(seek_size);
+    batch.slots = (uint8_t*)malloc((size_t)batch_blocks * PP_UPGRADE_SLOT);
+    if (!buf || !seek || !batch.slots) {
+        free(buf);
+        free(seek);
+        free(batch.slots);
+        return -1;
+    }
+
+    PP_Options opts = *options;
+    uint32_t pos = 0, start = 0, blocks = 0;
+    uint64_t total = 0;
+    int result = 0;
+
+    for (;;) {
+        result = pp_legacy_decode(d, buf, pos, start + batch_cap, buf + buf_size, &pos);
+        if (result != 0) break;
+        int last = d->done == size;
+
+        // The pipeline is chosen from the first block, as in pp_compress_stream
+        if (total == 0) {
+            uint32_t first = pos < PP_BLOCK_SIZE ? pos : PP_BLOCK_SIZE;
+            uint8_t file_type = pp_detect_filetype(buf, first);
+            if (opts.strategy == PP_STRATEGY_AUTO || opts.strategy >= PP_STRATEGY_COUNT) {
+                opts.strategy = pp_filetype_strategy[file_type];
+            }
+            opts.filters |= pp_strategy_table[opts.strategy].filters;
+
+            uint8_t header[PP_FRAME_HEADER_SIZE];
+            pp_write_frame_header(header, &opts, opts.level, file_type, size, NULL);
+            if (fwrite(header, 1, PP_FRAME_HEADER_SIZE, out) != PP_FRAME_HEADER_SIZE) {
+                result = -1;
+                break;
+            }
+            total = PP_FRAME_HEADER_SIZE;
+        }
+
+        batch.opts = &opts;
+        batch.raw = buf + start;
+        batch.raw_size = pos - start < batch_cap ? pos - start : batch_cap;
+        uint32_t count = (batch.raw_size + PP_BLOCK_SIZE - 1) / PP_BLOCK_SIZE;
+        pp_parallel_for(count, threads, pp_upgrade_block, &batch);
+        if (batch.error) {
+            result = -1;
+            break;
+        }
+
+        for (uint32_t i = 0; i < count && result == 0; i++, blocks++) {
+            uint32_t raw = (batch.raw_size - i * PP_BLOCK_SIZE < PP_BLOCK_SIZE)
+                         ? batch.raw_size - i * PP_BLOCK_SIZE : PP_BLOCK_SIZE;
+            if (fwrite(batch.slots + (size_t)i * PP_UPGRADE_SLOT, 1, batch.sizes[i], out) !=
+                batch.sizes[i]) {
+                result = -1;
+            }
+            pp_write_le32(seek + blocks * PP_SEEK_ENTRY_SIZE, batch.sizes[i]);
+            pp_write_le32(seek + blocks * PP_SEEK_ENTRY_SIZE + 4, raw);
+            total += batch.sizes[i];
+        }
+        start += batch.raw_size;
+        if (result != 0 || (last && start == pos)) break;
+
+        // Keep the match window; the bytes past the batch fall inside it
+        uint32_t keep = pos < PP_LEGACY_WINDOW ? pos : PP_LEGACY_WINDOW;
+        memmove(buf, buf + pos - keep, keep);
+        start -= pos - keep;
+        pos = keep;
+    }
+
+    // End-of-frame marker carrying the seek index
+    if (result == 0) {
+        uint8_t end[PP_BLOCK_HEADER_SIZE];
+        uint8_t *footer = seek + block_count * PP_SEEK_ENTRY_SIZE;
+        pp_write_le32(footer, block_count);
+        pp_write_le32(footer + 4, pp_xxh32(seek, block_count * PP_SEEK_ENTRY_SIZE, 0));
+        pp_write_le32(footer + 8, PP_SEEK_MAGIC);
+        pp_write_block_header(end, PP_BLOCK_END, 0, 0, seek_size, 0);
+        if (fwrite(end, 1, PP_BLOCK_HEADER_SIZE, out) != PP_BLOCK_HEADER_SIZE ||
+            fwrite(seek, 1, seek_size, out) != seek_size) {
+            result = -1;
+        }
+        total += PP_BLOCK_HEADER_SIZE + seek_size;
+    }
+
+    free(buf);
+    free(seek);
+    free(batch.slots);
+    *written = total;
+    return result;
+}
+
+// Convert one file in place, through a temporary file next to it
+static int pp_upgrade_file(const char *path, const PP_Options *opts, int threads,
+                           PP_Context **ctx, PP_UpgradeResult *res) {
+    uint64_t map_size = 0;
+    uint8_t *map = pp_map_file(path, &map_size);
+    if (!map) return -1;
+    res->old_size = map_size;
+
+    // script.js puts a flag byte first: 0x00 plain, 0x01 a CryptoJS
+    // passphrase envelope (base64 text starting with "Salted__" encoded),
+    // 0x02 its AES-GCM envelope
+    const uint8_t *input = map;
+    uint64_t input_size = map_size;
+    if ((map_size > 11 && map[0] == 0x01 && memcmp(map + 1, "U2FsdGVkX1", 10) == 0) ||
+        (map_size >= 48 && map[0] == 0x02 && map[1] == 1)) {
+        pp_unmap_file(map, map_size);
+        return PP_ERROR_ENCRYPTED;
+    }
+    if (map_size > 3 && map[0] == 0x00 && (map[1] | (map[2] << 8)) == PP_MAGIC) {
+        input++;
+        input_size--;
+    }
+    if (input_size < 16 || (input[0] | (input[1] << 8)) != PP_MAGIC || input_size > UINT32_MAX) {
+        pp_unmap_file(map, map_size);
+        return -1;
+    }
+    res->from_version = input[2];
+    if (input[2] == PP_FRAME_VERSION) {
+        // Already current: nothing to do
+        pp_unmap_file(map, map_size);
+        res->new_size = map_size;
+        return 0;
+    }
+
+    PP_LegacyDecoder d;
+    int result = pp_legacy_open(&d, input, (uint32_t)input_size);
+    if (result == 0 && d.content_size == 0) result = -4;
+    res->content_size = d.content_size;
+
+    size_t len = strlen(path);
+    char *tmp = (char*)malloc(len + sizeof(PP_UPGRADE_SUFFIX));
+    FILE *out = NULL;
+    struct stat st;
+    if (result == 0) {
+        if (!tmp || stat(path, &st) != 0) {
+            result = -1;
+        } else {
+            memcpy(tmp, path, len);
+            memcpy(tmp + len, PP_UPGRADE_SUFFIX, sizeof(PP_UPGRADE_SUFFIX));
+            out = fopen(tmp, "wb");
+            if (!out) result = -1;
+        }
+    }
+    if (result == 0) {
+        result = pp_upgrade_stream(&d, out, opts, threads, ctx, &res->new_size);
+    }
+    pp_legacy_close(&d);
+    pp_unmap_file(map, map_size);
+
+    if (out) {
+        if (fclose(out) != 0 && result == 0) result = -1;
+
+        // Same permissions and times as the file it replaces
+        if (result == 0) {
+            struct utimbuf times = { st.st_atime, st.st_mtime };
+            chmod(tmp, st.st_mode & 07777);
+            utime(tmp, &times);
+            if (rename(tmp, path) != 0) result = -1;
+        }
+        if (result != 0) unlink(tmp);
+    }
+    free(tmp);
+    return result;
+}
+
+static void pp_upgrade_job(void *p, uint32_t index, int worker) {
+    PP_UpgradeJob *job = (PP_UpgradeJob*)p;
+    PP_UpgradeResult *res = &job->results[index];
+    memset(res, 0, sizeof(*res));
+    res->result = pp_upgrade_file(job->paths[index], job->opts, job->inner,
+                                  job->ctx + worker * job->inner, res);
+}
+
+// Rewrite v1-v4 .pp files as v5 frames; see piedpiper.h
+int pp_upgrade(char **paths, int count, const PP_Options *options, int threads,
+               PP_UpgradeResult *results) {
+    if (!paths || count < 1 || !options || !results) return -1;
+    PP_UpgradeJob *job = (PP_UpgradeJob*)calloc(1, sizeof(PP_UpgradeJob));
+    if (!job) return -1;
+
+    PP_Options opts = *options;
+    opts.level = pp_resolve_level(opts.level);
+    if (opts.level >= PP_LEVEL_MAX) pp_cm_init_tables();
+    opts.window_log = 0;   // Batches compress in parallel
+
+    if (threads < 1) threads = 1;
+    if (threads > PP_MAX_THREADS) threads = PP_MAX_THREADS;
+    int files = threads < count ? threads : count;
+    job->paths = paths;
+    job->results = results;
+    job->opts = &opts;
+    job->inner = threads / files;
+    pp_parallel_for((uint32_t)count, files, pp_upgrade_job, job);
+
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) result = results[i].result;
+    for (int i = 0; i < PP_MAX_THREADS; i++) pp_free_context(job->ctx[i]);
+    free(job);
+    return result;
+}
+
+/* ---------- Frame info ---------- */
+
+// Header-level inspection: everything here reads the frame header and the
+// seek index at the end of the file, never block payloads. Frames written
+// before the index existed fall back to hopping over block headers.
+
+static int pp_read_at(FILE *f, uint64_t offset, void *buf, size_t n) {
+    return fseeko(f, (off_t)offset, SEEK_SET) == 0 && fread(buf, 1, n, f) == n;
+}
+
+// Load the seek index of a frame of the given size; 0 if present and consistent
+static int pp_read_seek_index(FILE *f, uint64_t size, PP_FrameInfo *info,
+                              PP_SeekEntry **entries) {
+    uint8_t footer[PP_SEEK_FOOTER_SIZE];
+    if (size < PP_FRAME_HEADER_SIZE + PP_BLOCK_HEADER_SIZE + PP_SEEK_FOOTER_SIZE ||
+        !pp_read_at(f, size - PP_SEEK_FOOTER_SIZE, footer, PP_SEEK_FOOTER_SIZE) ||
+        pp_read_le32(footer + 8) != PP_SEEK_MAGIC) {
+        return -1;
+    }
+
+    uint32_t count = pp_read_le32(footer);
+    uint64_t table = (uint64_t)count * PP_SEEK_ENTRY_SIZE;
+    uint64_t body = PP_BLOCK_HEADER_SIZE + table + PP_SEEK_FOOTER_SIZE;
+    if (body > size - PP_FRAME_HEADER_SIZE) return -1;
+
+    uint8_t *raw = (uint8_t*)malloc(PP_BLOCK_HEADER_SIZE + table);
+    PP_SeekEntry *list = (PP_SeekEntry*)malloc((count ? count : 1) * sizeof(PP_SeekEntry));
+    int ok = raw && list && pp_read_at(f, size - body, raw, PP_BLOCK_HEADER_SIZE + table) &&
+             raw[0] == PP_BLOCK_END &&
+             pp_read_le32(raw + 8) == table + PP_SEEK_FOOTER_SIZE &&
+             pp_xxh32(raw + PP_BLOCK_HEADER_SIZE, (size_t)table, 0) == pp_read_le32(footer + 4);
+
+    // The spans must tile the frame exactly and the sizes add up to the content
+    uint64_t spans = 0, content = 0;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        list[i].span = pp_read_le32(raw + PP_BLOCK_HEADER_SIZE + i * PP_SEEK_ENTRY_SIZE);
+        list[i].raw_size = pp_read_le32(raw + PP_BLOCK_HEADER_SIZE + i * PP_SEEK_ENTRY_SIZE + 4);
+        spans += list[i].span;
+        content += list[i].raw_size;
+        ok = list[i].span >= PP_BLOCK_HEADER_SIZE && list[i].raw_size <= (1u << info->block_log);
+    }
+    ok = ok && spans == size - PP_FRAME_HEADER_SIZE - body && content == info->content_size;
+
+    free(raw);
+    if (!ok) {
+        free(list);
+        return -1;
+    }
+    info->blocks = count;
+    *entries = list;
+    return 0;
+}
+
+// Hop over block headers with one small read per block
+static int pp_walk_block_headers(FILE *f, uint64_t size, PP_FrameInfo *info,
+                                 PP_SeekEntry **entries) {
+    uint32_t trailer = (info->flags & PP_FRAME_STORED_CHECKSUM) ? 4 : 0;
+    uint64_t pos = PP_FRAME_HEADER_SIZE, out = 0;
+    PP_SeekEntry *list = NULL;
+    uint32_t n = 0, cap = 0;
+    uint8_t bh[PP_BLOCK_HEADER_SIZE];
+
+    while (size - pos >= PP_BLOCK_HEADER_SIZE && pp_read_at(f, pos, bh, PP_BLOCK_HEADER_SIZE)) {
+        uint32_t raw_size = pp_read_le32(bh + 4);
+        uint64_t span = PP_BLOCK_HEADER_SIZE + (uint64_t)pp_read_le32(bh + 8) + trailer;
+
+        if (bh[0] == PP_BLOCK_END) {
+            if (out != info->content_size) break;
+            info->blocks = n;
+            *entries = list;
+            return 0;
+        }
+        if (span > size - pos || raw_size > (1u << info->block_log) ||
+            raw_size > info->content_size - out) {
+            break;
+        }
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            PP_SeekEntry *grown = (PP_SeekEntry*)realloc(list, cap * sizeof(PP_SeekEntry));
+            if (!grown) break;
+            list = grown;
+        }
+        list[n].span = (uint32_t)span;
+        list[n].raw_size = raw_size;
+        n++;
+        pos += span;
+        out += raw_size;
+    }
+
+    free(list);
+    return -4; // Truncated or inconsistent block headers
+}
+
+// Describe a .pp file from its header and seek index; entries (optional)
+// receives the per-block layout, to be freed by the caller
+int pp_frame_info(const char *path, PP_FrameInfo *info, PP_SeekEntry **entries) {
+    memset(info, 0, sizeof(*info));
+    if (entries) *entries = NULL;
+
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+
+    uint8_t header[PP_FRAME_HEADER_SIZE];
+    uint64_t size = 0;
+    int result = -1;
+    if (fseeko(f, 0, SEEK_END) == 0) size = (uint64_t)ftello(f);
+    info->compressed_size = size;
+
+    if (size >= 16 && pp_read_at(f, 0, header, 16) &&
+        (header[0] | (header[1] << 8)) == PP_MAGIC) {
+        info->version = header[2];
+        if (header[2] >= 1 && header[2] <= 4) {
+            // Legacy v1 and browser v2-v4: a single block described by the header
+            info->content_size = pp_read_le32(header + 4);
+            info->level = header[12];
+            info->file_type = header[13];
+            info->blocks = 1;
+            result = 0;
+        } else if (header[2] == PP_FRAME_VERSION && size >= PP_FRAME_HEADER_SIZE &&
+                   pp_read_at(f, 0, header, PP_FRAME_HEADER_SIZE) && header[7] <= 30) {
+            info->flags = header[4];
+            info->level = (int8_t)header[5];
+            info->file_type = header[6];
+            info->block_log = header[7];
+            info->content_size = pp_read_le64(header + 8);
+            info->filters = header[16];
+            info->strategy = header[17];
+            info->dict_id = pp_read_le32(header + 20);
+            if (info->flags & PP_FRAME_LINKED) info->window_log = header[3];
+
+            PP_SeekEntry *list = NULL;
+            if ((info->flags & PP_FRAME_SEEK_INDEX) &&
+                pp_read_seek_index(f, size, info, &list) == 0) {
+                info->has_index = 1;
+                result = 0;
+            } else {
+                result = pp_walk_block_headers(f, size, info, &list);
+            }
+            if (entries && result == 0) {
+                *entries = list;
+            } else {
+                free(list);
+            }
+        }
+    }
+
+    fclose(f);
+    return result;
+}
+
+/* ---------- Compression service ---------- */
+
+// serve keeps one warm compression context and decoder scratch per worker
+// plus every loaded dictionary, so callers pay neither process startup nor
+// table allocation per request. Messages on the Unix socket are
+// length-prefixed:
+//
+//   Request   u32 body length, u8 op (1 compress, 2 decompress), i8 level
+//             (0 = server default), u16 reserved, u32 dictionary id
+//             (compress only, 0 = none), payload
+//   Response  u32 body length, i32 status (0 or an error code), payload
+//
+// Clients may pipeline requests. Everything complete after one poll round,
+// across all clients, is one batch spread over the workers; responses go
+// back in request order per connection.
+
+#define PP_SERVE_REQUEST_HEADER 8
+#define PP_SERVE_MAX_MESSAGE (64u << 20)
+#define PP_SERVE_MAX_CLIENTS 256
+#define PP_SERVE_READ_SIZE 65536
+
+typedef struct {
+    int fd;
+    int closing;              // Peer is gone; drop once replies are out
+    uint8_t *in;
+    uint32_t in_len;
+    uint32_t in_cap;
+    uint8_t *out;
+    uint32_t out_len;
+    uint32_t out_pos;
+    uint32_t out_cap;
+} PP_ServeClient;
+
+typedef struct {
+    PP_ServeClient *client;
+    uint8_t *body;            // Points into the client's input buffer
+    uint32_t size;
+    uint8_t *reply;           // Length prefix, status, payload
+    uint32_t reply_size;
+} PP_ServeRequest;
+
+typedef struct {
+    PP_Options opts;
+    PP_Dict **dicts;
+    int dict_count;
+    int threads;
+    PP_Context *ctx[PP_MAX_THREADS];
+    PP_Decoder scratch[PP_MAX_THREADS];
+    PP_ServeRequest *batch;
+    uint32_t batch_count;
+    uint32_t batch_cap;
+} PP_Server;
+
+static volatile sig_atomic_t pp_serve_stop = 0;
+
+static void pp_serve_signal(int sig) {
+    (void)sig;
+    pp_serve_stop = 1;
+}
+
+static const PP_Dict* pp_serve_find_dict(const PP_Server *srv, uint32_t id) {
+    for (int i = 0; i < srv->dict_count; i++) {
+        if (srv->dicts[i]->id == id) return srv->dicts[i];
+    }
+    return NULL;
+}
+
+static int pp_serve_process(PP_Server *srv, int worker, uint8_t *body, uint32_t size,
+                            uint8_t **reply, uint32_t *reply_size) {
+    if (size < PP_SERVE_REQUEST_HEADER) return -1;
+    uint8_t op = body[0];
+    int8_t level = (int8_t)body[1];
+    uint32_t dict_id = pp_read_le32(body + 4);
+    uint8_t *payload = body + PP_SERVE_REQUEST_HEADER;
+    uint32_t payload_size = size - PP_SERVE_REQUEST_HEADER;
+    uint32_t out_size;
+
+    if (op == PP_SERVE_OP_COMPRESS) {
+        const PP_Dict *dict = dict_id ? pp_serve_find_dict(srv, dict_id) : NULL;
+        if (dict_id && !dict) return -5; // Dictionary not loaded
+        if (!srv->ctx[worker]) srv->ctx[worker] = pp_init_context(NULL, PP_BLOCK_SIZE);
+        if (!srv->ctx[worker]) return -1;
+
+        PP_Options opts = srv->opts;
+        if (level) opts.level = level;
+        out_size = pp_compress_bound(payload_size);
+        *reply = (uint8_t*)malloc(8 + (size_t)out_size);
+        if (!*reply) return -1;
+        srv->ctx[worker]->dict = dict;
+        int r = pp_compress_frame_with(srv->ctx[worker], payload, payload_size,
+                                       *reply + 8, &out_size, &opts, NULL);
+        if (r != 0) return r;
+    } else if (op == PP_SERVE_OP_DECOMPRESS) {
+        uint64_t content = pp_get_decompressed_size(payload, payload_size);
+        if (content == 0 || content > PP_SERVE_MAX_MESSAGE) return content ? -2 : -1;
+        out_size = (uint32_t)content;
+        *reply = (uint8_t*)malloc(8 + (size_t)out_size);
+        if (!*reply) return -1;
+
+        int r;
+        if (payload[2] == PP_FRAME_VERSION) {
+            uint32_t id = payload_size >= PP_FRAME_HEADER_SIZE ? pp_read_le32(payload + 20) : 0;
+            pp_scratch_set_dict(&srv->scratch[worker], id ? pp_serve_find_dict(srv, id) : NULL);
+            r = pp_decompress_frame(payload, payload_size, *reply + 8, &out_size,
+                                    &srv->scratch[worker]);
+        } else {
+            r = pp_decompress(payload, payload_size, *reply + 8, &out_size);
+        }
+        if (r != 0) return r;
+    } else {
+        return -1;
+    }
+
+    *reply_size = 8 + out_size;
+    return 0;
+}
+
+static void pp_serve_job(void *p, uint32_t index, int worker) {
+    PP_Server *srv = (PP_Server*)p;
+    PP_ServeRequest *req = &srv->batch[index];
+    uint8_t *reply = NULL;
+    uint32_t reply_size = 0;
+
+    int status = pp_serve_process(srv, worker, req->body, req->size, &reply, &reply_size);
+    if (status != 0) {
+        uint8_t *error = (uint8_t*)realloc(reply, 8);
+        reply = error ? error : reply;
+        reply_size = reply ? 8 : 0;
+    }
+    if (reply) {
+        pp_write_le32(reply, reply_size - 4);
+        pp_write_le32(reply + 4, (uint32_t)status);
+    }
+    req->reply = reply;
+    req->reply_size = reply_size;
+}
+
+static int pp_serve_append(PP_ServeClient *c, const uint8_t *data, uint32_t size) {
+    if (c->out_pos > 0 && c->out_pos == c->out_len) c->out_pos = c->out_len = 0;
+    if (c->out_len + size > c->out_cap) {
+        uint32_t cap = c->out_cap ? c->out_cap : PP_SERVE_READ_SIZE;
+        while (cap < c->out_len + size) cap *= 2;
+        uint8_t *grown = (uint8_t*)realloc(c->out, cap);
+        if (!grown) return -1;
+        c->out = grown;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, data, size);
+    c->out_len += size;
+    return 0;
+}
+
+// Read what is available; returns 0, or -1 once the connection is unusable
+static int pp_serve_read(PP_ServeClient *c) {
+    if (c->in_cap - c->in_len < PP_SERVE_READ_SIZE) {
+        const uint32_t limit = PP_SERVE_MAX_MESSAGE + 2 * PP_SERVE_READ_SIZE;
+        uint32_t cap = c->in_cap ? c->in_cap * 2 : 2 * PP_SERVE_READ_SIZE;
+        if (cap > limit) cap = limit;
+        if (cap - c->in_len < PP_SERVE_READ_SIZE) return -1;
+        uint8_t *grown = (uint8_t*)realloc(c->in, cap);
+        if (!grown) return -1;
+        c->in = grown;
+        c->in_cap = cap;
+    }
+    ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (n == 0) return -1;
+    c->in_len += (uint32_t)n;
+    return 0;
+}
+
+// Queue every complete request of a client; returns -1 on a malformed length
+static int pp_serve_collect(PP_Server *srv, PP_ServeClient *c, uint32_t *consumed) {
+    uint32_t pos = 0;
+    while (c->in_len - pos >= 4) {
+        uint32_t size = pp_read_le32(c->in + pos);
+        if (size < PP_SERVE_REQUEST_HEADER || size > PP_SERVE_MAX_MESSAGE) return -1;
+        if (c->in_len - pos - 4 < size) break;
+
+        if (srv->batch_count == srv->batch_cap) {
+            uint32_t cap = srv->batch_cap ? srv->batch_cap * 2 : 64;
+            PP_ServeRequest *grown = (PP_ServeRequest*)realloc(srv->batch, cap * sizeof(PP_ServeRequest));
+            if (!grown) return -1;
+            srv->batch = grown;
+            srv->batch_cap = cap;
+        }
+        PP_ServeRequest *req = &srv->batch[srv->batch_count++];
+        req->client = c;
+        req->body = c->in + pos + 4;
+        req->size = size;
+        pos += 4 + size;
+    }
+    *consumed = pos;
+    return 0;
+}
+
+static void pp_serve_drop(PP_ServeClient *c) {
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+// Serve requests on a Unix socket until SIGINT or SIGTERM
+int pp_serve(const char *socket_path, const PP_Options *opts, PP_Dict **dicts,
+             int dict_count, int threads) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 64) != 0) {
+        if (listen_fd >= 0) close(listen_fd);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = pp_serve_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    PP_Server *srv = (PP_Server*)calloc(1, sizeof(PP_Server));
+    PP_ServeClient *clients = (PP_ServeClient*)calloc(PP_SERVE_MAX_CLIENTS, sizeof(PP_ServeClient));
+    struct pollfd *fds = (struct pollfd*)calloc(PP_SERVE_MAX_CLIENTS + 1, sizeof(struct pollfd));
+    int result = (srv && clients && fds) ? 0 : -1;
+    if (srv) {
+        srv->opts = *opts;
+        srv->dicts = dicts;
+        srv->dict_count = dict_count;
+        srv->threads = threads < 1 ? 1 : threads > PP_MAX_THREADS ? PP_MAX_THREADS : threads;
+    }
+    for (int i = 0; clients && i < PP_SERVE_MAX_CLIENTS; i++) clients[i].fd = -1;
+
+    while (result == 0 && !pp_serve_stop) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < PP_SERVE_MAX_CLIENTS; i++) {
+            PP_ServeClient *c = &clients[i];
+            fds[i + 1].fd = c->fd;
+            fds[i + 1].events = 0;
+            // Stop reading from clients that do not collect their replies
+            if (c->fd >= 0 && !c->closing && c->out_len - c->out_pos < PP_SERVE_MAX_MESSAGE) {
+                fds[i + 1].events |= POLLIN;
+            }
+            if (c->fd >= 0 && c->out_len > c->out_pos) fds[i + 1].events |= POLLOUT;
+        }
+        if (poll(fds, PP_SERVE_MAX_CLIENTS + 1, -1) < 0) {
+            if (errno != EINTR) result = -1;
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            int slot = -1;
+            for (int i = 0; fd >= 0 && i < PP_SERVE_MAX_CLIENTS && slot < 0; i++) {
+                if (clients[i].fd < 0) slot = i;
+            }
+            if (slot >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                clients[slot].fd = fd;
+                fds[slot + 1].revents = 0;
+            } else if (fd >= 0) {
+                close(fd); // Full house
+            }
+        }
+
+        // Read, then batch every complete request
+        uint32_t consumed[PP_SERVE_MAX_CLIENTS] = {0};
+        srv->batch_count = 0;
+        for (int i = 0; i < PP_SERVE_MAX_CLIENTS; i++) {
+            PP_ServeClient *c = &clients[i];
+            if (c->fd < 0) continue;
+            if ((fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) && !c->closing &&
+                pp_serve_read(c) != 0) {
+                c->closing = 1;
+            }
+            if (pp_serve_collect(srv, c, &consumed[i]) != 0) c->closing = 1;
+        }
+
+        if (srv->batch_count > 0) {
+            pp_parallel_for(srv->batch_count, srv->threads, pp_serve_job, srv);
+            for (uint32_t k = 0; k < srv->batch_count; k++) {
+                PP_ServeRequest *req = &srv->batch[k];
+                if (!req->reply || pp_serve_append(req->client, req->reply, req->reply_size) != 0) {
+                    req->client->closing = 1;
+                }
+                free(req->reply);
+            }
+        }
+
+        // Drop consumed requests and flush replies
+        for (int i = 0; i < PP_SERVE_MAX_CLIENTS; i++) {
+            PP_ServeClient *c = &clients[i];
+            if (c->fd < 0) continue;
+            if (consumed[i]) {
+                memmove(c->in, c->in + consumed[i], c->in_len - consumed[i]);
+                c->in_len -= consumed[i];
+            }
+            while (c->out_len > c->out_pos) {
+                ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    if (n < 0 && errno != EAGAIN && errno != EINTR) c->out_pos = c->out_len;
+                    break;
+                }
+                c->out_pos += (uint32_t)n;
+            }
+            if (c->closing && c->out_len == c->out_pos) pp_serve_drop(c);
+        }
+    }
+
+    for (int i = 0; clients && i < PP_SERVE_MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) pp_serve_drop(&clients[i]);
+    }
+    if (srv) {
+        for (int i = 0; i < PP_MAX_THREADS; i++) {
+            pp_free_context(srv->ctx[i]);
+            pp_scratch_free(&srv->scratch[i]);
+        }
+        free(srv->batch);
+    }
+    free(srv);
+    free(clients);
+    free(fds);
+    close(listen_fd);
+    unlink(socket_path);
+    return result;
+}
+
+// Connect to a serve socket; returns the descriptor or -1
+int pp_serve_connect(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static int pp_serve_io(int fd, uint8_t *buf, size_t size, int writing) {
+    while (size > 0) {
+        ssize_t n = writing ? send(fd, buf, size, MSG_NOSIGNAL) : read(fd, buf, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+// One round trip: *reply (malloc'd, caller frees) receives the payload.
+// Returns the server's status, or -1 if the connection failed.
+int pp_serve_call(int fd, uint8_t op, int8_t level, uint32_t dict_id,
+                  const uint8_t *data, uint32_t size, uint8_t **reply, uint32_t *reply_size) {
+    uint8_t header[4 + PP_SERVE_REQUEST_HEADER] = {0};
+    *reply = NULL;
+    *reply_size = 0;
+    if (size > PP_SERVE_MAX_MESSAGE - PP_SERVE_REQUEST_HEADER) return -1;
+    pp_write_le32(header, PP_SERVE_REQUEST_HEADER + size);
+    header[4] = op;
+    header[5] = (uint8_t)level;
+    pp_write_le32(header + 8, dict_id);
+    if (pp_serve_io(fd, header, sizeof(header), 1) != 0 ||
+        pp_serve_io(fd, (uint8_t*)data, size, 1) != 0 ||
+        pp_serve_io(fd, header, 8, 0) != 0) {
+        return -1;
+    }
+
+    uint32_t body = pp_read_le32(header);
+    int status = (int)pp_read_le32(header + 4);
+    if (body < 4 || body - 4 > PP_SERVE_MAX_MESSAGE) return -1;
+    *reply = (uint8_t*)malloc(body - 4 ? body - 4 : 1);
+    if (!*reply || pp_serve_io(fd, *reply, body - 4, 0) != 0) {
+        free(*reply);
+        *reply = NULL;
+        return -1;
+    }
+    *reply_size = body - 4;
+    return status;
+}
@@ -0,0 +1,719 @@
+/*
+ * Pied Piper command-line tool
+ *
+ * Thin front end over libpiedpiper: compress and decompress files, build
+ * and extract .ppa archives, test integrity, inspect headers, and run or
+ * call the local compression service. Everything goes through piedpiper.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "piedpiper.h"
+
+// Report printed by the compress command
+static void pp_print_stats(const PP_Stats *st) {
+    printf("Pied Piper Compression Stats:\n");
+    printf("  Input size: %llu bytes\n", (unsigned long long)st->input_size);
+    printf("  Output size: %llu bytes\n", (unsigned long long)st->output_size);
+    printf("  Compression ratio: %.2f%%\n",
+           100.0 * st->output_size / st->input_size);
+    printf("  Strategy: %s (file type %u)\n", pp_strategy_name(st->strategy), st->file_type);
+    printf("  Matches found: %u\n", st->matches_found);
+    printf("  Blocks: %u (store %u, fast %u, strong %u, rle %u)\n", st->blocks,
+           st->routes[0], st->routes[1], st->routes[2], st->rle_blocks);
+    if (st->filters & PP_FILTER_TEXT) {
+        printf("  Text-filtered blocks: %u\n", st->filtered_blocks);
+    }
+    if (st->level >= PP_LEVEL_MAX) {
+        printf("  Context-mixing blocks: %u\n", st->cm_blocks);
+    }
+}
+
+// Read a whole file into a new buffer
+static int pp_read_file(const char *path, uint8_t **data, uint32_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || (uint64_t)st.st_size > UINT32_MAX) {
+        fclose(f);
+        return -1;
+    }
+    *size = (uint32_t)st.st_size;
+    *data = (uint8_t*)malloc(*size ? *size : 1);
+    if (!*data || fread(*data, 1, *size, f) != *size) {
+        free(*data);
+        *data = NULL;
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Parse one command-line option; returns 0, or -1 after printing an error
+static int pp_parse_option(const char *arg, PP_Options *opts, int *threads) {
+    if (strcmp(arg, "--text-filter") == 0) {
+        opts->filters |= PP_FILTER_TEXT;
+    } else if (strcmp(arg, "--max") == 0) {
+        opts->level = PP_LEVEL_MAX;
+    } else if (strncmp(arg, "--strategy=", 11) == 0) {
+        int strategy = pp_strategy_from_name(arg + 11);
+        if (strategy < 0) {
+            printf("Error: Unknown strategy %s\n", arg + 11);
+            return -1;
+        }
+        opts->strategy = (uint8_t)strategy;
+    } else if (strcmp(arg, "--adaptive") == 0 || strncmp(arg, "--adaptive=", 11) == 0) {
+        int min = 1, max = 9;
+        if (arg[10] == '=' && (sscanf(arg + 11, "%d:%d", &min, &max) != 2 ||
+                               min < 1 || max > PP_LEVEL_MAX || min > max)) {
+            printf("Error: --adaptive takes min:max levels within 1-%d\n", PP_LEVEL_MAX);
+            return -1;
+        }
+        opts->adaptive_min = (uint8_t)min;
+        opts->adaptive_max = (uint8_t)max;
+    } else if (strcmp(arg, "--long") == 0 || strncmp(arg, "--long=", 7) == 0) {
+        int log = arg[6] == '=' ? atoi(arg + 7) : PP_WINDOW_LOG_MAX;
+        if (log < PP_WINDOW_LOG_MIN || log > PP_WINDOW_LOG_MAX) {
+            printf("Error: --long takes a window log within %d-%d\n", PP_WINDOW_LOG_MIN, PP_WINDOW_LOG_MAX);
+            return -1;
+        }
+        opts->window_log = (uint8_t)log;
+    } else if (strcmp(arg, "--fast") == 0 || strncmp(arg, "--fast=", 7) == 0) {
+        int fast = arg[6] == '=' ? atoi(arg + 7) : 1;
+        if (fast < 1 || fast > PP_LEVEL_FAST_MAX) {
+            printf("Error: --fast takes a value within 1-%d\n", PP_LEVEL_FAST_MAX);
+            return -1;
+        }
+        opts->level = (int8_t)-fast;
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+        *threads = atoi(arg + 10);
+        if (*threads < 1) *threads = 1;
+    } else if (arg[0] != '-') {
+        int level = atoi(arg);
+        opts->level = (level < 1) ? 1 : (level > 9) ? 9 : level;
+    } else {
+        printf("Error: Unknown option %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+// Password from --password=P or the first line of --password-file=FILE
+static char* pp_read_password(const char *arg) {
+    if (strncmp(arg, "--password=", 11) == 0) return strdup(arg + 11);
+
+    uint8_t *data = NULL;
+    uint32_t size = 0;
+    if (pp_read_file(arg + 16, &data, &size) != 0) {
+        printf("Error: Cannot read password file %s\n", arg + 16);
+        return NULL;
+    }
+    uint32_t n = 0;
+    while (n < size && data[n] != '\n' && data[n] != '\r') n++;
+    char *password = (char*)malloc(n + 1);
+    if (password) {
+        memcpy(password, data, n);
+        password[n] = '\0';
+    }
+    free(data);
+    return password;
+}
+
+// Seal a compressed buffer in the web app's password envelope, in place
+static int pp_seal_buffer(uint8_t **data, uint64_t *size, const char *password, int threads) {
+    uint64_t sealed_size = pp_envelope_bound(*size);
+    uint8_t *sealed = (uint8_t*)malloc(sealed_size);
+    if (!sealed) return PP_ERROR_INVALID;
+    int result = pp_envelope_seal(*data, *size, sealed, &sealed_size, password, 0, threads);
+    if (result != 0) {
+        free(sealed);
+        return result;
+    }
+    free(*data);
+    *data = sealed;
+    *size = sealed_size;
+    return 0;
+}
+
+// Archive subcommands: a <archive> <dir> [options], x <archive> [dest] [paths]
+static int pp_archive_main(int argc, char **argv) {
+    PP_Options opts = { 6, 0, PP_STRATEGY_AUTO, 0, 0, 0 };
+    int threads = pp_cpu_count();
+    char **names = (char**)malloc(argc * sizeof(char*));
+    int name_count = 0;
+    PP_ArchiveInfo info;
+    int result;
+
+    if (!names) return 1;
+    if (strcmp(argv[1], "a") == 0) {
+        for (int i = 4; i < argc; i++) {
+            if (pp_parse_option(argv[i], &opts, &threads) != 0) {
+                free(names);
+                return 1;
+            }
+        }
+        result = pp_archive_create(argv[2], argv[3], &opts, threads, &info);
+        if (result == 0) {
+            printf("Archived %u files in %u groups (%llu bytes)\n", info.files, info.groups,
+                   (unsigned long long)info.stored_size);
+        }
+    } else {
+        const char *dest = ".";
+        for (int i = 3; i < argc; i++) {
+            if (strncmp(argv[i], "--threads=", 10) == 0) {
+                pp_parse_option(argv[i], &opts, &threads);
+            } else if (i == 3) {
+                dest = argv[i];
+            } else {
+                names[name_count++] = argv[i];
+            }
+        }
+        if (mkdir(dest, 0777) != 0 && errno != EEXIST) {
+            result = -1;
+        } else {
+            result = pp_archive_extract(argv[2], dest, names, name_count, threads, &info);
+        }
+        if (result == 0) {
+            printf("Extracted %u files (%u groups decoded)\n", info.files, info.groups);
+        } else if (result == -4) {
+            printf("Error: Corrupt archive or unsafe path in it\n");
+        }
+    }
+
+    free(names);
+    if (result != 0) {
+        printf("Archive %s failed with code %d\n", strcmp(argv[1], "a") == 0 ? "creation" : "extraction", result);
+        return 1;
+    }
+    return 0;
+}
+
+// Integrity test: test <file.pp|archive.ppa> [--quick] [--threads=N]
+static int pp_test_main(int argc, char **argv) {
+    PP_Options opts = { 6, 0, PP_STRATEGY_AUTO, 0, 0, 0 };
+    int threads = pp_cpu_count(), quick = 0;
+    const char *dict_path = NULL;
+
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else if (strncmp(argv[i], "--dict=", 7) == 0) {
+            dict_path = argv[i] + 7;
+        } else if (strncmp(argv[i], "--threads=", 10) != 0 ||
+                   pp_parse_option(argv[i], &opts, &threads) != 0) {
+            printf("Error: Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    PP_Dict *dict = dict_path ? pp_dict_load(dict_path) : NULL;
+    if (dict_path && !dict) {
+        printf("Error: Cannot load dictionary %s\n", dict_path);
+        return 1;
+    }
+    PP_VerifyResult res;
+    int result = pp_verify_file(argv[2], dict, quick, threads, &res);
+    pp_dict_free(dict);
+
+    if (result == -1) {
+        printf("Error: Not a v5 frame or .ppa archive\n");
+        return 1;
+    }
+    if (result == -5) {
+        printf("Error: Frame needs its dictionary (--dict=FILE)\n");
+        return 1;
+    }
+    if (result != 0) {
+        printf("FAILED: block %u at offset %llu: %s (code %d)\n", res.bad_block,
+               (unsigned long long)res.bad_offset,
+               result == -3 ? "checksum mismatch" : "corrupt data", result);
+        return 1;
+    }
+    printf("OK: %u blocks, %llu bytes (%u decoded, %u by stored checksum)\n", res.blocks,
+           (unsigned long long)res.content_size, res.decoded, res.blocks - res.decoded);
+    return 0;
+}
+
+// Inventory: info <files...> prints one line per file, list <file> its
+// blocks (.pp) or files (.ppa); neither reads compressed payloads
+static int pp_info_main(int argc, char **argv) {
+    int list = strcmp(argv[1], "list") == 0;
+    int status = 0;
+
+    for (int i = 2; i < argc; i++) {
+        const char *path = argv[i];
+        uint8_t magic[4] = {0};
+        FILE *f = fopen(path, "rb");
+        size_t got = f ? fread(magic, 1, 4, f) : 0;
+        if (f) fclose(f);
+
+        if (got == 4 && memcmp(magic, "PPAR", 4) == 0) {
+            PP_ArchiveInfo arc;
+            PP_ArchiveFile *files = NULL;
+            int result = pp_archive_info(path, &arc, list ? &files : NULL);
+            if (result != 0) {
+                printf("%s: corrupt archive index (code %d)\n", path, result);
+                status = 1;
+                continue;
+            }
+            printf("%s: archive files=%u groups=%u content=%llu stored=%llu\n", path,
+                   arc.files, arc.groups,
+                   (unsigned long long)arc.content_size, (unsigned long long)arc.stored_size);
+            for (uint32_t e = 0; list && e < arc.files; e++) {
+                printf("  %04o %12llu %10llu %s\n", files[e].mode, (unsigned long long)files[e].size,
+                       (unsigned long long)files[e].mtime, files[e].path);
+            }
+            free(files);
+            continue;
+        }
+
+        PP_FrameInfo info;
+        PP_SeekEntry *entries = NULL;
+        int result = pp_frame_info(path, &info, list ? &entries : NULL);
+        if (result != 0) {
+            printf("%s: %s\n", path, result == -1 ? "not a .pp file" : "corrupt block headers");
+            status = 1;
+            continue;
+        }
+
+        char dict[16] = "none";
+        if (info.dict_id) snprintf(dict, sizeof(dict), "%08x", info.dict_id);
+        char window[16] = "block";
+        if (info.window_log) snprintf(window, sizeof(window), "%uKB", (1u << info.window_log) >> 10);
+        const char *checksum = info.version < 5 ? "sum16"
+                             : (info.flags & PP_FRAME_STORED_CHECKSUM) ? "xxh32+stored"
+                             : (info.flags & PP_FRAME_BLOCK_CHECKSUM) ? "xxh32" : "none";
+        printf("%s: v%u content=%llu stored=%llu blocks=%u level=%d strategy=%s filters=%s "
+               "type=%u dict=%s window=%s checksum=%s index=%s\n", path, info.version,
+               (unsigned long long)info.content_size, (unsigned long long)info.compressed_size,
+               info.blocks, info.level,
+               pp_strategy_name(info.strategy),
+               (info.filters & PP_FILTER_TEXT) ? "text" : "none", info.file_type, dict, window,
+               checksum, info.has_index ? "yes" : "no");
+
+        uint64_t offset = info.version < 5 ? 16 : PP_FRAME_HEADER_SIZE, out = 0;
+        for (uint32_t b = 0; list && b < info.blocks && entries; b++) {
+            printf("  block %6u  offset %12llu  raw %8u  stored %8u  out %12llu\n", b,
+                   (unsigned long long)offset, entries[b].raw_size, entries[b].span,
+                   (unsigned long long)out);
+            offset += entries[b].span;
+            out += entries[b].raw_size;
+        }
+        free(entries);
+    }
+    return status;
+}
+
+// Streaming compression, for --adaptive or an output of "-" (stdout: a pipe
+// or socket), in which case the report goes to stderr
+static int pp_stream_main(const char *input_file, const char *output_file,
+                            const PP_Options *opts, const PP_Dict *dict) {
+    int to_stdout = strcmp(output_file, "-") == 0;
+    FILE *log = to_stdout ? stderr : stdout;
+    FILE *fin = fopen(input_file, "rb");
+    struct stat st;
+    if (!fin || fstat(fileno(fin), &st) != 0 || st.st_size == 0) {
+        fprintf(log, "Error: Cannot open input file\n");
+        if (fin) fclose(fin);
+        return 1;
+    }
+    FILE *fout = to_stdout ? stdout : fopen(output_file, "wb");
+    if (!fout) {
+        fprintf(log, "Error: Cannot open output file\n");
+        fclose(fin);
+        return 1;
+    }
+
+    PP_Stats stats;
+    int result = pp_compress_stream(fin, (uint64_t)st.st_size, fout, opts, dict, &stats);
+    fclose(fin);
+    if (!to_stdout && fclose(fout) != 0) result = -1;
+    if (result != 0) {
+        fprintf(log, "Compression failed with code %d\n", result);
+        return 1;
+    }
+
+    fprintf(log, "Compressed %llu -> %llu bytes (%.2f%%), blocks per level:",
+            (unsigned long long)stats.input_size, (unsigned long long)stats.output_size,
+            100.0 * stats.output_size / stats.input_size);
+    if (!opts->adaptive_max) fprintf(log, " %d:%u", stats.level, stats.blocks);
+    for (int level = 1; opts->adaptive_max && level <= PP_LEVEL_MAX; level++) {
+        if (stats.levels[level]) fprintf(log, " %d:%u", level, stats.levels[level]);
+    }
+    fprintf(log, "\n");
+    return 0;
+}
+
+// Upgrade: upgrade <files...> [--level=N] [options] rewrites legacy .pp
+// files in place as v5 frames
+static int pp_upgrade_main(int argc, char **argv) {
+    PP_Options opts = { 6, 0, PP_STRATEGY_AUTO, 0, 0, 0 };
+    int threads = pp_cpu_count(), count = 0;
+    char **paths = (char**)malloc(argc * sizeof(char*));
+    PP_UpgradeResult *results = (PP_UpgradeResult*)calloc(argc, sizeof(PP_UpgradeResult));
+    if (!paths || !results) {
+        free(paths);
+        free(results);
+        return 1;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--level=", 8) == 0) {
+            int level = atoi(argv[i] + 8);
+            opts.level = (level < 1) ? 1 : (level > 9) ? 9 : level;
+        } else if (argv[i][0] != '-') {
+            paths[count++] = argv[i];
+        } else if (pp_parse_option(argv[i], &opts, &threads) != 0) {
+            free(paths);
+            free(results);
+            return 1;
+        }
+    }
+    if (opts.adaptive_max) {
+        printf("Error: --adaptive does not apply to upgrade\n");
+        count = 0;
+    }
+
+    int status = count ? 0 : 1;
+    uint32_t upgraded = 0;
+    uint64_t before = 0, after = 0;
+    if (count) pp_upgrade(paths, count, &opts, threads, results);
+    for (int i = 0; i < count; i++) {
+        const PP_UpgradeResult *r = &results[i];
+        if (r->result == 0 && r->from_version == 5) {
+            printf("%s: already v5\n", paths[i]);
+        } else if (r->result == 0) {
+            printf("%s: v%u -> v5, %llu -> %llu bytes\n", paths[i], r->from_version,
+                   (unsigned long long)r->old_size, (unsigned long long)r->new_size);
+            upgraded++;
+            before += r->old_size;
+            after += r->new_size;
+        } else {
+            printf("%s: %s (code %d)\n", paths[i],
+                   r->result == PP_ERROR_ENCRYPTED ? "encrypted, left as is"
+                   : r->result == -1 ? "not a .pp file or cannot be written"
+                   : r->result == -3 ? "checksum mismatch" : "corrupt data", r->result);
+            status = 1;
+        }
+    }
+    if (upgraded) {
+        printf("Upgraded %u files: %llu -> %llu bytes\n", upgraded,
+               (unsigned long long)before, (unsigned long long)after);
+    }
+    free(paths);
+    free(results);
+    return status;
+}
+
+// Service: serve <socket> [level] [--dict=FILE]... [--threads=N] [options]
+static int pp_serve_main(int argc, char **argv) {
+    PP_Options opts = { 6, 0, PP_STRATEGY_AUTO, 0, 0, 0 };
+    int threads = pp_cpu_count(), dict_count = 0, status = 0;
+    PP_Dict **dicts = (PP_Dict**)calloc(argc, sizeof(PP_Dict*));
+    if (!dicts) return 1;
+
+    for (int i = 3; i < argc && status == 0; i++) {
+        if (strncmp(argv[i], "--dict=", 7) == 0) {
+            dicts[dict_count] = pp_dict_load(argv[i] + 7);
+            if (!dicts[dict_count]) {
+                printf("Error: Cannot load dictionary %s\n", argv[i] + 7);
+                status = 1;
+            } else {
+                printf("Dictionary %s: id %08x\n", argv[i] + 7, pp_dict_id(dicts[dict_count++]));
+            }
+        } else if (pp_parse_option(argv[i], &opts, &threads) != 0) {
+            status = 1;
+        }
+    }
+
+    if (status == 0) {
+        printf("Listening on %s (%d workers)\n", argv[2], threads);
+        fflush(stdout);
+        if (pp_serve(argv[2], &opts, dicts, dict_count, threads) != 0) {
+            printf("Error: Cannot serve on %s\n", argv[2]);
+            status = 1;
+        }
+    }
+    for (int i = 0; i < dict_count; i++) pp_dict_free(dicts[i]);
+    free(dicts);
+    return status;
+}
+
+// Service client: client <socket> <compress|decompress> <in> <out> [level] [--dict=FILE]
+static int pp_client_main(int argc, char **argv) {
+    int compress = strcmp(argv[3], "compress") == 0;
+    int8_t level = 0;
+    uint32_t dict_id = 0;
+    if (!compress && strcmp(argv[3], "decompress") != 0) {
+        printf("Error: Invalid mode. Use 'compress' or 'decompress'\n");
+        return 1;
+    }
+    for (int i = 6; i < argc; i++) {
+        if (strncmp(argv[i], "--dict=", 7) == 0) {
+            PP_Dict *dict = pp_dict_load(argv[i] + 7);
+            if (!dict) {
+                printf("Error: Cannot load dictionary %s\n", argv[i] + 7);
+                return 1;
+            }
+            dict_id = pp_dict_id(dict);
+            pp_dict_free(dict);
+        } else if (argv[i][0] != '-' && atoi(argv[i]) > 0) {
+            level = (int8_t)(atoi(argv[i]) > 9 ? 9 : atoi(argv[i]));
+        } else if (strcmp(argv[i], "--max") == 0) {
+            level = PP_LEVEL_MAX;
+        } else if (strncmp(argv[i], "--fast=", 7) == 0 && atoi(argv[i] + 7) > 0) {
+            level = (int8_t)-(atoi(argv[i] + 7) > PP_LEVEL_FAST_MAX ? PP_LEVEL_FAST_MAX : atoi(argv[i] + 7));
+        } else {
+            printf("Error: Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    uint8_t *input = NULL;
+    uint32_t size = 0;
+    if (pp_read_file(argv[4], &input, &size) != 0) {
+        printf("Error: Cannot open input file\n");
+        return 1;
+    }
+    int fd = pp_serve_connect(argv[2]);
+    if (fd < 0) {
+        printf("Error: Cannot connect to %s\n", argv[2]);
+        free(input);
+        return 1;
+    }
+
+    uint8_t *reply = NULL;
+    uint32_t reply_size = 0;
+    int result = pp_serve_call(fd, compress ? PP_SERVE_OP_COMPRESS : PP_SERVE_OP_DECOMPRESS,
+                               level, dict_id, input, size, &reply, &reply_size);
+    close(fd);
+    free(input);
+
+    FILE *fout = result == 0 ? fopen(argv[5], "wb") : NULL;
+    int ok = fout && fwrite(reply, 1, reply_size, fout) == reply_size;
+    if (fout && fclose(fout) != 0) ok = 0;
+    free(reply);
+    if (!ok) {
+        printf("Request failed with code %d\n", result ? result : -1);
+        return 1;
+    }
+    return 0;
+}
+
+// Command-line interface
+int main(int argc, char **argv) {
+    if (argc >= 3 && (strcmp(argv[1], "a") == 0 || strcmp(argv[1], "x") == 0) &&
+        (argc >= 4 || argv[1][0] == 'x')) {
+        return pp_archive_main(argc, argv);
+    }
+    if (argc >= 3 && strcmp(argv[1], "test") == 0) {
+        return pp_test_main(argc, argv);
+    }
+    if (argc >= 3 && (strcmp(argv[1], "info") == 0 || strcmp(argv[1], "list") == 0)) {
+        return pp_info_main(argc, argv);
+    }
+    if (argc >= 3 && strcmp(argv[1], "upgrade") == 0) {
+        return pp_upgrade_main(argc, argv);
+    }
+    if (argc >= 3 && strcmp(argv[1], "serve") == 0) {
+        return pp_serve_main(argc, argv);
+    }
+    if (argc >= 6 && strcmp(argv[1], "client") == 0) {
+        return pp_client_main(argc, argv);
+    }
+
+    if (argc < 4) {
+        printf("Pied Piper Compression Engine v%s\n", PP_VERSION);
+        printf("Usage: %s <compress|decompress> <input> <output> [level] [options]\n", argv[0]);
+        printf("       %s a <archive.ppa> <dir> [level] [options]\n", argv[0]);
+        printf("       %s x <archive.ppa> [dest] [paths...]\n", argv[0]);
+        printf("       %s test <file.pp|archive.ppa> [--quick]\n", argv[0]);
+        printf("       %s info <files...>      (headers and index only)\n", argv[0]);
+        printf("       %s list <file.pp|archive.ppa>\n", argv[0]);
+        printf("       %s upgrade <files...> [--level=N] [options]  (v1-v4 to v5, in place)\n", argv[0]);
+        printf("       %s serve <socket> [level] [--dict=FILE]... [--threads=N]\n", argv[0]);
+        printf("       %s client <socket> <compress|decompress> <input> <output> [level]\n", argv[0]);
+        printf("  level: 1-9 (default: 6)\n");
+        printf("  output: - streams compress output to stdout, block by block\n");
+        printf("  --text-filter   tokenize JSON/CSV/log text before LZ\n");
+        printf("  --fast[=N]      levels below 1 (1-%d, default 1): skip harder as N grows,\n",
+               PP_LEVEL_FAST_MAX);
+        printf("                  literals stored raw; for RPC traffic and hot paths\n");
+        printf("  --max           context-mixing coder instead of LZ (slow, archival)\n");
+        printf("  --strategy=S    auto (default), generic, text or stored\n");
+        printf("  --adaptive[=min:max]  compress: pick each block's level (default 1:9)\n");
+        printf("                  from how fast the output drains; output may be -\n");
+        printf("  --long[=N]      compress: match across blocks over a 2^N-byte window\n");
+        printf("                  (%d-%d, default %d: 128MB); not with --adaptive or output -\n",
+               PP_WINDOW_LOG_MIN, PP_WINDOW_LOG_MAX,
+               PP_WINDOW_LOG_MAX);
+        printf("  --threads=N     compress, archive, test, upgrade and encryption threads\n");
+        printf("                  (default: all cores)\n");
+        printf("  --quick         test: check stored-byte checksums without decoding\n");
+        printf("  --dict=FILE     raw prefix dictionary (last 32KB of FILE); decompress\n");
+        printf("                  and test need the same file, serve loads several\n");
+        printf("  --password=P    compress/decompress: the web app's AES-256-GCM envelope\n");
+        printf("  --password-file=FILE  same, with the password on FILE's first line\n");
+        return 1;
+    }
+
+    const char *mode = argv[1];
+    const char *input_file = argv[2];
+    const char *output_file = argv[3];
+    PP_Options opts = { 6, 0, PP_STRATEGY_AUTO, 0, 0, 0 };
+    int threads = pp_cpu_count();
+    const char *dict_path = NULL;
+    char *password = NULL;
+
+    for (int i = 4; i < argc; i++) {
+        if (strncmp(argv[i], "--dict=", 7) == 0) {
+            dict_path = argv[i] + 7;
+        } else if (strncmp(argv[i], "--password=", 11) == 0 ||
+                   strncmp(argv[i], "--password-file=", 16) == 0) {
+            free(password);
+            password = pp_read_password(argv[i]);
+            if (!password) return 1;
+        } else if (pp_parse_option(argv[i], &opts, &threads) != 0) {
+            free(password);
+            return 1;
+        }
+    }
+
+    PP_Dict *dict = dict_path ? pp_dict_load(dict_path) : NULL;
+    if (dict_path && !dict) {
+        printf("Error: Cannot load dictionary %s\n", dict_path);
+        free(password);
+        return 1;
+    }
+    if (strcmp(mode, "compress") == 0 && (opts.adaptive_max || strcmp(output_file, "-") == 0)) {
+        int status = 1;
+        if (password) {
+            printf("Error: --adaptive and output - cannot be combined with --password\n");
+        } else if (opts.window_log) {
+            printf("Error: --adaptive and output - cannot be combined with --long\n");
+        } else {
+            status = pp_stream_main(input_file, output_file, &opts, dict);
+        }
+        pp_dict_free(dict);
+        return status;
+    }
+
+    // Read input file
+    uint8_t *input = NULL;
+    uint32_t input_size = 0;
+    if (pp_read_file(input_file, &input, &input_size) != 0) {
+        printf("Error: Cannot read input file\n");
+        pp_dict_free(dict);
+        free(password);
+        return 1;
+    }
+
+    int status = 0;
+
+    if (strcmp(mode, "compress") == 0) {
+        uint32_t output_size = pp_compress_bound(input_size);
+        uint8_t *output = (uint8_t*)malloc(output_size);
+        PP_Context *ctx = pp_context_create();
+        PP_Stats stats;
+        int result = -1;
+
+        if (ctx && output) {
+            pp_context_set_dict(ctx, dict);
+            pp_context_set_threads(ctx, threads);
+            result = pp_compress_ctx(ctx, input, input_size, output, &output_size, &opts, &stats);
+        }
+        pp_context_free(ctx);
+
+        uint64_t sealed_size = output_size;
+        if (result == 0 && password) {
+            result = pp_seal_buffer(&output, &sealed_size, password, threads);
+        }
+
+        if (result == 0) {
+            pp_print_stats(&stats);
+            if (password) {
+                printf("  Encrypted size: %llu bytes (AES-256-GCM)\n", (unsigned long long)sealed_size);
+            }
+            FILE *fout = fopen(output_file, "wb");
+            fwrite(output, 1, sealed_size, fout);
+            fclose(fout);
+            printf("Compression successful!\n");
+        } else {
+            printf("Compression failed with code %d\n", result);
+            status = 1;
+        }
+
+        free(output);
+    }
+    else if (strcmp(mode, "decompress") == 0) {
+        // The web app's files start with a flag byte: 0x00 plain, 0x02 sealed
+        if (input_size > 0 && input[0] == PP_ENVELOPE_FLAG) {
+            int64_t content = pp_envelope_content_size(input, input_size);
+            uint64_t opened_size = content > 0 ? (uint64_t)content : 0;
+            uint8_t *opened = (uint8_t*)malloc(opened_size ? opened_size : 1);
+            int result = content < 0 ? (int)content : !password ? PP_ERROR_ENCRYPTED :
+                         pp_envelope_open(input, input_size, opened, &opened_size, password, threads);
+            if (result != 0) {
+                const char *reason = result == PP_ERROR_ENCRYPTED ? "the file is encrypted (--password=P)" :
+                                     result == PP_ERROR_CHECKSUM ? "wrong password or corrupted file" :
+                                     "not a valid password envelope";
+                printf("Decompression failed: %s\n", reason);
+                free(opened);
+                free(input);
+                pp_dict_free(dict);
+                free(password);
+                return 1;
+            }
+            free(input);
+            input = opened;
+            input_size = (uint32_t)opened_size;
+        }
+        if (input_size > 1 && input[0] == 0x00 && pp_get_decompressed_size(input + 1, input_size - 1)) {
+            memmove(input, input + 1, --input_size);
+        }
+
+        uint64_t content_size = pp_get_decompressed_size(input, input_size);
+        uint32_t output_size = content_size ? (uint32_t)content_size : 1;
+        uint8_t *output = (uint8_t*)malloc(output_size);
+
+        int result = pp_decompress_dict(input, input_size, output, &output_size, dict);
+
+        if (result == 0) {
+            FILE *fout = fopen(output_file, "wb");
+            fwrite(output, 1, output_size, fout);
+            fclose(fout);
+            printf("Decompression successful!\n");
+        } else if (result == -5) {
+            printf("Decompression failed: the file needs its dictionary (--dict=FILE)\n");
+            status = 1;
+        } else {
+            printf("Decompression failed with code %d\n", result);
+            status = 1;
+        }
+
+        free(output);
+    }
+    else {
+        printf("Error: Invalid mode. Use 'compress' or 'decompress'\n");
+        free(input);
+        pp_dict_free(dict);
+        free(password);
+        return 1;
+    }
+
+    free(input);
+    pp_dict_free(dict);
+    free(password);
+    return status;
+}
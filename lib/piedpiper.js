@@ -28,7 +28,9 @@ class PiedPiperCompressor {
         this.WINDOW_SIZE = 131072;       // 128KB sliding window (Zstd-inspired)
         this.MAX_MATCH_LENGTH = 1024;    // 1KB max match (LZMA2-inspired)
         this.MIN_MATCH_LENGTH = 4;       // Optimal for modern algorithms
-        this.HASH_SIZE = 262144;         // 256K hash table (2x larger)
+        this.HASH_LOG_MIN = 10;          // Hash table bits, chosen per call from the
+        this.HASH_LOG_MAX = 18;          // input size up to the mode's hashLog
+        this.hashBits = this.HASH_LOG_MAX;
         this.MAX_CHAIN_LENGTH = 512;     // Deep search for maximum compression
         this.CHUNK_SIZE = 64 * 1024 * 1024; // 64MB chunks for parallel processing
         this.STREAM_THRESHOLD = 50 * 1024 * 1024; // 50MB streaming
@@ -39,6 +41,36 @@ class PiedPiperCompressor {
         this.MODE_BALANCED = 'balanced'; // Best balance (Zstd-inspired)
         this.MODE_WEB = 'web';           // Web optimized (Brotli-inspired)
 
+        // Match-finder limits per mode (same meaning as the C level table):
+        // depth = chain entries searched, good = best match after which only a
+        // quarter of the remaining depth is searched, target = match committed
+        // without a lazy step, nice = match that ends the search, hashLog =
+        // largest hash table in bits
+        this.MODE_PARAMS = {
+            [this.MODE_FAST]: { depth: 16, good: 8, target: 0, nice: 32, hashLog: 16 },
+            [this.MODE_BALANCED]: { depth: this.MAX_CHAIN_LENGTH, good: 32, target: 128, nice: 256, hashLog: 18 },
+            [this.MODE_WEB]: { depth: 128, good: 32, target: 128, nice: 512, hashLog: 18 },
+            [this.MODE_ULTRA]: { depth: this.MAX_CHAIN_LENGTH * 2, good: 128, target: this.MAX_MATCH_LENGTH, nice: this.MAX_MATCH_LENGTH, hashLog: this.HASH_LOG_MAX }
+        };
+
+        // Per-filetype pipeline (same strategy codes as the C engine's header
+        // byte 17): match-finder mode for levels 3-8 and for levels 9+.
+        // Already-compressed formats never pay for a deep search.
+        const generic = { code: 1, name: 'generic', mode: this.MODE_BALANCED, maxMode: this.MODE_ULTRA };
+        const text = { code: 2, name: 'text', mode: this.MODE_WEB, maxMode: this.MODE_ULTRA };
+        const stored = { code: 3, name: 'stored', mode: this.MODE_FAST, maxMode: this.MODE_FAST };
+        this.FILETYPE_STRATEGY = {
+            0: generic,   // Binary
+            1: stored,    // PNG
+            2: stored,    // JPEG
+            3: stored,    // GIF
+            4: generic,   // ZIP: may hold stored members
+            5: generic,   // PDF
+            6: stored,    // GZIP
+            7: stored,    // bzip2, xz, zstd, 7z
+            10: text
+        };
+
         this.stats = {
             inputSize: 0,
             outputSize: 0,
@@ -88,7 +120,16 @@ class PiedPiperCompressor {
         h = ((h * PRIME1) | 0);
         h ^= h >>> 16;
 
-        return (h >>> 0) & (this.HASH_SIZE - 1);
+        return (h >>> 0) & ((1 << this.hashBits) - 1);
+    }
+
+    // Hash table bits for an input: one slot per position, within
+    // [HASH_LOG_MIN, the mode's hashLog]
+    hashLog(size, mode) {
+        const limit = Math.min(this.MODE_PARAMS[mode].hashLog, this.HASH_LOG_MAX);
+        let log = this.HASH_LOG_MIN;
+        while (log < limit && (1 << log) < size) log++;
+        return log;
     }
 
     // Context hash for 2nd order modeling (Brotli-inspired)
@@ -107,7 +148,7 @@ class PiedPiperCompressor {
         // Simple multiplicative hash (faster than xxHash)
         const val = (data[pos] | (data[pos + 1] << 8) |
                     (data[pos + 2] << 16) | (data[pos + 3] << 24)) >>> 0;
-        return ((val * 2654435761) >>> 19) & (this.HASH_SIZE - 1);
+        return Math.imul(val, 2654435761) >>> (32 - this.hashBits);
     }
 
     // Optimized min-heap implementation for Huffman tree
@@ -218,9 +259,16 @@ class PiedPiperCompressor {
         // Check magic numbers
         if (data[0] === 0x89 && data[1] === 0x50 && data[2] === 0x4E && data[3] === 0x47) return 1; // PNG
         if (data[0] === 0xFF && data[1] === 0xD8 && data[2] === 0xFF) return 2; // JPEG
+        if (data[0] === 0x47 && data[1] === 0x49 && data[2] === 0x46 && data[3] === 0x38) return 3; // GIF
         if (data[0] === 0x50 && data[1] === 0x4B) return 4; // ZIP/XLSX/DOCX
         if (data[0] === 0x25 && data[1] === 0x50 && data[2] === 0x44 && data[3] === 0x46) return 5; // PDF
         if (data[0] === 0x1F && data[1] === 0x8B) return 6; // GZIP
+        if ((data[0] === 0x42 && data[1] === 0x5A && data[2] === 0x68) ||                      // bzip2
+            (data[0] === 0x28 && data[1] === 0xB5 && data[2] === 0x2F && data[3] === 0xFD) ||  // zstd
+            (data[0] === 0xFD && data[1] === 0x37 && data[2] === 0x7A && data[3] === 0x58) ||  // xz
+            (data[0] === 0x37 && data[1] === 0x7A && data[2] === 0xBC && data[3] === 0xAF)) {  // 7z
+            return 7;
+        }
 
         // Check for text
         let textChars = 0;
@@ -237,12 +285,17 @@ class PiedPiperCompressor {
         return 0; // Binary
     }
 
+    // Pipeline for a detected file type (unknown types are generic)
+    getStrategy(fileType) {
+        return this.FILETYPE_STRATEGY[fileType] || this.FILETYPE_STRATEGY[0];
+    }
+
     // Determine compression mode based on level and file type
     getCompressionMode(level, fileType) {
-        if (level >= 9) return this.MODE_ULTRA;      // Maximum compression
+        const strategy = this.getStrategy(fileType);
         if (level <= 2) return this.MODE_FAST;       // Speed priority
-        if (fileType === 10) return this.MODE_WEB;   // Text - use Brotli-style
-        return this.MODE_BALANCED;                    // Default: Zstd-style
+        if (level >= 9) return strategy.maxMode;     // Maximum compression
+        return strategy.mode;
     }
 
     // ULTRA MODE: Optimal parsing for maximum compression (LZMA2-inspired)
@@ -293,24 +346,13 @@ class PiedPiperCompressor {
             return { offset: 0, length: 0 };
         }
 
-        // Adjust search depth based on mode
-        let searchDepth;
-        switch (mode) {
-            case this.MODE_FAST:
-                searchDepth = 16;  // LZ4-style: very shallow search
-                break;
-            case this.MODE_ULTRA:
-                searchDepth = this.MAX_CHAIN_LENGTH * 2;  // LZMA2-style: deep search
-                break;
-            case this.MODE_WEB:
-                searchDepth = 128;  // Brotli-style: moderate search with context
-                break;
-            default: // MODE_BALANCED (Zstd-style)
-                searchDepth = this.MAX_CHAIN_LENGTH;
-        }
+        // Search depth and exit thresholds based on mode
+        const params = this.MODE_PARAMS[mode] || this.MODE_PARAMS[this.MODE_BALANCED];
+        const nice = Math.min(params.nice, maxMatch);
+        let good = params.good;
 
-        const searchLimit = Math.min(chain.length, searchDepth);
-        const startIdx = Math.max(0, chain.length - searchLimit);
+        const searchLimit = Math.min(chain.length, params.depth);
+        let startIdx = Math.max(0, chain.length - searchLimit);
 
         // Cache first bytes for quick rejection
         const minCheck = Math.min(4, maxMatch);
@@ -352,10 +394,12 @@ class PiedPiperCompressor {
                 bestLength = matchLen;
                 bestOffset = pos - matchPos;
 
-                // Early exit conditions based on mode
-                if (mode === this.MODE_FAST && matchLen >= 32) break;
-                if (mode === this.MODE_BALANCED && matchLen >= 256) break;
-                if (matchLen === maxMatch) break;
+                // Long enough: stop. Good enough: search a quarter of what is left
+                if (matchLen >= nice) break;
+                if (matchLen >= good) {
+                    startIdx = i - ((i - startIdx) >> 2);
+                    good = Infinity;
+                }
             }
         }
 
@@ -443,8 +487,10 @@ class PiedPiperCompressor {
 
         // Build optimized hash chains with mode-specific hashing
         this.reportProgress('hashing', 30, `Construindo índice (modo ${mode})...`);
-        const hashChains = new Array(this.HASH_SIZE);
-        for (let i = 0; i < this.HASH_SIZE; i++) {
+        // Sized to the input: small messages don't pay for a 256K-slot table
+        this.hashBits = this.hashLog(data.length, mode);
+        const hashChains = new Array(1 << this.hashBits);
+        for (let i = 0; i < hashChains.length; i++) {
             hashChains[i] = [];
         }
 
@@ -495,7 +541,7 @@ class PiedPiperCompressor {
                 // LAZY MATCHING for non-FAST modes (already done in ULTRA)
                 let useMatch = true;
                 if (mode !== this.MODE_ULTRA && mode !== this.MODE_FAST &&
-                    pos + 1 < data.length && match.length < this.MAX_MATCH_LENGTH) {
+                    pos + 1 < data.length && match.length < this.MODE_PARAMS[mode].target) {
                     const nextMatch = this.findBestMatch(data, pos + 1, null, hashChains, mode);
                     // Use next match if significantly better
                     if (nextMatch.length > match.length + 2) {
@@ -587,7 +633,7 @@ class PiedPiperCompressor {
         // v4.0 additions: store compression mode for optimal decompression
         const modeCode = { 'fast': 1, 'balanced': 2, 'web': 3, 'ultra': 4 };
         headerView.setUint8(14, modeCode[mode] || 2);  // Compression mode
-        headerView.setUint8(15, 0);  // Reserved for future use
+        headerView.setUint8(15, this.getStrategy(fileType).code);  // Strategy
 
         // Calculate checksum
         this.reportProgress('checksum', 92, 'Calculando checksum...');
@@ -949,11 +995,431 @@ class PiedPiperCompressor {
     }
 }
 
+// Node.js streams over the WASM build of the C engine (cd engine && make wasm).
+// The compressed stream is a sequence of v5 frames, one per chunk, the same
+// layout the C++ CompressBuf writes. Each stream keeps one reusable engine
+// context and fixed WASM buffers, so memory stays at about one chunk and its
+// frame; Transform backpressure pauses the writer while the reader lags.
+const PP_STREAM_CHUNK = 1024 * 1024;           // Input bytes per frame
+const PP_STREAM_MAX_FRAME = 64 * 1024 * 1024;  // Largest frame accepted on decompression
+const PP_ERROR_BUFFER = -2;
+const PP_LEVEL_FAST_MAX = 10;                  // level -N is the engine's --fast=N
+let ppWasmModule = null;
+
+// Load the Emscripten module once; `wasm` may be a loaded module or its factory
+function loadPiedPiperWasm(wasm) {
+    if (wasm && typeof wasm === 'object') return Promise.resolve(wasm);
+    if (typeof wasm === 'function') return Promise.resolve(wasm());
+    if (!ppWasmModule) {
+        ppWasmModule = new Promise((resolve) => resolve(require('./ppcompress.js')()))
+            .catch((error) => {
+                ppWasmModule = null;
+                throw new Error('WASM engine not available (cd engine && make wasm): ' + error.message);
+            });
+    }
+    return ppWasmModule;
+}
+
+// Copy a WASM region out before the heap can move or be reused
+function ppWasmRead(mod, ptr, size) {
+    return Buffer.from(mod.HEAPU8.subarray(ptr, ptr + size));
+}
+
+function createCompressStream(options = {}) {
+    const { Transform } = require('stream');
+    const level = options.level === 'max' ? 10
+                : Math.min(9, Math.max(-PP_LEVEL_FAST_MAX, options.level || 6));
+    const chunkSize = options.chunkSize || PP_STREAM_CHUNK;
+    let mod = null;
+    let ctx = 0, inPtr = 0, outPtr = 0, outCap = 0, optsPtr = 0, sizePtr = 0;
+    let pending = 0;
+
+    const release = () => {
+        if (!mod) return;
+        if (ctx) mod._pp_context_free(ctx);
+        [inPtr, outPtr, optsPtr, sizePtr].forEach((ptr) => ptr && mod._free(ptr));
+        ctx = inPtr = outPtr = optsPtr = sizePtr = 0;
+    };
+
+    const setup = () => loadPiedPiperWasm(options.wasm).then((loaded) => {
+        if (ctx) return;
+        mod = loaded;
+        ctx = mod._pp_context_create();
+        outCap = mod._pp_compress_bound(chunkSize);
+        inPtr = mod._malloc(chunkSize);
+        outPtr = mod._malloc(outCap);
+        optsPtr = mod._malloc(12);  // PP_Options: level, filters, strategy, adaptive range, window log
+        sizePtr = mod._malloc(4);
+        if (!ctx || !inPtr || !outPtr || !optsPtr || !sizePtr) throw new Error('Out of WASM memory');
+        mod.HEAPU8.fill(0, optsPtr, optsPtr + 12);
+        mod.HEAPU8[optsPtr] = level & 0xFF;  // int8_t
+        mod.HEAPU8[optsPtr + 8] = options.strategy || 0;
+        mod.HEAPU8[optsPtr + 11] = options.windowLog || 0;
+    });
+
+    // Compress the buffered chunk into one frame and pass it on
+    const emit = (stream) => {
+        if (pending === 0) return;
+        mod.HEAPU32[sizePtr >> 2] = outCap;
+        const result = mod._pp_compress_ctx(ctx, inPtr, pending, outPtr, sizePtr, optsPtr, 0);
+        if (result !== 0) throw new Error('Compression failed with code ' + result);
+        pending = 0;
+        stream.push(ppWasmRead(mod, outPtr, mod.HEAPU32[sizePtr >> 2]));
+    };
+
+    return new Transform({
+        transform(chunk, encoding, callback) {
+            setup().then(() => {
+                for (let pos = 0; pos < chunk.length; ) {
+                    const n = Math.min(chunk.length - pos, chunkSize - pending);
+                    mod.HEAPU8.set(chunk.subarray(pos, pos + n), inPtr + pending);
+                    pending += n;
+                    pos += n;
+                    if (pending === chunkSize) emit(this);
+                }
+                callback();
+            }).catch(callback);
+        },
+        flush(callback) {
+            setup().then(() => {
+                emit(this);
+                release();
+                callback();
+            }).catch(callback);
+        },
+        destroy(error, callback) {
+            release();
+            callback(error);
+        }
+    });
+}
+
+function createDecompressStream(options = {}) {
+    const { Transform } = require('stream');
+    const maxFrame = options.maxFrameSize || PP_STREAM_MAX_FRAME;
+    let mod = null;
+    let dec = 0, inPtr = 0, inCap = 0, outPtr = 0, outCap = 0, sizePtr = 0;
+    let buffered = 0;
+    let want = 1;   // Input bytes to gather before the next drain
+
+    const release = () => {
+        if (!mod) return;
+        if (dec) mod._pp_decoder_free(dec);
+        [inPtr, outPtr, sizePtr].forEach((ptr) => ptr && mod._free(ptr));
+        dec = inPtr = outPtr = sizePtr = 0;
+    };
+
+    const setup = () => loadPiedPiperWasm(options.wasm).then((loaded) => {
+        if (dec) return;
+        mod = loaded;
+        dec = mod._pp_decoder_create();
+        sizePtr = mod._malloc(8);
+        outCap = 65536;
+        outPtr = mod._malloc(outCap);
+        if (!dec || !sizePtr || !outPtr) throw new Error('Out of WASM memory');
+    });
+
+    // Grow a WASM buffer to at least `size` bytes, keeping `keep` bytes of it
+    const grow = (ptr, cap, size, keep) => {
+        if (size > maxFrame) throw new Error('Frame larger than maxFrameSize');
+        if (size <= cap) return [ptr, cap];
+        const newCap = Math.min(maxFrame, Math.max(size, cap * 2, 65536));
+        const newPtr = mod._malloc(newCap);
+        if (!newPtr) throw new Error('Out of WASM memory');
+        if (keep) mod.HEAPU8.copyWithin(newPtr, ptr, ptr + keep);
+        if (ptr) mod._free(ptr);
+        return [newPtr, newCap];
+    };
+
+    // Decode every complete frame at the start of the input buffer, then
+    // note how much of the next frame is needed to go further
+    const drain = (stream) => {
+        for (;;) {
+            const result = mod._pp_frame_size(inPtr, buffered, sizePtr);
+            const heap = mod.HEAPU32;
+            const need = heap[sizePtr >> 2] + heap[(sizePtr >> 2) + 1] * 0x100000000;
+            if (result !== 0 && result !== PP_ERROR_BUFFER) {
+                throw new Error('Not a Pied Piper stream (code ' + result + ')');
+            }
+            if (result !== 0 || need > buffered) {
+                [inPtr, inCap] = grow(inPtr, inCap, need, buffered);
+                want = need;
+                return;
+            }
+
+            // Decode, growing the output to the size the decoder asks for
+            let code = PP_ERROR_BUFFER;
+            while (code === PP_ERROR_BUFFER) {
+                mod.HEAPU32[sizePtr >> 2] = outCap;
+                code = mod._pp_decompress_ctx(dec, inPtr, need, outPtr, sizePtr);
+                if (code === PP_ERROR_BUFFER) {
+                    [outPtr, outCap] = grow(outPtr, outCap, mod.HEAPU32[sizePtr >> 2], 0);
+                }
+            }
+            if (code !== 0) throw new Error('Decompression failed with code ' + code);
+            const produced = mod.HEAPU32[sizePtr >> 2];
+            if (produced) stream.push(ppWasmRead(mod, outPtr, produced));
+
+            mod.HEAPU8.copyWithin(inPtr, inPtr + need, inPtr + buffered);
+            buffered -= need;
+        }
+    };
+
+    return new Transform({
+        transform(chunk, encoding, callback) {
+            setup().then(() => {
+                // Copy no further than the frame being assembled, so a chunk
+                // of many frames never needs more than one frame of buffer
+                for (let pos = 0; pos < chunk.length; ) {
+                    const n = Math.min(chunk.length - pos, want - buffered);
+                    [inPtr, inCap] = grow(inPtr, inCap, buffered + n, buffered);
+                    mod.HEAPU8.set(chunk.subarray(pos, pos + n), inPtr + buffered);
+                    buffered += n;
+                    pos += n;
+                    if (buffered === want) drain(this);
+                }
+                callback();
+            }).catch(callback);
+        },
+        flush(callback) {
+            setup().then(() => {
+                const truncated = buffered > 0;
+                release();
+                callback(truncated ? new Error('Truncated Pied Piper stream') : null);
+            }).catch(callback);
+        },
+        destroy(error, callback) {
+            release();
+            callback(error);
+        }
+    });
+}
+
+// Password envelope (script.js flag byte 0x02). The .pp bytes are cut into
+// fixed-size segments, each sealed with AES-256-GCM under a key derived
+// from the password with PBKDF2-HMAC-SHA256. The 12-byte nonce is a random
+// 7-byte prefix, the segment index (u32 big-endian) and a final-segment
+// byte, so segments cannot be reordered, dropped or truncated unnoticed.
+// Every segment authenticates the 32-byte header as associated data:
+//   0      0x02 (flag byte)
+//   1      envelope version (1)
+//   2      KDF (1 = PBKDF2-HMAC-SHA256)
+//   3      log2 of the segment size
+//   4-7    PBKDF2 iterations (u32 LE)
+//   8-23   salt
+//   24-30  nonce prefix
+//   31     reserved (0)
+// then each segment's ciphertext followed by its 16-byte tag. Segments are
+// independent, so they are sealed and opened several at a time.
+const PP_ENVELOPE_FLAG = 0x02;
+const PP_ENVELOPE_HEADER = 32;
+const PP_ENVELOPE_TAG = 16;
+const PP_ENVELOPE_SEGMENT_LOG = 18;       // 256KB, the engine's block size
+const PP_ENVELOPE_ITERATIONS = 600000;
+const PP_ENVELOPE_MAX_ITERATIONS = 10000000;
+const PP_ENVELOPE_PARALLEL = 8;           // Segments in flight
+
+function ppWebCrypto() {
+    if (typeof crypto !== 'undefined' && crypto.subtle) return crypto;
+    if (typeof require === 'function') return require('crypto').webcrypto;
+    throw new Error('WebCrypto not available (a secure context is required)');
+}
+
+function ppEnvelopeHeader(options = {}) {
+    const header = new Uint8Array(PP_ENVELOPE_HEADER);
+    const iterations = options.iterations || PP_ENVELOPE_ITERATIONS;
+    header[0] = PP_ENVELOPE_FLAG;
+    header[1] = 1;
+    header[2] = 1;
+    header[3] = options.segmentLog || PP_ENVELOPE_SEGMENT_LOG;
+    new DataView(header.buffer).setUint32(4, iterations, true);
+    ppWebCrypto().getRandomValues(header.subarray(8, 31));
+    return header;
+}
+
+// Check an envelope header; returns the segment size
+function ppEnvelopeCheck(header) {
+    if (header.length < PP_ENVELOPE_HEADER || header[0] !== PP_ENVELOPE_FLAG) {
+        throw new Error('Not a Pied Piper password envelope');
+    }
+    const iterations = new DataView(header.buffer, header.byteOffset, 8).getUint32(4, true);
+    if (header[1] !== 1 || header[2] !== 1 || header[3] < 12 || header[3] > 24 ||
+        iterations === 0 || iterations > PP_ENVELOPE_MAX_ITERATIONS) {
+        throw new Error('Unsupported envelope version or parameters');
+    }
+    return 1 << header[3];
+}
+
+async function ppEnvelopeKey(password, header, usage) {
+    const subtle = ppWebCrypto().subtle;
+    const base = await subtle.importKey('raw', new TextEncoder().encode(password),
+        'PBKDF2', false, ['deriveKey']);
+    const iterations = new DataView(header.buffer, header.byteOffset, 8).getUint32(4, true);
+    return subtle.deriveKey(
+        { name: 'PBKDF2', hash: 'SHA-256', salt: header.slice(8, 24), iterations },
+        base, { name: 'AES-GCM', length: 256 }, false, [usage]);
+}
+
+function ppEnvelopeNonce(header, index, last) {
+    const nonce = new Uint8Array(12);
+    nonce.set(header.subarray(24, 31));
+    new DataView(nonce.buffer).setUint32(7, index, false);
+    nonce[11] = last ? 1 : 0;
+    return nonce;
+}
+
+// Seal or open segments [first, first + parts.length) several at a time
+async function ppEnvelopeRun(key, header, parts, first, lastIndex, encrypt) {
+    const subtle = ppWebCrypto().subtle;
+    const aad = header.slice(0, PP_ENVELOPE_HEADER);
+    const out = new Array(parts.length);
+    for (let i = 0; i < parts.length; i += PP_ENVELOPE_PARALLEL) {
+        const batch = parts.slice(i, i + PP_ENVELOPE_PARALLEL).map((part, j) => {
+            const index = first + i + j;
+            const params = { name: 'AES-GCM', iv: ppEnvelopeNonce(header, index, index === lastIndex),
+                             additionalData: aad, tagLength: 128 };
+            return (encrypt ? subtle.encrypt(params, key, part) : subtle.decrypt(params, key, part))
+                .then((result) => { out[i + j] = new Uint8Array(result); });
+        });
+        try {
+            await Promise.all(batch);
+        } catch (error) {
+            throw new Error('Wrong password or corrupted file');
+        }
+    }
+    return out;
+}
+
+// Encrypt a whole buffer; the result starts with the flag byte
+async function encryptEnvelope(data, password, options = {}) {
+    const header = ppEnvelopeHeader(options);
+    const segment = ppEnvelopeCheck(header);
+    const count = Math.max(1, Math.ceil(data.length / segment));
+    const key = await ppEnvelopeKey(password, header, 'encrypt');
+
+    const parts = [];
+    for (let i = 0; i < count; i++) parts.push(data.subarray(i * segment, (i + 1) * segment));
+    const sealed = await ppEnvelopeRun(key, header, parts, 0, count - 1, true);
+
+    const output = new Uint8Array(PP_ENVELOPE_HEADER + data.length + count * PP_ENVELOPE_TAG);
+    output.set(header);
+    let pos = PP_ENVELOPE_HEADER;
+    for (const part of sealed) {
+        output.set(part, pos);
+        pos += part.length;
+    }
+    return output;
+}
+
+// Decrypt a whole envelope (flag byte included) back to the .pp bytes
+async function decryptEnvelope(data, password) {
+    const header = data.subarray(0, PP_ENVELOPE_HEADER);
+    const segment = ppEnvelopeCheck(header);
+    const body = data.length - PP_ENVELOPE_HEADER;
+    const count = Math.max(1, Math.ceil(body / (segment + PP_ENVELOPE_TAG)));
+    if (body < count * PP_ENVELOPE_TAG) throw new Error('Truncated envelope');
+    const key = await ppEnvelopeKey(password, header, 'decrypt');
+
+    const parts = [];
+    for (let i = 0; i < count; i++) {
+        const start = PP_ENVELOPE_HEADER + i * (segment + PP_ENVELOPE_TAG);
+        parts.push(data.subarray(start, Math.min(data.length, start + segment + PP_ENVELOPE_TAG)));
+    }
+    const opened = await ppEnvelopeRun(key, header, parts, 0, count - 1, false);
+
+    const output = new Uint8Array(body - count * PP_ENVELOPE_TAG);
+    let pos = 0;
+    for (const part of opened) {
+        output.set(part, pos);
+        pos += part.length;
+    }
+    return output;
+}
+
+// Node.js Transform streams over the same envelope. The newest segment is
+// held back until more input or the end arrives, as only then is it known
+// whether it is the final one.
+function createEnvelopeStream(password, options, encrypt) {
+    const { Transform } = require('stream');
+    let header = encrypt ? ppEnvelopeHeader(options) : null;
+    let segment = encrypt ? ppEnvelopeCheck(header) : 0;
+    let key = null, index = 0, pending = Buffer.alloc(0);
+
+    const start = (stream) => {
+        if (key) return key;
+        if (encrypt) stream.push(Buffer.from(header));
+        key = ppEnvelopeKey(password, header, encrypt ? 'encrypt' : 'decrypt');
+        return key;
+    };
+
+    // Process every full segment that is certainly not the last
+    const run = async (stream, final) => {
+        if (!header) {
+            if (pending.length < PP_ENVELOPE_HEADER) {
+                if (final) throw new Error('Truncated envelope');
+                return;
+            }
+            header = new Uint8Array(pending.subarray(0, PP_ENVELOPE_HEADER));
+            segment = ppEnvelopeCheck(header);
+            pending = pending.subarray(PP_ENVELOPE_HEADER);
+        }
+        const size = encrypt ? segment : segment + PP_ENVELOPE_TAG;
+        const k = await start(stream);
+
+        let full = Math.floor(pending.length / size);
+        if (full > 0 && full * size === pending.length) full--;
+        const parts = [];
+        for (let i = 0; i < full; i++) parts.push(pending.subarray(i * size, (i + 1) * size));
+        if (final) {
+            const rest = pending.subarray(full * size);
+            if (!encrypt && rest.length < PP_ENVELOPE_TAG) throw new Error('Truncated envelope');
+            parts.push(rest);
+        }
+        if (parts.length === 0) return;
+
+        const lastIndex = final ? index + parts.length - 1 : -1;
+        const done = await ppEnvelopeRun(k, header, parts, index, lastIndex, encrypt);
+        index += parts.length;
+        pending = Buffer.from(pending.subarray(full * size));
+        if (final) pending = Buffer.alloc(0);
+        for (const part of done) if (part.length) stream.push(Buffer.from(part));
+    };
+
+    return new Transform({
+        transform(chunk, encoding, callback) {
+            pending = Buffer.concat([pending, chunk]);
+            run(this, false).then(() => callback(), callback);
+        },
+        flush(callback) {
+            run(this, true).then(() => callback(), callback);
+        }
+    });
+}
+
+function createEncryptStream(options = {}) {
+    if (!options.password) throw new Error('createEncryptStream needs a password');
+    return createEnvelopeStream(options.password, options, true);
+}
+
+function createDecryptStream(options = {}) {
+    if (!options.password) throw new Error('createDecryptStream needs a password');
+    return createEnvelopeStream(options.password, options, false);
+}
+
 // Export for different module systems
 if (typeof module !== 'undefined' && module.exports) {
     module.exports = PiedPiperCompressor;
+    module.exports.loadWasm = loadPiedPiperWasm;
+    module.exports.createCompressStream = createCompressStream;
+    module.exports.createDecompressStream = createDecompressStream;
+    module.exports.encryptEnvelope = encryptEnvelope;
+    module.exports.decryptEnvelope = decryptEnvelope;
+    module.exports.createEncryptStream = createEncryptStream;
+    module.exports.createDecryptStream = createDecryptStream;
 }
 
 if (typeof window !== 'undefined') {
     window.PiedPiperCompressor = PiedPiperCompressor;
+    PiedPiperCompressor.encryptEnvelope = encryptEnvelope;
+    PiedPiperCompressor.decryptEnvelope = decryptEnvelope;
 }
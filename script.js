@@ -25,6 +25,28 @@ function getCompressionWorker() {
     return compressionWorker;
 }
 
+// CryptoJS is only needed to open files encrypted before the AES-GCM
+// envelope (flag 0x01), so it is loaded on first use
+const CRYPTOJS_URL = 'https://cdn.jsdelivr.net/npm/crypto-js@4.2.0/crypto-js.min.js';
+let cryptoJSLoading = null;
+
+function loadCryptoJS() {
+    if (typeof CryptoJS !== 'undefined') return Promise.resolve();
+    if (!cryptoJSLoading) {
+        cryptoJSLoading = new Promise((resolve, reject) => {
+            const script = document.createElement('script');
+            script.src = CRYPTOJS_URL;
+            script.onload = () => resolve();
+            script.onerror = () => {
+                cryptoJSLoading = null;
+                reject(new Error('CryptoJS unavailable'));
+            };
+            document.head.appendChild(script);
+        });
+    }
+    return cryptoJSLoading;
+}
+
 // Compress using Web Worker (for large files)
 function compressWithWorker(data, level) {
     return new Promise((resolve, reject) => {
@@ -295,15 +317,9 @@ document.getElementById('btn-compress').addEventListener('click', async () => {
         let finalData = compressed;
 
         if (usePassword && password) {
-            // Encrypt with AES-256
-            const wordArray = CryptoJS.lib.WordArray.create(compressed);
-            const encrypted = CryptoJS.AES.encrypt(wordArray, password).toString();
-            const encryptedBytes = new TextEncoder().encode(encrypted);
-
-            // Add encryption flag to header
-            finalData = new Uint8Array(1 + encryptedBytes.length);
-            finalData[0] = 0x01; // Encrypted flag
-            finalData.set(encryptedBytes, 1);
+            // AES-256-GCM envelope, sealed per segment (flag byte 0x02 included)
+            updateProgress({ stage: 'encrypt', percent: 100, message: 'Criptografando...' });
+            finalData = await PiedPiperCompressor.encryptEnvelope(compressed, password);
         } else {
             // Add no-encryption flag
             const temp = new Uint8Array(1 + compressed.length);
@@ -411,23 +427,33 @@ document.getElementById('btn-decompress').addEventListener('click', async () =>
         let data = new Uint8Array(arrayBuffer);
         const compressedSize = data.length;
 
-        // Check encryption flag
+        // Check encryption flag: 0x00 plain, 0x01 CryptoJS (older files),
+        // 0x02 AES-GCM envelope
         const encryptedFlag = data[0];
-        data = data.slice(1);
+        const usePassword = document.getElementById('use-pass-decompress').checked;
+        const password = document.getElementById('pass-decompress').value;
 
-        if (encryptedFlag === 0x01) {
-            // Decrypt with password
-            const usePassword = document.getElementById('use-pass-decompress').checked;
-            const password = document.getElementById('pass-decompress').value;
+        if (encryptedFlag !== 0x00 && (!usePassword || !password)) {
+            showResult('🔒 Este arquivo está protegido por senha. Por favor, marque a opção e digite a senha.', 'error');
+            button.disabled = false;
+            button.innerHTML = originalText;
+            return;
+        }
 
-            if (!usePassword || !password) {
-                showResult('🔒 Este arquivo está protegido por senha. Por favor, marque a opção e digite a senha.', 'error');
+        if (encryptedFlag === 0x02) {
+            try {
+                updateProgress({ stage: 'decrypt', percent: 0, message: 'Descriptografando...' });
+                data = await PiedPiperCompressor.decryptEnvelope(data, password);
+            } catch (error) {
+                showResult('❌ Senha incorreta ou arquivo corrompido', 'error');
                 button.disabled = false;
                 button.innerHTML = originalText;
                 return;
             }
-
+        } else if (encryptedFlag === 0x01) {
+            data = data.slice(1);
             try {
+                await loadCryptoJS();
                 const encryptedStr = new TextDecoder().decode(data);
                 const decrypted = CryptoJS.AES.decrypt(encryptedStr, password);
 
@@ -447,6 +473,8 @@ document.getElementById('btn-decompress').addEventListener('click', async () =>
                 button.innerHTML = originalText;
                 return;
             }
+        } else {
+            data = data.slice(1);
         }
 
         // Use worker for large files, main thread for small files